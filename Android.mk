@@ -10,6 +10,13 @@ commands_recovery_local_path := $(LOCAL_PATH)
 LOCAL_SRC_FILES := \
 	extendedcommands.c \
 	nandroid.c \
+	blockcopy.c \
+	blockcopy_dedup.c \
+	blockcopy_gzip.c \
+	blockcopy_sparse.c \
+	blockcopy_tar.c \
+	tarmanifest.c \
+	md5.c \
 	legacy.c \
 	commands.c \
 	recovery.c \
@@ -42,6 +49,8 @@ LOCAL_SRC_FILES += test_roots.c
 
 LOCAL_MODULE := recovery
 
+LOCAL_C_INCLUDES += external/zlib
+
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 RECOVERY_VERSION := Samdroid.Net Recovery v0.1.3.b6
@@ -140,6 +149,18 @@ ifdef BOARD_HAS_SMALL_RECOVERY
   LOCAL_CFLAGS += -DBOARD_HAS_SMALL_RECOVERY
 endif
 
+ifdef BOARD_NANDROID_CHUNK_SIZE
+  LOCAL_CFLAGS += -DBLOCKCOPY_CHUNK_SIZE=$(BOARD_NANDROID_CHUNK_SIZE)
+endif
+
+ifdef BOARD_NANDROID_GZIP_LEVEL
+  LOCAL_CFLAGS += -DBLOCKCOPY_GZIP_LEVEL=$(BOARD_NANDROID_GZIP_LEVEL)
+endif
+
+ifdef BOARD_NANDROID_JOBS
+  LOCAL_CFLAGS += -DNANDROID_JOBS=$(BOARD_NANDROID_JOBS)
+endif
+
 # This binary is in the recovery ramdisk, which is otherwise a copy of root.
 # It gets copied there in config/Makefile.  LOCAL_MODULE_TAGS suppresses
 # a (redundant) copy of the binary in /system/bin for user builds.
@@ -155,7 +176,7 @@ else
 endif
 LOCAL_STATIC_LIBRARIES += libbusybox libclearsilverregex libmkyaffs2image libunyaffs liberase_image libdump_image libflash_image libmtdutils
 LOCAL_STATIC_LIBRARIES += libamend
-LOCAL_STATIC_LIBRARIES += libminzip libunz libmtdutils libmmcutils libmincrypt
+LOCAL_STATIC_LIBRARIES += libminzip libunz libmtdutils libmmcutils libdigestutils libmincrypt libz
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc
 
@@ -186,14 +207,6 @@ $(SYMLINKS): $(LOCAL_INSTALLED_MODULE)
 
 ALL_DEFAULT_INSTALLED_MODULES += $(SYMLINKS)
 
-include $(CLEAR_VARS)
-LOCAL_MODULE := nandroid-md5.sh
-LOCAL_MODULE_TAGS := eng
-LOCAL_MODULE_CLASS := RECOVERY_EXECUTABLES
-LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/sbin
-LOCAL_SRC_FILES := nandroid-md5.sh
-include $(BUILD_PREBUILT)
-
 include $(CLEAR_VARS)
 LOCAL_MODULE := killrecovery.sh
 LOCAL_MODULE_TAGS := eng
@@ -212,13 +225,14 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 LOCAL_MODULE_TAGS := tests
 
-LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
+LOCAL_STATIC_LIBRARIES := libdigestutils libmincrypt libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
 
 include $(commands_recovery_local_path)/amend/Android.mk
 include $(commands_recovery_local_path)/bmlutils/Android.mk
+include $(commands_recovery_local_path)/digestutils/Android.mk
 include $(commands_recovery_local_path)/minui/Android.mk
 include $(commands_recovery_local_path)/minzip/Android.mk
 include $(commands_recovery_local_path)/mtdutils/Android.mk
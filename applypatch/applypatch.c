@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
@@ -41,6 +42,7 @@ static int mtd_partitions_scanned = 0;
 // *file.  Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" means to load the
     // contents of an MTD partition.
@@ -74,10 +76,63 @@ int LoadFileContents(const char* filename, FileContents* file) {
     }
     fclose(f);
 
-    SHA(file->data, file->size, file->sha1);
+    digest_sha1(file->data, file->size, file->sha1);
     return 0;
 }
 
+// Map a regular file read-only and hash it in place, so large sources
+// don't have to be copied into anonymous memory.  MTD partitions, empty
+// files and anything mmap() refuses go through LoadFileContents();
+// file->mapped says which happened.
+int MapFileContents(const char* filename, FileContents* file) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0) {
+        return LoadMTDContents(filename, file);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &file->st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(file->st.st_mode) || file->st.st_size == 0) {
+        close(fd);
+        return LoadFileContents(filename, file);
+    }
+
+    file->size = file->st.st_size;
+    void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("failed to map \"%s\" (%s); reading it instead\n",
+               filename, strerror(errno));
+        return LoadFileContents(filename, file);
+    }
+    madvise(data, file->size, MADV_SEQUENTIAL);
+
+    file->data = data;
+    file->mapped = 1;
+    digest_sha1(file->data, file->size, file->sha1);
+    return 0;
+}
+
+void ReleaseFileContents(FileContents* file) {
+    if (file->mapped) {
+        munmap(file->data, file->size);
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -94,7 +149,7 @@ static int compare_size_indices(const void* a, const void* b) {
 }
 
 void FreeFileContents(FileContents* file) {
-    if (file) free(file->data);
+    if (file) ReleaseFileContents(file);
     free(file);
 }
 
@@ -175,8 +230,8 @@ int LoadMTDContents(const char* filename, FileContents* file) {
         return -1;
     }
 
-    SHA_CTX sha_ctx;
-    SHA_init(&sha_ctx);
+    DigestSha1 sha_ctx;
+    digest_sha1_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
     // allocate enough memory to hold the largest size.
@@ -199,15 +254,15 @@ int LoadMTDContents(const char* filename, FileContents* file) {
                 file->data = NULL;
                 return -1;
             }
-            SHA_update(&sha_ctx, p, read);
+            digest_sha1_update(&sha_ctx, p, read);
             file->size += read;
         }
 
         // Duplicate the SHA context and finalize the duplicate so we can
         // check it against this pair's expected hash.
-        SHA_CTX temp_ctx;
-        memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
-        const uint8_t* sha_so_far = SHA_final(&temp_ctx);
+        DigestSha1 temp_ctx;
+        memcpy(&temp_ctx, &sha_ctx, sizeof(DigestSha1));
+        const uint8_t* sha_so_far = digest_sha1_final(&temp_ctx);
 
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
@@ -240,7 +295,7 @@ int LoadMTDContents(const char* filename, FileContents* file) {
         return -1;
     }
 
-    const uint8_t* sha_final = SHA_final(&sha_ctx);
+    const uint8_t* sha_final = digest_sha1_final(&sha_ctx);
     for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
         file->sha1[i] = sha_final[i];
     }
@@ -404,18 +459,19 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.mapped = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
-    // LoadFileContents is successful.  (Useful for reading MTD
+    // MapFileContents is successful.  (Useful for reading MTD
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    if (LoadFileContents(filename, &file) != 0 ||
+    if (MapFileContents(filename, &file) != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
+        ReleaseFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -423,19 +479,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            ReleaseFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    ReleaseFileContents(&file);
     return 0;
 }
 
@@ -544,17 +600,20 @@ int applypatch(const char* source_filename,
 
     FileContents copy_file;
     FileContents source_file;
+    copy_file.data = NULL;
+    copy_file.mapped = 0;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
     int made_copy = 0;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file) == 0) {
+    if (MapFileContents(target_filename, &source_file) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
+            ReleaseFileContents(&source_file);
             return 0;
         }
     }
@@ -564,8 +623,8 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        LoadFileContents(source_filename, &source_file);
+        ReleaseFileContents(&source_file);
+        MapFileContents(source_filename, &source_file);
     }
 
     if (source_file.data != NULL) {
@@ -577,10 +636,10 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
+        ReleaseFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file) < 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
@@ -600,7 +659,7 @@ int applypatch(const char* source_filename,
     }
 
     int retry = 1;
-    SHA_CTX ctx;
+    DigestSha1 ctx;
     int output;
     MemorySinkInfo msi;
     FileContents* source_to_use;
@@ -635,7 +694,10 @@ int applypatch(const char* source_filename,
                 printf("not enough free space on /cache\n");
                 return 1;
             }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+            // If we're patching from the copy it's already there (and
+            // mapped, so it mustn't be rewritten underneath us).
+            if (source_patch_value != NULL &&
+                SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
                 printf("failed to back up source file\n");
                 return 1;
             }
@@ -655,7 +717,7 @@ int applypatch(const char* source_filename,
                 retry = 0;
             }
 
-            if (!enough_space && source_patch_value != NULL) {
+            if (!enough_space && source_patch_value != NULL && !made_copy) {
                 // Using the original source, but not enough free space.  First
                 // copy the source file to cache, then delete it from the original
                 // location.
@@ -680,6 +742,21 @@ int applypatch(const char* source_filename,
                 made_copy = 1;
                 unlink(source_filename);
 
+                if (source_file.mapped) {
+                    // Our mapping would keep the unlinked source's blocks
+                    // allocated; patch from the copy instead.
+                    struct stat st = source_file.st;
+                    uint8_t sha1[SHA_DIGEST_SIZE];
+                    memcpy(sha1, source_file.sha1, SHA_DIGEST_SIZE);
+                    ReleaseFileContents(&source_file);
+                    if (MapFileContents(CACHE_TEMP_SOURCE, &source_file) != 0 ||
+                        memcmp(source_file.sha1, sha1, SHA_DIGEST_SIZE) != 0) {
+                        printf("failed to reload source from copy\n");
+                        return 1;
+                    }
+                    source_file.st = st;
+                }
+
                 size_t free_space = FreeSpaceForFile(target_fs);
                 printf("(now %ld bytes free for target)\n", (long)free_space);
             }
@@ -734,7 +811,7 @@ int applypatch(const char* source_filename,
         char* header = patch->data;
         ssize_t header_bytes_read = patch->size;
 
-        SHA_init(&ctx);
+        digest_sha1_init(&ctx);
 
         int result;
 
@@ -772,7 +849,7 @@ int applypatch(const char* source_filename,
         }
     } while (retry-- > 0);
 
-    const uint8_t* current_target_sha1 = SHA_final(&ctx);
+    const uint8_t* current_target_sha1 = digest_sha1_final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
         return 1;
@@ -806,6 +883,9 @@ int applypatch(const char* source_filename,
         }
     }
 
+    ReleaseFileContents(&source_file);
+    ReleaseFileContents(&copy_file);
+
     // If this run of applypatch created the copy, and we're here, we
     // can delete it.
     if (made_copy) unlink(CACHE_TEMP_SOURCE);
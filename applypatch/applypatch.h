@@ -19,6 +19,7 @@
 
 #include <sys/stat.h>
 #include "mincrypt/sha.h"
+#include "digestutils/digest.h"
 #include "edify/expr.h"
 
 typedef struct _Patch {
@@ -31,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;  // data is a read-only mmap() rather than malloc()'d
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -62,13 +64,32 @@ int applypatch_check(const char* filename,
 // Read a file into memory; store it and its associated metadata in
 // *file.  Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file);
+// Like LoadFileContents(), but map a regular file read-only instead of
+// copying it.  MTD partitions are still read into memory.
+int MapFileContents(const char* filename, FileContents* file);
+// Free or unmap the data of a loaded or mapped file.
+void ReleaseFileContents(FileContents* file);
 void FreeFileContents(FileContents* file);
 
+// Most memory ApplyBSDiffPatch may use for its three bzip2 decoders and
+// the output window it hands to the sink.  If the decoders would leave
+// less than BSPATCH_MIN_WINDOW they are run in bzip2's slower small-memory
+// mode; the window never grows past BSPATCH_MAX_WINDOW.
+#ifndef BSPATCH_MEMORY_BUDGET
+#define BSPATCH_MEMORY_BUDGET (16 * 1024 * 1024)
+#endif
+#ifndef BSPATCH_MIN_WINDOW
+#define BSPATCH_MIN_WINDOW (64 * 1024)
+#endif
+#ifndef BSPATCH_MAX_WINDOW
+#define BSPATCH_MAX_WINDOW (1024 * 1024)
+#endif
+
 // bsdiff.c
 void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx);
+                     SinkFn sink, void* token, DigestSha1* ctx);
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
@@ -76,7 +97,7 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx);
+                    SinkFn sink, void* token, DigestSha1* ctx);
 
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
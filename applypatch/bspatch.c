@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <bzlib.h>
@@ -92,161 +93,264 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
         }
         if (stream->avail_out > 0) {
             printf("need %d more bytes\n", stream->avail_out);
+            if (bzerr == BZ_STREAM_END) return -1;
         }
     }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+// Patch data format:
+//   0       8       "BSDIFF40"
+//   8       8       X
+//   16      8       Y
+//   24      8       sizeof(newfile)
+//   32      X       bzip2(control block)
+//   32+X    Y       bzip2(diff block)
+//   32+X+Y  ???     bzip2(extra block)
+// with control block a set of triples (x,y,z) meaning "add x bytes
+// from oldfile to x bytes from the diff block; copy y bytes from the
+// extra block; seek forwards in oldfile by z bytes".
+static int ReadBSDiffHeader(const Value* patch, ssize_t patch_offset,
+                            ssize_t* ctrl_len, ssize_t* data_len,
+                            ssize_t* new_size) {
+    unsigned char* header = (unsigned char*) patch->data + patch_offset;
+    if (patch_offset + 32 > patch->size || memcmp(header, "BSDIFF40", 8) != 0) {
+        printf("corrupt bsdiff patch file header (magic number)\n");
+        return 1;
+    }
+
+    *ctrl_len = offtin(header+8);
+    *data_len = offtin(header+16);
+    *new_size = offtin(header+24);
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
+    if (*ctrl_len < 0 || *data_len < 0 || *new_size < 0 ||
+        patch_offset + 32 + *ctrl_len + *data_len > patch->size) {
+        printf("corrupt patch file header (data lengths)\n");
+        return 1;
     }
+    return 0;
+}
+
+// bzip2 needs about 100k plus 4 bytes (2.5 in its small mode) per byte
+// of block size to decompress a stream; the block size is the digit in
+// the stream's "BZh" header.
+static size_t BZ2MemoryNeeded(const char* stream, ssize_t len, int small) {
+    size_t block = 900000;
+    if (len >= 4 && memcmp(stream, "BZh", 3) == 0 &&
+        stream[3] >= '1' && stream[3] <= '9') {
+        block = (stream[3] - '0') * 100000;
+    }
+    return 100000 + (small ? block * 5 / 2 : block * 4);
+}
 
-    if (sink(new_data, new_size, token) < new_size) {
+static int FlushWindow(unsigned char* window, ssize_t* fill,
+                       SinkFn sink, void* token, DigestSha1* ctx) {
+    if (sink(window, *fill, token) < *fill) {
         printf("short write of output: %d (%s)\n", errno, strerror(errno));
         return 1;
     }
     if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+        digest_sha1_update(ctx, window, *fill);
     }
-    free(new_data);
-
+    *fill = 0;
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
-    // Patch data format:
-    //   0       8       "BSDIFF40"
-    //   8       8       X
-    //   16      8       Y
-    //   24      8       sizeof(newfile)
-    //   32      X       bzip2(control block)
-    //   32+X    Y       bzip2(diff block)
-    //   32+X+Y  ???     bzip2(extra block)
-    // with control block a set of triples (x,y,z) meaning "add x bytes
-    // from oldfile to x bytes from the diff block; copy y bytes from the
-    // extra block; seek forwards in oldfile by z bytes".
-
-    unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
-        printf("corrupt bsdiff patch file header (magic number)\n");
-        return 1;
+// Adds the old data at oldpos to the n bytes of diff string in dst,
+// leaving the bytes whose old position falls outside the file alone.
+static void AddOldData(unsigned char* dst, ssize_t n,
+                       const unsigned char* old_data, ssize_t old_size,
+                       off_t oldpos) {
+    off_t i = oldpos < 0 ? -oldpos : 0;
+    off_t end = old_size - oldpos < n ? old_size - oldpos : n;
+    for (; i < end; ++i) {
+        dst[i] += old_data[oldpos + i];
     }
+}
 
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
-    *new_size = offtin(header+24);
-
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
-        printf("corrupt patch file header (data lengths)\n");
+// Applies the patch, building the output window_size bytes at a time in
+// window and handing each piece to sink (and ctx, if not NULL) as it
+// fills.  The bzip2 streams are decompressed as they are needed, so
+// memory use is the window plus the three decoders whatever the size of
+// the output.
+static int ApplyBSDiffPatchWindow(const unsigned char* old_data, ssize_t old_size,
+                                  const Value* patch, ssize_t patch_offset,
+                                  unsigned char* window, ssize_t window_size,
+                                  int small, SinkFn sink, void* token,
+                                  DigestSha1* ctx) {
+    ssize_t ctrl_len, data_len, new_size;
+    if (ReadBSDiffHeader(patch, patch_offset, &ctrl_len, &data_len, &new_size)) {
         return 1;
     }
 
+    bz_stream streams[3];
+    bz_stream* cstream = &streams[0];
+    bz_stream* dstream = &streams[1];
+    bz_stream* estream = &streams[2];
+    static const char* names[3] = { "control", "diff", "extra" };
+    char* start = patch->data + patch_offset + 32;
+    ssize_t lens[3] = { ctrl_len, data_len,
+                        patch->size - (patch_offset + 32 + ctrl_len + data_len) };
+    int result = 1;
     int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
-    }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
-    }
-
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
-    }
-
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
-        return 1;
+    int inited;
+    for (inited = 0; inited < 3; ++inited) {
+        bz_stream* s = &streams[inited];
+        memset(s, 0, sizeof(*s));
+        s->next_in = start;
+        s->avail_in = lens[inited];
+        start += lens[inited];
+        if ((bzerr = BZ2_bzDecompressInit(s, 0, small)) != BZ_OK) {
+            printf("failed to bzinit %s stream (%d)\n", names[inited], bzerr);
+            goto done;
+        }
     }
 
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
+    ssize_t fill = 0;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (FillBuffer(buf, 24, cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
         ctrl[2] = offtin(buf+16);
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (ctrl[0] < 0 || ctrl[1] < 0 || newpos + ctrl[0] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
-
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
+            goto done;
         }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read diff string and add old data to it, a window at a time
+        off_t left = ctrl[0];
+        while (left > 0) {
+            ssize_t n = window_size - fill < left ? window_size - fill : left;
+            if (FillBuffer(window + fill, n, dstream) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
+            }
+            AddOldData(window + fill, n, old_data, old_size, oldpos);
+            fill += n;
+            oldpos += n;
+            left -= n;
+            if (fill == window_size &&
+                FlushWindow(window, &fill, sink, token, ctx) != 0) {
+                goto done;
             }
         }
-
-        // Adjust pointers
         newpos += ctrl[0];
-        oldpos += ctrl[0];
 
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (newpos + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        left = ctrl[1];
+        while (left > 0) {
+            ssize_t n = window_size - fill < left ? window_size - fill : left;
+            if (FillBuffer(window + fill, n, estream) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
+            fill += n;
+            left -= n;
+            if (fill == window_size &&
+                FlushWindow(window, &fill, sink, token, ctx) != 0) {
+                goto done;
+            }
         }
 
         // Adjust pointers
         newpos += ctrl[1];
         oldpos += ctrl[2];
     }
+    if (fill > 0 && FlushWindow(window, &fill, sink, token, ctx) != 0) {
+        goto done;
+    }
+    result = 0;
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+done:
+    while (inited-- > 0) {
+        BZ2_bzDecompressEnd(&streams[inited]);
+    }
+    return result;
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, DigestSha1* ctx) {
+    ssize_t ctrl_len, data_len, new_size;
+    if (ReadBSDiffHeader(patch, patch_offset, &ctrl_len, &data_len, &new_size)) {
+        return 1;
+    }
+
+    // Fit the decoders and the output window into BSPATCH_MEMORY_BUDGET,
+    // switching bzip2 to its small mode if the window would otherwise
+    // drop below BSPATCH_MIN_WINDOW.
+    const char* start = patch->data + patch_offset + 32;
+    ssize_t extra_len = patch->size - (patch_offset + 32 + ctrl_len + data_len);
+    int small;
+    size_t decoders = 0;
+    for (small = 0; small <= 1; ++small) {
+        decoders = BZ2MemoryNeeded(start, ctrl_len, small) +
+                   BZ2MemoryNeeded(start + ctrl_len, data_len, small) +
+                   BZ2MemoryNeeded(start + ctrl_len + data_len, extra_len, small);
+        if (decoders + BSPATCH_MIN_WINDOW <= BSPATCH_MEMORY_BUDGET) break;
+    }
+    if (small > 1) small = 1;
+
+    ssize_t window_size = BSPATCH_MIN_WINDOW;
+    if (decoders + BSPATCH_MIN_WINDOW < BSPATCH_MEMORY_BUDGET) {
+        window_size = BSPATCH_MEMORY_BUDGET - decoders;
+    }
+    if (window_size > BSPATCH_MAX_WINDOW) window_size = BSPATCH_MAX_WINDOW;
+    if (window_size > new_size) window_size = new_size > 0 ? new_size : 1;
+
+    unsigned char* window = malloc(window_size);
+    if (window == NULL) {
+        printf("failed to allocate %ld bytes of memory for output window\n",
+               (long)window_size);
+        return 1;
+    }
+    int result = ApplyBSDiffPatchWindow(old_data, old_size, patch, patch_offset,
+                                        window, window_size, small,
+                                        sink, token, ctx);
+    free(window);
+    return result;
+}
+
+static ssize_t DiscardSink(unsigned char* data, ssize_t len, void* token) {
+    return len;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    ssize_t ctrl_len, data_len;
+    if (ReadBSDiffHeader(patch, patch_offset, &ctrl_len, &data_len, new_size)) {
+        return 1;
+    }
+
+    // The whole output is one window, left in *new_data.
+    *new_data = malloc(*new_size > 0 ? *new_size : 1);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+    if (ApplyBSDiffPatchWindow(old_data, old_size, patch, patch_offset,
+                               *new_data, *new_size > 0 ? *new_size : 1, 0,
+                               DiscardSink, NULL, NULL) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
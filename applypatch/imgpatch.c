@@ -18,6 +18,7 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -29,6 +30,47 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+// Compresses the patched data of a deflate chunk as ApplyBSDiffPatch
+// produces it, so the uncompressed target never has to be held whole.
+typedef struct {
+    z_stream strm;
+    unsigned char* out;
+    ssize_t out_size;
+    SinkFn sink;
+    void* token;
+    DigestSha1* ctx;
+} DeflateSinkInfo;
+
+static int DeflateOutput(DeflateSinkInfo* dsi, int flush) {
+    int ret;
+    do {
+        dsi->strm.avail_out = dsi->out_size;
+        dsi->strm.next_out = dsi->out;
+        ret = deflate(&dsi->strm, flush);
+        if (ret == Z_STREAM_ERROR) {
+            printf("deflate failed (%d)\n", ret);
+            return -1;
+        }
+        ssize_t have = dsi->out_size - dsi->strm.avail_out;
+        if (have > 0) {
+            if (dsi->sink(dsi->out, have, dsi->token) != have) {
+                printf("failed to write %ld compressed bytes to output\n",
+                       (long)have);
+                return -1;
+            }
+            digest_sha1_update(dsi->ctx, dsi->out, have);
+        }
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END : dsi->strm.avail_out == 0);
+    return 0;
+}
+
+static ssize_t DeflateSink(unsigned char* data, ssize_t len, void* token) {
+    DeflateSinkInfo* dsi = (DeflateSinkInfo*)token;
+    dsi->strm.avail_in = len;
+    dsi->strm.next_in = data;
+    return DeflateOutput(dsi, Z_NO_FLUSH) == 0 ? len : -1;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
@@ -37,7 +79,7 @@
  */
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx) {
+                    SinkFn sink, void* token, DigestSha1* ctx) {
     ssize_t pos = 12;
     char* header = patch->data;
     if (patch->size < 12) {
@@ -77,8 +119,11 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
             size_t src_len = Read8(normal_header+8);
             size_t patch_offset = Read8(normal_header+16);
 
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
+            if (ApplyBSDiffPatch(old_data + src_start, src_len,
+                                 patch, patch_offset, sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d\n", i);
+                return -1;
+            }
         } else if (type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
@@ -93,7 +138,7 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 printf("failed to read chunk %d raw data\n", i);
                 return -1;
             }
-            SHA_update(ctx, patch->data + pos, data_len);
+            digest_sha1_update(ctx, patch->data + pos, data_len);
             if (sink((unsigned char*)patch->data + pos,
                      data_len, token) != data_len) {
                 printf("failed to write chunk %d raw data\n", i);
@@ -160,55 +205,36 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
             }
             inflateEnd(&strm);
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
+            // Next, apply the bsdiff patch to the uncompressed data,
+            // compressing the target data and appending it to the output
+            // as it comes.
+            DeflateSinkInfo dsi;
+            dsi.strm.zalloc = Z_NULL;
+            dsi.strm.zfree = Z_NULL;
+            dsi.strm.opaque = Z_NULL;
+            dsi.out_size = 32768;
+            dsi.out = malloc(dsi.out_size);
+            dsi.sink = sink;
+            dsi.token = token;
+            dsi.ctx = ctx;
+            if (dsi.out == NULL ||
+                deflateInit2(&dsi.strm, level, method, windowBits, memLevel,
+                             strategy) != Z_OK) {
+                printf("failed to init target deflation\n");
+                free(dsi.out);
+                free(expanded_source);
                 return -1;
             }
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+            ret = ApplyBSDiffPatch(expanded_source, expanded_len,
+                                   patch, patch_offset, DeflateSink, &dsi, NULL);
+            if (ret == 0) ret = DeflateOutput(&dsi, Z_FINISH);
+            deflateEnd(&dsi.strm);
+            free(dsi.out);
+            free(expanded_source);
+            if (ret != 0) {
+                return -1;
             }
-
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
         } else {
             printf("patch chunk %d is unknown type %d\n", i, type);
             return -1;
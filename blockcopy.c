@@ -0,0 +1,768 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "roots.h"
+#include "mtdutils/mtdutils.h"
+#include "mtdutils/sparse_image.h"
+
+#include "blockcopy.h"
+
+/* Plain file descriptor stream: block device nodes and image files.
+ */
+typedef struct {
+    BlockCopyStream stream;
+    int fd;
+    int for_write;
+    MD5_CTX *md5;           // digest of everything transferred, or NULL
+} FdStream;
+
+static ssize_t fd_read(BlockCopyStream *stream, char *data, size_t len)
+{
+    FdStream *s = (FdStream *) stream;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(s->fd, data + got, len - got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        got += r;
+    }
+    if (s->md5 != NULL) MD5_update(s->md5, data, got);
+    return got;
+}
+
+static ssize_t fd_write(BlockCopyStream *stream, const char *data, size_t len)
+{
+    FdStream *s = (FdStream *) stream;
+    size_t wrote = 0;
+    while (wrote < len) {
+        ssize_t w = write(s->fd, data + wrote, len - wrote);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        wrote += w;
+    }
+    if (s->md5 != NULL) MD5_update(s->md5, data, wrote);
+    return wrote;
+}
+
+static int fd_close(BlockCopyStream *stream)
+{
+    FdStream *s = (FdStream *) stream;
+    if (s->md5 != NULL && !s->for_write) {
+        // Readers may stop at the end of their own data; the digest is of
+        // the whole file.
+        char buf[4096];
+        while (fd_read(stream, buf, sizeof(buf)) > 0) {
+        }
+    }
+    int r = close(s->fd);
+    free(s);
+    return r;
+}
+
+static BlockCopyStream *open_fd_stream(const char *path, int flags, MD5_CTX *md5)
+{
+    int for_write = (flags & O_ACCMODE) != O_RDONLY;
+    int fd = open(path, flags, 0666);
+    if (fd < 0) {
+        LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+        return NULL;
+    }
+
+    FdStream *s = calloc(1, sizeof(FdStream));
+    if (s == NULL) {
+        close(fd);
+        return NULL;
+    }
+    s->fd = fd;
+    s->for_write = for_write;
+    s->md5 = md5;
+    s->stream.read = fd_read;
+    s->stream.write = fd_write;
+    s->stream.close = fd_close;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        if (S_ISBLK(st.st_mode)) {
+            uint64_t size;
+            if (ioctl(fd, BLKGETSIZE64, &size) == 0) s->stream.size = size;
+        } else if (S_ISREG(st.st_mode) && !for_write) {
+            s->stream.size = st.st_size;
+        }
+    }
+    return &s->stream;
+}
+
+/* MTD partitions, through the bad-block aware mtdutils contexts.
+ */
+typedef struct {
+    BlockCopyStream stream;
+    const MtdPartition *partition;
+    MtdReadContext *in;
+    MtdWriteContext *out;
+    int eof;
+    uint64_t offset;        // bytes written so far
+    char *scratch;          // one erase block, for partial fills
+} MtdStream;
+
+static ssize_t mtd_stream_read(BlockCopyStream *stream, char *data, size_t len)
+{
+    MtdStream *s = (MtdStream *) stream;
+    if (s->eof) return 0;
+    // mtd_read_data only comes back short at the end of the partition.
+    ssize_t r = mtd_read_data(s->in, data, len);
+    if (r < 0) {
+        if (errno != ENOSPC) return -1;
+        r = 0;
+    }
+    if ((size_t) r < len) s->eof = 1;
+    return r;
+}
+
+static ssize_t mtd_stream_write(BlockCopyStream *stream, const char *data, size_t len)
+{
+    MtdStream *s = (MtdStream *) stream;
+    ssize_t wrote = mtd_write_data(s->out, data, len);
+    if (wrote > 0) s->offset += wrote;
+    return wrote;
+}
+
+/* Whole erase blocks of 0xff only need erasing, not writing and reading
+ * back; anything else is written out from the scratch block.
+ */
+static int mtd_stream_fill(BlockCopyStream *stream, int value, size_t len)
+{
+    MtdStream *s = (MtdStream *) stream;
+    const size_t block = s->partition->erase_size;
+    while (len > 0) {
+        size_t in_block = s->offset % block;
+        if (value == 0xff && in_block == 0 && len >= block) {
+            int blocks = len / block;
+            if (mtd_write_erased_blocks(s->out, blocks)) return -1;
+            s->offset += (uint64_t) blocks * block;
+            len -= (size_t) blocks * block;
+            continue;
+        }
+
+        if (s->scratch == NULL) {
+            s->scratch = malloc(block);
+            if (s->scratch == NULL) return -1;
+        }
+        size_t n = block - in_block;
+        if (n > len) n = len;
+        memset(s->scratch, value, n);
+        if (mtd_stream_write(stream, s->scratch, n) != (ssize_t) n) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int mtd_stream_close(BlockCopyStream *stream)
+{
+    MtdStream *s = (MtdStream *) stream;
+    int r = 0;
+    if (s->in != NULL) mtd_read_close(s->in);
+    if (s->out != NULL) r = mtd_write_close(s->out);
+    free(s->scratch);
+    free(s);
+    return r;
+}
+
+static BlockCopyStream *open_mtd_stream(const MtdPartition *partition, int for_write)
+{
+    MtdStream *s = calloc(1, sizeof(MtdStream));
+    if (s == NULL) return NULL;
+
+    s->partition = partition;
+    if (for_write) {
+        s->out = mtd_write_partition(partition);
+    } else {
+        s->in = mtd_read_partition(partition);
+    }
+    if (s->in == NULL && s->out == NULL) {
+        LOGE("Can't open mtd partition %s\n(%s)\n", partition->name, strerror(errno));
+        free(s);
+        return NULL;
+    }
+
+    s->stream.read = mtd_stream_read;
+    s->stream.write = mtd_stream_write;
+    s->stream.close = mtd_stream_close;
+    s->stream.fill = mtd_stream_fill;
+    s->stream.size = partition->size;
+    s->stream.align = partition->erase_size;
+    return &s->stream;
+}
+
+BlockCopyStream *blockcopy_open_root(const char *root, int for_write)
+{
+    const MtdPartition *partition = get_root_mtd_partition(root);
+    if (partition != NULL) {
+        return open_mtd_stream(partition, for_write);
+    }
+
+    const char *device = get_dev_for_root(root);
+    if (device == NULL) {
+        LOGE("Can't find device for %s\n", root);
+        return NULL;
+    }
+    return open_fd_stream(device, for_write ? O_WRONLY : O_RDONLY, NULL);
+}
+
+BlockCopyStream *blockcopy_open_file(const char *path, int for_write, MD5_CTX *md5)
+{
+    return open_fd_stream(path, for_write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, md5);
+}
+
+static int has_suffix(const char *path, const char *suffix)
+{
+    size_t len = strlen(path);
+    size_t suffix_len = strlen(suffix);
+    return len > suffix_len && strcmp(path + len - suffix_len, suffix) == 0;
+}
+
+static int is_sparse_file(const char *path)
+{
+    char header[SPARSE_HEADER_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    int sparse = read(fd, header, sizeof(header)) == sizeof(header) &&
+                 sparse_is_image(header, sizeof(header));
+    close(fd);
+    return sparse;
+}
+
+BlockCopyStream *blockcopy_open_image(const char *path, int for_write, MD5_CTX *md5)
+{
+    if (has_suffix(path, ".gz")) {
+        return blockcopy_open_gzip_file(path, for_write, md5);
+    }
+    if (has_suffix(path, ".idx")) {
+        return blockcopy_open_dedup_file(path, for_write, md5);
+    }
+    if (for_write ? has_suffix(path, ".simg") : is_sparse_file(path)) {
+        return blockcopy_open_sparse_file(path, for_write, md5);
+    }
+    return blockcopy_open_file(path, for_write, md5);
+}
+
+int blockcopy_close(BlockCopyStream *stream)
+{
+    return stream->close(stream);
+}
+
+/* Buffers are handed from the reader thread to the writer in a ring;
+ * a buffer with len == 0 marks the end of the source.  Runs reported by
+ * a sparse source travel as a fill value and a length, without data.
+ */
+typedef struct {
+    BlockCopyStream *src;
+    size_t chunk_size;
+    char *data[BLOCKCOPY_BUFFERS];
+    ssize_t len[BLOCKCOPY_BUFFERS];
+    int fill[BLOCKCOPY_BUFFERS];    // run value instead of data, or -1
+    int head, tail, filled;
+    int read_errno;
+    int abort;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CopyPipe;
+
+static void *reader_thread(void *cookie)
+{
+    CopyPipe *pipe = (CopyPipe *) cookie;
+    for (;;) {
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->filled == BLOCKCOPY_BUFFERS && !pipe->abort) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        int slot = pipe->head;
+        int abort = pipe->abort;
+        pthread_mutex_unlock(&pipe->lock);
+        if (abort) break;
+
+        int fill = -1;
+        ssize_t len;
+        if (pipe->src->read_run != NULL) {
+            len = pipe->src->read_run(pipe->src, pipe->data[slot],
+                                      pipe->chunk_size, &fill);
+        } else {
+            len = pipe->src->read(pipe->src, pipe->data[slot], pipe->chunk_size);
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        if (len < 0) pipe->read_errno = errno;
+        pipe->len[slot] = len;
+        pipe->fill[slot] = fill;
+        pipe->head = (slot + 1) % BLOCKCOPY_BUFFERS;
+        pipe->filled++;
+        pthread_cond_signal(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+
+        if (len <= 0) break;
+    }
+    return NULL;
+}
+
+static size_t round_up(size_t size, size_t align)
+{
+    if (align == 0) return size;
+    return (size + align - 1) / align * align;
+}
+
+int blockcopy_run(BlockCopyStream *src, BlockCopyStream *dst,
+        size_t chunk_size, BlockCopyProgressFn progress, void *cookie,
+        BlockCopyStats *stats)
+{
+    CopyPipe pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.src = src;
+    if (chunk_size == 0) chunk_size = BLOCKCOPY_CHUNK_SIZE;
+    chunk_size = round_up(chunk_size, src->align);
+    chunk_size = round_up(chunk_size, dst->align);
+    pipe.chunk_size = chunk_size;
+
+    int i;
+    long page = sysconf(_SC_PAGESIZE);
+    for (i = 0; i < BLOCKCOPY_BUFFERS; ++i) {
+        pipe.data[i] = memalign(page, chunk_size);
+        if (pipe.data[i] == NULL) {
+            LOGE("Can't allocate %d byte copy buffer\n", (int) chunk_size);
+            while (--i >= 0) free(pipe.data[i]);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.cond, NULL);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_thread, &pipe)) {
+        LOGE("Can't start reader thread\n");
+        for (i = 0; i < BLOCKCOPY_BUFFERS; ++i) free(pipe.data[i]);
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t total = 0;
+    for (;;) {
+        pthread_mutex_lock(&pipe.lock);
+        while (pipe.filled == 0) {
+            pthread_cond_wait(&pipe.cond, &pipe.lock);
+        }
+        int slot = pipe.tail;
+        ssize_t len = pipe.len[slot];
+        int fill = pipe.fill[slot];
+        pthread_mutex_unlock(&pipe.lock);
+
+        if (len < 0) {
+            LOGE("Read error after %llu bytes\n(%s)\n", total,
+                    strerror(pipe.read_errno));
+            ret = -1;
+            break;
+        }
+
+        int failed;
+        if (len == 0) {
+            failed = 0;
+        } else if (fill >= 0 && dst->fill != NULL) {
+            failed = dst->fill(dst, fill, len) != 0;
+        } else {
+            if (fill >= 0) memset(pipe.data[slot], fill, len);
+            failed = dst->write(dst, pipe.data[slot], len) != len;
+        }
+        if (failed) {
+            LOGE("Write error after %llu bytes\n(%s)\n", total, strerror(errno));
+            ret = -1;
+            break;
+        }
+        total += len;
+        if (progress != NULL) {
+            progress(total, src->size, cookie);
+        } else if (src->size > 0) {
+            ui_set_progress((float) total / src->size);
+        }
+
+        pthread_mutex_lock(&pipe.lock);
+        pipe.tail = (slot + 1) % BLOCKCOPY_BUFFERS;
+        pipe.filled--;
+        pthread_cond_signal(&pipe.cond);
+        pthread_mutex_unlock(&pipe.lock);
+
+        if (len == 0) break;
+    }
+
+    pthread_mutex_lock(&pipe.lock);
+    pipe.abort = 1;
+    pthread_cond_signal(&pipe.cond);
+    pthread_mutex_unlock(&pipe.lock);
+    pthread_join(reader, NULL);
+
+    gettimeofday(&end, NULL);
+    if (stats != NULL) {
+        stats->bytes = total;
+        stats->msec = (end.tv_sec - start.tv_sec) * 1000 +
+                      (end.tv_usec - start.tv_usec) / 1000;
+    }
+
+    pthread_cond_destroy(&pipe.cond);
+    pthread_mutex_destroy(&pipe.lock);
+    for (i = 0; i < BLOCKCOPY_BUFFERS; ++i) free(pipe.data[i]);
+    return ret;
+}
+
+static void print_stats(const char *label, const BlockCopyStats *stats)
+{
+    unsigned int msec = stats->msec > 0 ? stats->msec : 1;
+    ui_print("%s%lluMB in %u.%us (%lluKB/s)\n", label,
+            stats->bytes / (1024 * 1024), msec / 1000, (msec % 1000) / 100,
+            stats->bytes * 1000 / msec / 1024);
+}
+
+static int copy_and_close_progress(BlockCopyStream *src, BlockCopyStream *dst,
+        BlockCopyProgressFn progress, void *cookie)
+{
+    BlockCopyStats stats;
+    int ret = blockcopy_run(src, dst, 0, progress, cookie, &stats);
+    if (blockcopy_close(src)) ret = -1;
+    if (blockcopy_close(dst)) {
+        LOGE("Error closing output\n(%s)\n", strerror(errno));
+        ret = -1;
+    }
+    if (ret == 0) print_stats("", &stats);
+    return ret;
+}
+
+static int copy_and_close(BlockCopyStream *src, BlockCopyStream *dst)
+{
+    return copy_and_close_progress(src, dst, NULL, NULL);
+}
+
+int blockcopy_root_to_file(const char *root, const char *path, uint8_t *md5)
+{
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    BlockCopyStream *src = blockcopy_open_root(root, 0);
+    if (src == NULL) return -1;
+    BlockCopyStream *dst = blockcopy_open_image(path, 1, md5 != NULL ? &ctx : NULL);
+    if (dst == NULL) {
+        blockcopy_close(src);
+        return -1;
+    }
+    int ret = copy_and_close(src, dst);
+    if (md5 != NULL) memcpy(md5, MD5_final(&ctx), MD5_DIGEST_SIZE);
+    return ret;
+}
+
+int blockcopy_tar_create(const char *dir, const char *exclude,
+        const BlockCopyTarHooks *hooks, const char *path,
+        BlockCopyProgressFn progress, void *cookie)
+{
+    BlockCopyStream *src = blockcopy_open_tar_source(dir, exclude, hooks);
+    if (src == NULL) return -1;
+    BlockCopyStream *dst = blockcopy_open_image(path, 1, NULL);
+    if (dst == NULL) {
+        blockcopy_close(src);
+        return -1;
+    }
+    return copy_and_close_progress(src, dst, progress, cookie);
+}
+
+int blockcopy_tar_extract(const char *path, const char *dest,
+        BlockCopyProgressFn progress, void *cookie)
+{
+    BlockCopyStream *src = blockcopy_open_image(path, 0, NULL);
+    if (src == NULL) return -1;
+    BlockCopyStream *dst = blockcopy_open_tar_sink(dest);
+    if (dst == NULL) {
+        blockcopy_close(src);
+        return -1;
+    }
+    return copy_and_close_progress(src, dst, progress, cookie);
+}
+
+int blockcopy_check_image(const char *path, const uint8_t *md5)
+{
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    BlockCopyStream *src = blockcopy_open_image(path, 0, &ctx);
+    if (src == NULL) return -1;
+    char *data = malloc(BLOCKCOPY_CHUNK_SIZE);
+    int ret = data != NULL ? 0 : -1;
+    ssize_t got;
+    while (ret == 0 && (got = src->read(src, data, BLOCKCOPY_CHUNK_SIZE)) != 0) {
+        if (got < 0) ret = -1;
+    }
+    free(data);
+    if (blockcopy_close(src)) ret = -1;
+    if (ret != 0) {
+        LOGE("Can't read %s\n(%s)\n", path, strerror(errno));
+    } else if (memcmp(MD5_final(&ctx), md5, MD5_DIGEST_SIZE) != 0) {
+        LOGE("MD5 mismatch in %s\n", path);
+        ret = -1;
+    }
+    return ret;
+}
+
+int blockcopy_file_to_root(const char *path, const char *root, const uint8_t *md5)
+{
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    BlockCopyStream *src = blockcopy_open_image(path, 0, md5 != NULL ? &ctx : NULL);
+    if (src == NULL) return -1;
+    BlockCopyStream *dst = blockcopy_open_root(root, 1);
+    if (dst == NULL) {
+        blockcopy_close(src);
+        return -1;
+    }
+    int ret = copy_and_close(src, dst);
+    if (ret == 0 && md5 != NULL && memcmp(MD5_final(&ctx), md5, MD5_DIGEST_SIZE) != 0) {
+        LOGE("MD5 mismatch in %s\n", path);
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Parallel backup.  Sources are opened up front so the overall size is
+ * known; each worker thread then takes the next job, opens its image
+ * file and copies.  Writes to the image files draw on a shared byte
+ * budget so the jobs queue up for the SD card instead of fighting over it.
+ */
+typedef struct {
+    BlockCopyStream stream;
+    BlockCopyStream *inner;
+    struct JobQueue *queue;
+} BudgetStream;
+
+typedef struct JobQueue {
+    BlockCopyJob *jobs;
+    BlockCopyStream **sources;
+    int count;
+    int next;
+    int failed;
+    uint64_t total;
+    size_t budget_size;
+    size_t budget;
+    int shown[BLOCKCOPY_MAX_JOBS_SHOWN];
+    pthread_mutex_t lock;
+    pthread_cond_t budget_cond;
+} JobQueue;
+
+static ssize_t budget_write(BlockCopyStream *stream, const char *data, size_t len)
+{
+    BudgetStream *s = (BudgetStream *) stream;
+    JobQueue *queue = s->queue;
+    size_t want = len < queue->budget_size ? len : queue->budget_size;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->budget < want) {
+        pthread_cond_wait(&queue->budget_cond, &queue->lock);
+    }
+    queue->budget -= want;
+    pthread_mutex_unlock(&queue->lock);
+
+    ssize_t wrote = s->inner->write(s->inner, data, len);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->budget += want;
+    pthread_cond_broadcast(&queue->budget_cond);
+    pthread_mutex_unlock(&queue->lock);
+    return wrote;
+}
+
+static int budget_close(BlockCopyStream *stream)
+{
+    BudgetStream *s = (BudgetStream *) stream;
+    int r = blockcopy_close(s->inner);
+    free(s);
+    return r;
+}
+
+static BlockCopyStream *open_budget_stream(BlockCopyStream *inner, JobQueue *queue)
+{
+    BudgetStream *s = calloc(1, sizeof(BudgetStream));
+    if (s == NULL) return NULL;
+    s->stream.write = budget_write;
+    s->stream.close = budget_close;
+    s->stream.size = inner->size;
+    s->stream.align = inner->align;
+    s->inner = inner;
+    s->queue = queue;
+    return &s->stream;
+}
+
+// Should only be called with queue->lock held.
+static void show_jobs_locked(JobQueue *queue)
+{
+    char line[256];
+    int len = 0;
+    uint64_t done = 0;
+    int i;
+    for (i = 0; i < queue->count; ++i) {
+        const BlockCopyJob *job = &queue->jobs[i];
+        done += job->done;
+        if (i < BLOCKCOPY_MAX_JOBS_SHOWN && len < (int) sizeof(line)) {
+            len += snprintf(line + len, sizeof(line) - len, "%s%s %d%%",
+                    i > 0 ? "  " : "\r", job->name, queue->shown[i]);
+        }
+    }
+    if (queue->total > 0) {
+        ui_set_progress((float) done / queue->total);
+    }
+    ui_print("%s", line);
+}
+
+static void job_progress(uint64_t done, uint64_t total, void *cookie)
+{
+    BlockCopyJob *job = (BlockCopyJob *) cookie;
+    JobQueue *queue = job->queue;
+    int index = job - queue->jobs;
+    int percent = total > 0 ? (int) (done * 100 / total) : 100;
+
+    pthread_mutex_lock(&queue->lock);
+    job->done = done;
+    // Redraw in 5% steps; every ui_print repaints the whole screen.
+    if (index < BLOCKCOPY_MAX_JOBS_SHOWN &&
+            percent / 5 != queue->shown[index] / 5) {
+        queue->shown[index] = percent;
+        show_jobs_locked(queue);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void *job_thread(void *cookie)
+{
+    JobQueue *queue = (JobQueue *) cookie;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next;
+        if (queue->failed || index >= queue->count) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+
+        BlockCopyJob *job = &queue->jobs[index];
+        BlockCopyStream *src = queue->sources[index];
+        queue->sources[index] = NULL;
+
+        job->status = -1;
+        MD5_CTX md5;
+        MD5_init(&md5);
+        BlockCopyStream *file = blockcopy_open_image(job->path, 1, &md5);
+        BlockCopyStream *dst = NULL;
+        if (file != NULL) {
+            dst = open_budget_stream(file, queue);
+            if (dst == NULL) blockcopy_close(file);
+        }
+        if (dst != NULL) {
+            job->status = blockcopy_run(src, dst, 0, job_progress, job, &job->stats);
+            if (blockcopy_close(dst)) {
+                LOGE("Error closing %s\n(%s)\n", job->path, strerror(errno));
+                job->status = -1;
+            }
+            memcpy(job->md5, MD5_final(&md5), MD5_DIGEST_SIZE);
+        }
+        blockcopy_close(src);
+
+        if (job->status != 0) {
+            pthread_mutex_lock(&queue->lock);
+            queue->failed = 1;
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+    return NULL;
+}
+
+int blockcopy_backup_roots(BlockCopyJob *jobs, int count, int max_parallel,
+        size_t sink_budget)
+{
+    JobQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.jobs = jobs;
+    queue.count = count;
+    queue.budget_size = queue.budget =
+            sink_budget > 0 ? sink_budget : BLOCKCOPY_SINK_BUDGET;
+    if (max_parallel <= 0) max_parallel = BLOCKCOPY_MAX_JOBS;
+    if (max_parallel > count) max_parallel = count;
+
+    queue.sources = calloc(count, sizeof(BlockCopyStream *));
+    pthread_t *threads = calloc(max_parallel, sizeof(pthread_t));
+    if (queue.sources == NULL || threads == NULL) {
+        free(queue.sources);
+        free(threads);
+        return -1;
+    }
+
+    int ret = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        jobs[i].queue = &queue;
+        jobs[i].status = -1;
+        jobs[i].done = 0;
+        queue.sources[i] = blockcopy_open_root(jobs[i].root, 0);
+        if (queue.sources[i] == NULL) {
+            ret = -1;
+            break;
+        }
+        queue.total += queue.sources[i]->size;
+    }
+
+    if (ret == 0) {
+        pthread_mutex_init(&queue.lock, NULL);
+        pthread_cond_init(&queue.budget_cond, NULL);
+
+        int started = 0;
+        for (i = 0; i < max_parallel; ++i) {
+            if (pthread_create(&threads[i], NULL, job_thread, &queue)) break;
+            ++started;
+        }
+        if (started == 0) {
+            // No threads available; just do the work here.
+            job_thread(&queue);
+        }
+        for (i = 0; i < started; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        ui_print("\n");
+
+        for (i = 0; i < count; ++i) {
+            if (jobs[i].status != 0) {
+                ret = -1;
+            } else {
+                char label[64];
+                snprintf(label, sizeof(label), "%s: ", jobs[i].name);
+                print_stats(label, &jobs[i].stats);
+            }
+        }
+
+        pthread_cond_destroy(&queue.budget_cond);
+        pthread_mutex_destroy(&queue.lock);
+    }
+
+    // Sources of jobs that never ran (open failure or an earlier error).
+    for (i = 0; i < count; ++i) {
+        if (queue.sources[i] != NULL) blockcopy_close(queue.sources[i]);
+    }
+    free(queue.sources);
+    free(threads);
+    return ret;
+}
@@ -0,0 +1,225 @@
+#ifndef BLOCKCOPY_H
+#define BLOCKCOPY_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "md5.h"
+
+/* Size of each transfer buffer.  Boards with plenty of RAM can raise it
+ * with BOARD_NANDROID_CHUNK_SIZE; it is rounded up to a multiple of the
+ * erase block size when copying to or from MTD.
+ */
+#ifndef BLOCKCOPY_CHUNK_SIZE
+#define BLOCKCOPY_CHUNK_SIZE (1024 * 1024)
+#endif
+
+/* Number of buffers cycled between the reader and the writer thread.
+ */
+#ifndef BLOCKCOPY_BUFFERS
+#define BLOCKCOPY_BUFFERS 2
+#endif
+
+/* A source or sink of raw partition data.  Concrete streams embed this
+ * as their first member; read() returns 0 at the end of the stream.
+ *
+ * Sparse sources may also provide read_run(), which works like read()
+ * but can instead report a run of len bytes that all equal *fill (0x00
+ * or 0xff) without filling data; *fill is -1 for ordinary data.  Sinks
+ * that can store such a run more cheaply than writing it provide fill().
+ */
+typedef struct BlockCopyStream BlockCopyStream;
+struct BlockCopyStream {
+    ssize_t (*read)(BlockCopyStream *stream, char *data, size_t len);
+    ssize_t (*write)(BlockCopyStream *stream, const char *data, size_t len);
+    int (*close)(BlockCopyStream *stream);
+    ssize_t (*read_run)(BlockCopyStream *stream, char *data, size_t len, int *fill);
+    int (*fill)(BlockCopyStream *stream, int value, size_t len);
+    uint64_t size;      // expected length in bytes, 0 if unknown
+    size_t align;       // transfers should be a multiple of this, 0 if any
+};
+
+/* Open the raw device behind a root such as "SYSTEM:" or "BOOT:".
+ * MTD partitions go through mtdutils, everything else (bml, stl, mmc)
+ * through the block device node.
+ */
+BlockCopyStream *blockcopy_open_root(const char *root, int for_write);
+
+/* Image files.  If md5 is not NULL, every byte of the file that is read
+ * or written is added to it; closing a file opened for reading first
+ * reads whatever is left, so the digest always covers the whole file.
+ */
+BlockCopyStream *blockcopy_open_file(const char *path, int for_write, MD5_CTX *md5);
+
+/* Deflate level and piece size for compressed images.  Pieces are
+ * compressed in parallel and must be at least 32KB (the deflate window).
+ */
+#ifndef BLOCKCOPY_GZIP_LEVEL
+#define BLOCKCOPY_GZIP_LEVEL 1
+#endif
+#define BLOCKCOPY_GZIP_PIECE (128 * 1024)
+#define BLOCKCOPY_GZIP_MAX_THREADS 8
+
+/* A gzip file, compressed on all cores when writing and decompressed on
+ * the fly when reading.
+ */
+BlockCopyStream *blockcopy_open_gzip_file(const char *path, int for_write, MD5_CTX *md5);
+
+/* A sparse image file (see mtdutils/sparse_image.h): runs of zero and
+ * erased blocks are stored as a length instead of data.
+ */
+BlockCopyStream *blockcopy_open_sparse_file(const char *path, int for_write, MD5_CTX *md5);
+
+/* Size of the pieces deduplicated images are cut into.  Smaller chunks
+ * share more between snapshots but put more files in the store.
+ */
+#ifndef BLOCKCOPY_DEDUP_CHUNK_SIZE
+#define BLOCKCOPY_DEDUP_CHUNK_SIZE (128 * 1024)
+#endif
+
+/* A deduplicated image: the file at path only lists the digests of the
+ * image's chunks, whose data lives in a store shared by every snapshot
+ * next to the one path is in (see blockcopy_dedup.c).  Chunks are checked
+ * against their digest as they are read.
+ */
+BlockCopyStream *blockcopy_open_dedup_file(const char *path, int for_write, MD5_CTX *md5);
+
+/* Remove the chunks that no deduplicated image in any snapshot directory
+ * below backup_dir refers to any more.  Returns 0 on success; nothing is
+ * removed if any index can't be read.
+ */
+int blockcopy_dedup_gc(const char *backup_dir);
+
+/* Backups trust a chunk already in the store if its name and size fit.
+ * With verify set, each one is read back and compared first, and a
+ * damaged chunk is written again; that costs a read of every reused
+ * chunk.
+ */
+void blockcopy_dedup_set_verify(int verify);
+
+/* Lets the caller of a tar source leave files out and see what it
+ * archived.  Names are member names, without a trailing slash.
+ *
+ * unchanged() is asked about every regular file; returning nonzero
+ * leaves it out of the archive.  entry() is called for every entry that
+ * was walked over, including those left out, once its data has gone
+ * into the archive; md5 is the digest of an archived regular file's
+ * contents and NULL for everything else.
+ */
+typedef struct {
+    int (*unchanged)(void *cookie, const char *name, const struct stat *st);
+    void (*entry)(void *cookie, const char *name, const struct stat *st,
+            const uint8_t *md5);
+    void *cookie;
+} BlockCopyTarHooks;
+
+/* tar archives.  The source walks the directory tree at dir (an absolute
+ * path) and reads as a tar archive of it, with member names relative to
+ * "/" and anything whose name matches the fnmatch() pattern exclude left
+ * out.  hooks may be NULL.  Its size is only an estimate, taken from the
+ * space used on the filesystem.  The sink extracts a tar archive written
+ * to it below dest, keeping ownership, modes, times, links, device nodes
+ * and extended attributes.
+ */
+BlockCopyStream *blockcopy_open_tar_source(const char *dir, const char *exclude,
+        const BlockCopyTarHooks *hooks);
+BlockCopyStream *blockcopy_open_tar_sink(const char *dest);
+
+/* Open a nandroid image file.  Names ending in ".gz" are compressed,
+ * names ending in ".idx" are deduplicated and names ending in ".simg"
+ * are written sparse; sparse images are recognised by their header when
+ * reading.
+ */
+BlockCopyStream *blockcopy_open_image(const char *path, int for_write, MD5_CTX *md5);
+
+/* Flushes and frees the stream.  Returns nonzero if anything failed.
+ */
+int blockcopy_close(BlockCopyStream *stream);
+
+typedef struct {
+    uint64_t bytes;
+    unsigned int msec;
+} BlockCopyStats;
+
+/* Called on the writing thread after every chunk.  total is the size
+ * of the source, 0 if unknown.
+ */
+typedef void (*BlockCopyProgressFn)(uint64_t done, uint64_t total, void *cookie);
+
+/* Copy src to dst until src is exhausted, reading on a helper thread
+ * while the calling thread writes.  If progress is NULL, the bytes
+ * written drive the current ui_show_progress() scope.  chunk_size of 0
+ * selects BLOCKCOPY_CHUNK_SIZE.  Returns 0 on success.
+ */
+int blockcopy_run(BlockCopyStream *src, BlockCopyStream *dst,
+        size_t chunk_size, BlockCopyProgressFn progress, void *cookie,
+        BlockCopyStats *stats);
+
+/* Convenience wrappers used by nandroid: dump a root to an image file and
+ * write an image file back to a root, printing the throughput achieved.
+ * blockcopy_root_to_file() stores the MD5 of the image file written in md5
+ * unless it is NULL; blockcopy_file_to_root() checks the image against md5
+ * (if not NULL) as it goes and fails on a mismatch, by which time the
+ * partition has been overwritten: use blockcopy_check_image() first.
+ */
+int blockcopy_root_to_file(const char *root, const char *path, uint8_t *md5);
+int blockcopy_file_to_root(const char *path, const char *root, const uint8_t *md5);
+
+/* Read the image at path through to the end, the way a restore would
+ * (so deduplicated chunks and compressed data are checked too), and
+ * compare the image file's MD5 with md5.  Returns 0 if it matches.
+ */
+int blockcopy_check_image(const char *path, const uint8_t *md5);
+
+/* Archive the tree at dir into the file at path, or extract the archive
+ * at path below dest.  progress works as for blockcopy_run().
+ */
+int blockcopy_tar_create(const char *dir, const char *exclude,
+        const BlockCopyTarHooks *hooks, const char *path,
+        BlockCopyProgressFn progress, void *cookie);
+int blockcopy_tar_extract(const char *path, const char *dest,
+        BlockCopyProgressFn progress, void *cookie);
+
+/* How many partitions blockcopy_backup_roots() dumps at once by default.
+ * Raise it with BOARD_NANDROID_JOBS on devices whose partitions live on
+ * separate chips or volumes.
+ */
+#ifndef BLOCKCOPY_MAX_JOBS
+#define BLOCKCOPY_MAX_JOBS 2
+#endif
+
+/* Bytes that may be in flight to the image files at any one time, shared
+ * by all jobs.  The default lets one chunk be written while the next job
+ * waits with its own.
+ */
+#ifndef BLOCKCOPY_SINK_BUDGET
+#define BLOCKCOPY_SINK_BUDGET BLOCKCOPY_CHUNK_SIZE
+#endif
+
+// Only this many jobs fit on the progress line.
+#define BLOCKCOPY_MAX_JOBS_SHOWN 4
+
+typedef struct {
+    const char *root;       // partition to dump, e.g. "SYSTEM:"
+    const char *path;       // image file to create
+    const char *name;       // label on the progress line
+
+    // Filled in by blockcopy_backup_roots().
+    int status;
+    uint64_t done;
+    BlockCopyStats stats;
+    uint8_t md5[MD5_DIGEST_SIZE];   // of the image file
+    struct JobQueue *queue;
+} BlockCopyJob;
+
+/* Dump every job's root to its image file, running up to max_parallel
+ * copies at once (0 for BLOCKCOPY_MAX_JOBS) with at most sink_budget
+ * bytes (0 for BLOCKCOPY_SINK_BUDGET) being written at any time.  The
+ * progress bar follows the combined progress and a status line shows
+ * each partition.  Returns 0 if every job succeeded.
+ */
+int blockcopy_backup_roots(BlockCopyJob *jobs, int count, int max_parallel,
+        size_t sink_budget);
+
+#endif
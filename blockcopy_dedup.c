@@ -0,0 +1,644 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "blockcopy.h"
+
+/* Deduplicated images.  The image file is an index:
+ *
+ *     dedup 1 <chunk size>
+ *     <md5 of chunk 0>
+ *     0                    (a chunk of zeros)
+ *     f                    (a chunk of erased flash, all 0xff)
+ *     ...
+ *     size <image size>
+ *
+ * and the chunk data is kept in <backup dir>/.chunks/<xx>/<md5>, where
+ * <backup dir> is the directory holding the snapshot directories and
+ * <xx> are the first two digits of the digest.  A chunk already in the
+ * store (by name and size) is not written again, so snapshots of a
+ * partition that has barely changed cost little more than their index.
+ * Chunks are aligned to the partition, which suits filesystem images:
+ * their blocks don't move when something is added in front of them.
+ */
+
+#define DEDUP_MAGIC "dedup 1"
+#define DEDUP_STORE ".chunks"
+#define DEDUP_HEX_SIZE (MD5_DIGEST_SIZE * 2 + 1)
+
+enum {
+    DEDUP_DATA = -1,
+    DEDUP_ZERO = 0x00,
+    DEDUP_ERASED = 0xff,
+};
+
+typedef struct {
+    int fill;                       // DEDUP_DATA, DEDUP_ZERO or DEDUP_ERASED
+    uint8_t md5[MD5_DIGEST_SIZE];
+} DedupChunk;
+
+/* Digests a writer has already stored or checked, so a chunk that repeats
+ * within the image is neither read back nor counted again.
+ */
+typedef struct {
+    uint8_t (*md5)[MD5_DIGEST_SIZE];
+    char *used;
+    size_t mask;
+    size_t count;
+} SeenSet;
+
+typedef struct {
+    BlockCopyStream stream;
+    BlockCopyStream *index;
+    char store[PATH_MAX];
+    size_t chunk_size;
+    char *buf;
+    size_t buffered;    // writing: bytes of the current chunk in buf
+    uint64_t size;
+
+    // reading
+    DedupChunk *chunks;
+    int count;
+    int next;           // chunk the next read starts in
+    size_t offset;      // bytes of chunks[next] already read
+    int loaded;         // chunk held in buf, or -1
+
+    // writing
+    SeenSet seen;
+    char *check;        // chunk read back from the store
+    int stored;
+    int reused;
+    int error;
+} DedupStream;
+
+static void store_path(const DedupStream *s, const uint8_t *md5, char *path)
+{
+    char hex[DEDUP_HEX_SIZE];
+    MD5_hex(md5, hex);
+    snprintf(path, PATH_MAX, "%s/%.2s/%s", s->store, hex, hex);
+}
+
+static int is_filled(const char *data, size_t len, int value)
+{
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        if ((unsigned char) data[i] != value) return 0;
+    }
+    return 1;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static size_t seen_slot(const SeenSet *set, const uint8_t *md5)
+{
+    size_t i;
+    memcpy(&i, md5, sizeof(i));
+    for (i &= set->mask; set->used[i]; i = (i + 1) & set->mask) {
+        if (memcmp(set->md5[i], md5, MD5_DIGEST_SIZE) == 0) break;
+    }
+    return i;
+}
+
+// Returns 1 if md5 was already in the set, 0 if it has been added.
+static int seen_add(SeenSet *set, const uint8_t *md5)
+{
+    if (set->used != NULL && set->used[seen_slot(set, md5)]) return 1;
+    if (set->count * 2 >= set->mask) {
+        SeenSet bigger;
+        size_t i;
+        bigger.mask = set->mask ? set->mask * 2 + 1 : 1023;
+        bigger.count = set->count;
+        bigger.md5 = malloc((bigger.mask + 1) * MD5_DIGEST_SIZE);
+        bigger.used = calloc(bigger.mask + 1, 1);
+        if (bigger.md5 == NULL || bigger.used == NULL) {
+            // Without the set, repeats are just checked and counted again.
+            free(bigger.md5);
+            free(bigger.used);
+            return 0;
+        }
+        for (i = 0; set->used != NULL && i <= set->mask; ++i) {
+            if (!set->used[i]) continue;
+            size_t j = seen_slot(&bigger, set->md5[i]);
+            memcpy(bigger.md5[j], set->md5[i], MD5_DIGEST_SIZE);
+            bigger.used[j] = 1;
+        }
+        free(set->md5);
+        free(set->used);
+        *set = bigger;
+    }
+    size_t i = seen_slot(set, md5);
+    memcpy(set->md5[i], md5, MD5_DIGEST_SIZE);
+    set->used[i] = 1;
+    set->count++;
+    return 0;
+}
+
+// See blockcopy_dedup_set_verify().
+static int verify_store = 0;
+
+void blockcopy_dedup_set_verify(int verify)
+{
+    verify_store = verify;
+}
+
+/* With store verification on, an existing chunk is only reused once it
+ * has been read back and found to hold exactly the data being stored; a
+ * damaged one is replaced.
+ */
+static int chunk_matches(DedupStream *s, const char *path, const char *data, size_t len)
+{
+    if (s->check == NULL && (s->check = malloc(s->chunk_size)) == NULL) return 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, s->check + done, len - done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        done += r;
+    }
+    close(fd);
+    if (done == len && memcmp(s->check, data, len) == 0) return 1;
+    LOGE("Chunk %s is damaged, storing it again\n", path);
+    return 0;
+}
+
+/* Chunks are written under a temporary name, synced and renamed into
+ * place, so an interrupted backup or a power cut never leaves a
+ * truncated chunk behind that a later one would reuse.  Two jobs storing
+ * the same chunk at once just rename identical files over each other.
+ */
+static int store_chunk(DedupStream *s, const char *data, size_t len, const uint8_t *md5)
+{
+    if (seen_add(&s->seen, md5)) return 0;
+
+    char path[PATH_MAX];
+    struct stat st;
+    store_path(s, md5, path);
+    if (stat(path, &st) == 0 && (size_t) st.st_size == len &&
+            (!verify_store || chunk_matches(s, path, data, len))) {
+        s->reused++;
+        return 0;
+    }
+
+    char dir[PATH_MAX];
+    char tmp[PATH_MAX];
+    strcpy(dir, path);
+    *strrchr(dir, '/') = '\0';
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        LOGE("Can't create %s\n(%s)\n", dir, strerror(errno));
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%p.tmp", path, (void *) s);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE("Can't create %s\n(%s)\n", tmp, strerror(errno));
+        return -1;
+    }
+    int ret = write_all(fd, data, len);
+    if (ret == 0 && fsync(fd)) ret = -1;
+    if (close(fd)) ret = -1;
+    if (ret == 0 && rename(tmp, path)) ret = -1;
+    if (ret != 0) {
+        LOGE("Can't store %s\n(%s)\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    s->stored++;
+    return 0;
+}
+
+static int index_printf(DedupStream *s, const char *fmt, ...)
+{
+    char line[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    return s->index->write(s->index, line, len) == len ? 0 : -1;
+}
+
+static int flush_chunk(DedupStream *s)
+{
+    const char *data = s->buf;
+    size_t len = s->buffered;
+    s->buffered = 0;
+    if (is_filled(data, len, DEDUP_ZERO)) return index_printf(s, "0\n");
+    if (is_filled(data, len, DEDUP_ERASED)) return index_printf(s, "f\n");
+
+    MD5_CTX ctx;
+    char hex[DEDUP_HEX_SIZE];
+    MD5_init(&ctx);
+    MD5_update(&ctx, data, len);
+    const uint8_t *md5 = MD5_final(&ctx);
+    if (store_chunk(s, data, len, md5)) return -1;
+    MD5_hex(md5, hex);
+    return index_printf(s, "%s\n", hex);
+}
+
+static ssize_t dedup_write(BlockCopyStream *stream, const char *data, size_t len)
+{
+    DedupStream *s = (DedupStream *) stream;
+    size_t done = 0;
+    if (s->error) return -1;
+    while (done < len) {
+        size_t n = s->chunk_size - s->buffered;
+        if (n > len - done) n = len - done;
+        memcpy(s->buf + s->buffered, data + done, n);
+        s->buffered += n;
+        done += n;
+        if (s->buffered == s->chunk_size && flush_chunk(s)) {
+            s->error = 1;
+            return -1;
+        }
+    }
+    s->size += len;
+    return len;
+}
+
+static size_t chunk_len(const DedupStream *s, int i)
+{
+    uint64_t start = (uint64_t) i * s->chunk_size;
+    return s->size - start < s->chunk_size ? (size_t) (s->size - start) : s->chunk_size;
+}
+
+/* Read chunk i into data, checking it against its digest.
+ */
+static int load_chunk(DedupStream *s, int i, char *data)
+{
+    char path[PATH_MAX];
+    size_t len = chunk_len(s, i);
+    store_path(s, s->chunks[i].md5, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Missing chunk %s\n", path);
+        errno = ENOENT;
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, data + done, len - done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        done += r;
+    }
+    close(fd);
+
+    MD5_CTX ctx;
+    MD5_init(&ctx);
+    MD5_update(&ctx, data, len);
+    if (done != len || memcmp(MD5_final(&ctx), s->chunks[i].md5, MD5_DIGEST_SIZE) != 0) {
+        LOGE("Chunk %s is damaged\n", path);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t dedup_read_run(BlockCopyStream *stream, char *data, size_t len, int *fill)
+{
+    DedupStream *s = (DedupStream *) stream;
+    size_t done = 0;
+    *fill = -1;
+    if (s->next < s->count && s->chunks[s->next].fill != DEDUP_DATA) {
+        // Report consecutive chunks of the same fill as one run.
+        *fill = s->chunks[s->next].fill;
+        while (done < len && s->next < s->count && s->chunks[s->next].fill == *fill) {
+            size_t n = chunk_len(s, s->next) - s->offset;
+            if (n > len - done) n = len - done;
+            done += n;
+            s->offset += n;
+            if (s->offset == chunk_len(s, s->next)) {
+                s->next++;
+                s->offset = 0;
+            }
+        }
+        return done;
+    }
+
+    while (done < len && s->next < s->count && s->chunks[s->next].fill == DEDUP_DATA) {
+        size_t clen = chunk_len(s, s->next);
+        size_t n = clen - s->offset;
+        if (n > len - done) n = len - done;
+        if (s->offset == 0 && n == clen) {
+            // Whole chunk: straight into the caller's buffer.
+            if (load_chunk(s, s->next, data + done)) return -1;
+        } else {
+            if (s->loaded != s->next) {
+                if (load_chunk(s, s->next, s->buf)) return -1;
+                s->loaded = s->next;
+            }
+            memcpy(data + done, s->buf + s->offset, n);
+        }
+        done += n;
+        s->offset += n;
+        if (s->offset == clen) {
+            s->next++;
+            s->offset = 0;
+        }
+    }
+    return done;
+}
+
+static ssize_t dedup_read(BlockCopyStream *stream, char *data, size_t len)
+{
+    int fill;
+    ssize_t r = dedup_read_run(stream, data, len, &fill);
+    if (r > 0 && fill >= 0) memset(data, fill, r);
+    return r;
+}
+
+static int dedup_close(BlockCopyStream *stream)
+{
+    DedupStream *s = (DedupStream *) stream;
+    int r = s->error ? -1 : 0;
+    if (s->stream.write != NULL && r == 0) {
+        if (s->buffered > 0 && flush_chunk(s)) r = -1;
+        if (r == 0 && index_printf(s, "size %llu\n", (unsigned long long) s->size)) r = -1;
+        if (r == 0) {
+            ui_print("%d new chunks, %d already in the store\n", s->stored, s->reused);
+        }
+    }
+    if (blockcopy_close(s->index)) r = -1;
+    free(s->chunks);
+    free(s->seen.md5);
+    free(s->seen.used);
+    free(s->check);
+    free(s->buf);
+    free(s);
+    return r;
+}
+
+/* Reads the whole index through the index stream (so its digest covers
+ * the index file) and parses it.
+ */
+static int read_index(DedupStream *s, const char *path)
+{
+    size_t len = 0;
+    size_t alloc = 0;
+    char *text = NULL;
+    for (;;) {
+        if (alloc - len < 4096) {
+            alloc = alloc ? alloc * 2 : 64 * 1024;
+            char *t = realloc(text, alloc + 1);
+            if (t == NULL) {
+                free(text);
+                return -1;
+            }
+            text = t;
+        }
+        ssize_t r = s->index->read(s->index, text + len, alloc - len);
+        if (r < 0) {
+            free(text);
+            return -1;
+        }
+        if (r == 0) break;
+        len += r;
+    }
+    text[len] = '\0';
+
+    int ret = -1;
+    int alloc_chunks = 0;
+    int have_size = 0;
+    unsigned long chunk_size = 0;
+    char *save;
+    char *line = strtok_r(text, "\n", &save);
+    if (line == NULL || sscanf(line, DEDUP_MAGIC " %lu", &chunk_size) != 1 || chunk_size == 0) {
+        LOGE("%s is not a deduplicated image\n", path);
+        free(text);
+        return -1;
+    }
+    s->chunk_size = chunk_size;
+    while ((line = strtok_r(NULL, "\n", &save)) != NULL) {
+        unsigned long long size;
+        if (sscanf(line, "size %llu", &size) == 1) {
+            s->size = size;
+            have_size = 1;
+            break;
+        }
+        if (s->count == alloc_chunks) {
+            alloc_chunks = alloc_chunks ? alloc_chunks * 2 : 1024;
+            DedupChunk *c = realloc(s->chunks, alloc_chunks * sizeof(DedupChunk));
+            if (c == NULL) break;
+            s->chunks = c;
+        }
+        DedupChunk *c = &s->chunks[s->count];
+        if (strcmp(line, "0") == 0) {
+            c->fill = DEDUP_ZERO;
+        } else if (strcmp(line, "f") == 0) {
+            c->fill = DEDUP_ERASED;
+        } else if (strlen(line) == MD5_DIGEST_SIZE * 2) {
+            int i;
+            unsigned int byte;
+            c->fill = DEDUP_DATA;
+            for (i = 0; i < MD5_DIGEST_SIZE && sscanf(line + 2 * i, "%2x", &byte) == 1; ++i) {
+                c->md5[i] = byte;
+            }
+            if (i != MD5_DIGEST_SIZE) break;
+        } else {
+            break;
+        }
+        s->count++;
+    }
+    uint64_t full = (uint64_t) s->count * s->chunk_size;
+    if (have_size && (s->count == 0 ? s->size == 0 :
+            s->size <= full && s->size > full - s->chunk_size)) {
+        ret = 0;
+    } else {
+        LOGE("Index %s is damaged\n", path);
+    }
+    free(text);
+    return ret;
+}
+
+static void store_for_index(const char *path, char *store)
+{
+    char *slash;
+    strcpy(store, path);
+    // Strip the file name and the snapshot directory.
+    if ((slash = strrchr(store, '/')) != NULL) *slash = '\0';
+    if ((slash = strrchr(store, '/')) != NULL) {
+        *slash = '\0';
+    } else {
+        strcpy(store, ".");
+    }
+    strcat(store, "/" DEDUP_STORE);
+}
+
+BlockCopyStream *blockcopy_open_dedup_file(const char *path, int for_write, MD5_CTX *md5)
+{
+    DedupStream *s = calloc(1, sizeof(DedupStream));
+    if (s == NULL) return NULL;
+    s->loaded = -1;
+    store_for_index(path, s->store);
+    s->stream.close = dedup_close;
+
+    s->index = blockcopy_open_file(path, for_write, md5);
+    if (s->index == NULL) {
+        free(s);
+        return NULL;
+    }
+
+    if (for_write) {
+        s->stream.write = dedup_write;
+        s->chunk_size = BLOCKCOPY_DEDUP_CHUNK_SIZE;
+        if (mkdir(s->store, 0755) && errno != EEXIST) {
+            LOGE("Can't create %s\n(%s)\n", s->store, strerror(errno));
+            s->error = 1;
+        } else if (index_printf(s, DEDUP_MAGIC " %lu\n", (unsigned long) s->chunk_size)) {
+            s->error = 1;
+        }
+    } else {
+        s->stream.read = dedup_read;
+        s->stream.read_run = dedup_read_run;
+        if (read_index(s, path)) s->error = 1;
+        s->stream.size = s->size;
+        s->stream.align = s->chunk_size;
+    }
+    if (!s->error) s->buf = malloc(s->chunk_size);
+    if (s->error || s->buf == NULL) {
+        s->stream.write = NULL;
+        dedup_close(&s->stream);
+        return NULL;
+    }
+    return &s->stream;
+}
+
+/* Garbage collection: every digest named by an index in a snapshot
+ * directory is live, everything else in the store (including chunks left
+ * under a temporary name by an interrupted backup) goes.
+ */
+typedef struct {
+    uint8_t (*md5)[MD5_DIGEST_SIZE];
+    int count;
+    int alloc;
+} DigestSet;
+
+static int digest_compare(const void *a, const void *b)
+{
+    return memcmp(a, b, MD5_DIGEST_SIZE);
+}
+
+static int collect_index(DigestSet *set, const char *path)
+{
+    DedupStream s;
+    memset(&s, 0, sizeof(s));
+    s.index = blockcopy_open_file(path, 0, NULL);
+    if (s.index == NULL) return -1;
+    int ret = read_index(&s, path);
+    blockcopy_close(s.index);
+    int i;
+    for (i = 0; ret == 0 && i < s.count; ++i) {
+        if (s.chunks[i].fill != DEDUP_DATA) continue;
+        if (set->count == set->alloc) {
+            set->alloc = set->alloc ? set->alloc * 2 : 4096;
+            void *m = realloc(set->md5, set->alloc * MD5_DIGEST_SIZE);
+            if (m == NULL) {
+                ret = -1;
+                break;
+            }
+            set->md5 = m;
+        }
+        memcpy(set->md5[set->count++], s.chunks[i].md5, MD5_DIGEST_SIZE);
+    }
+    free(s.chunks);
+    return ret;
+}
+
+static int collect_snapshots(DigestSet *set, const char *backup_dir)
+{
+    DIR *d = opendir(backup_dir);
+    if (d == NULL) return -1;
+    int ret = 0;
+    struct dirent *de;
+    while (ret == 0 && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%s", backup_dir, de->d_name);
+        DIR *snapshot = opendir(dir);
+        if (snapshot == NULL) continue;
+        struct dirent *f;
+        while (ret == 0 && (f = readdir(snapshot)) != NULL) {
+            size_t len = strlen(f->d_name);
+            if (len < 4 || strcmp(f->d_name + len - 4, ".idx") != 0) continue;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, f->d_name);
+            if (collect_index(set, path)) {
+                // Don't throw anything away on the strength of a bad index.
+                LOGE("Can't read %s\n", path);
+                ret = -1;
+            }
+        }
+        closedir(snapshot);
+    }
+    closedir(d);
+    return ret;
+}
+
+int blockcopy_dedup_gc(const char *backup_dir)
+{
+    char store[PATH_MAX];
+    snprintf(store, sizeof(store), "%s/" DEDUP_STORE, backup_dir);
+    DIR *d = opendir(store);
+    if (d == NULL) return 0;
+
+    DigestSet set;
+    memset(&set, 0, sizeof(set));
+    if (collect_snapshots(&set, backup_dir)) {
+        closedir(d);
+        free(set.md5);
+        return -1;
+    }
+    qsort(set.md5, set.count, MD5_DIGEST_SIZE, digest_compare);
+
+    int removed = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/%s", store, de->d_name);
+        DIR *sub = opendir(dir);
+        if (sub == NULL) continue;
+        struct dirent *f;
+        while ((f = readdir(sub)) != NULL) {
+            if (f->d_name[0] == '.') continue;
+            uint8_t md5[MD5_DIGEST_SIZE];
+            int i;
+            unsigned int byte;
+            for (i = 0; i < MD5_DIGEST_SIZE && sscanf(f->d_name + 2 * i, "%2x", &byte) == 1; ++i) {
+                md5[i] = byte;
+            }
+            if (i == MD5_DIGEST_SIZE && f->d_name[2 * i] == '\0' &&
+                    bsearch(md5, set.md5, set.count, MD5_DIGEST_SIZE, digest_compare) != NULL) {
+                continue;
+            }
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, f->d_name);
+            if (unlink(path) == 0) removed++;
+        }
+        closedir(sub);
+        rmdir(dir);     // only succeeds once empty
+    }
+    closedir(d);
+    free(set.md5);
+    if (removed > 0) ui_print("Freed %d unused backup chunks\n", removed);
+    return 0;
+}
@@ -0,0 +1,364 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "common.h"
+#include "blockcopy.h"
+#include "digestutils/digest.h"
+
+/* gzip image streams.
+ *
+ * Compression works like pigz: every write is cut into pieces that are
+ * deflated independently on a pool of worker threads, each primed with
+ * the 32KB of data preceding its piece as a dictionary and ended with a
+ * sync flush so the outputs simply concatenate into one deflate stream.
+ * The result is an ordinary .gz file that gunzip and zcat understand.
+ *
+ * Decompression is a plain streaming inflate; it runs on the block
+ * copier's reader thread, so it overlaps with writing the device.
+ */
+
+#define GZIP_WINDOW_SIZE 32768
+#define GZIP_INPUT_SIZE (64 * 1024)
+
+typedef struct {
+    const unsigned char *in;
+    size_t in_len;
+    const unsigned char *dict;
+    size_t dict_len;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_alloc;
+    uLong crc;
+    int status;
+} GzipPiece;
+
+typedef struct {
+    BlockCopyStream stream;
+    BlockCopyStream *inner;
+
+    // compression
+    int thread_count;
+    pthread_t *threads;
+    GzipPiece *pieces;
+    int pieces_alloc;
+    int piece_count;
+    int next_piece;
+    int pieces_done;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned char window[GZIP_WINDOW_SIZE];
+    size_t window_len;
+    uLong crc;
+    uint64_t isize;
+    int started;
+
+    // decompression
+    z_stream zs;
+    unsigned char *input;
+    int input_eof;
+    int stream_end;
+} GzipStream;
+
+static int deflate_piece(z_stream *zs, GzipPiece *piece)
+{
+    if (deflateReset(zs) != Z_OK) return -1;
+    if (piece->dict_len > 0 &&
+        deflateSetDictionary(zs, piece->dict, piece->dict_len) != Z_OK) {
+        return -1;
+    }
+
+    size_t bound = deflateBound(zs, piece->in_len) + 64;
+    if (piece->out_alloc < bound) {
+        unsigned char *out = realloc(piece->out, bound);
+        if (out == NULL) return -1;
+        piece->out = out;
+        piece->out_alloc = bound;
+    }
+
+    zs->next_in = (Bytef *) piece->in;
+    zs->avail_in = piece->in_len;
+    piece->out_len = 0;
+    for (;;) {
+        zs->next_out = piece->out + piece->out_len;
+        zs->avail_out = piece->out_alloc - piece->out_len;
+        int ret = deflate(zs, Z_SYNC_FLUSH);
+        piece->out_len = piece->out_alloc - zs->avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) return -1;
+        if (zs->avail_in == 0 && zs->avail_out > 0) break;
+
+        // Incompressible data can overshoot the bound; make more room.
+        unsigned char *out = realloc(piece->out, piece->out_alloc * 2);
+        if (out == NULL) return -1;
+        piece->out = out;
+        piece->out_alloc *= 2;
+    }
+
+    piece->crc = digest_crc32(0, piece->in, piece->in_len);
+    return 0;
+}
+
+static void *deflate_thread(void *cookie)
+{
+    GzipStream *s = (GzipStream *) cookie;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int ok = deflateInit2(&zs, BLOCKCOPY_GZIP_LEVEL, Z_DEFLATED,
+            -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->quit && s->next_piece >= s->piece_count) {
+            pthread_cond_wait(&s->work_cond, &s->lock);
+        }
+        if (s->quit) break;
+        GzipPiece *piece = &s->pieces[s->next_piece++];
+        pthread_mutex_unlock(&s->lock);
+
+        piece->status = ok ? deflate_piece(&zs, piece) : -1;
+
+        pthread_mutex_lock(&s->lock);
+        if (++s->pieces_done == s->piece_count) {
+            pthread_cond_signal(&s->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (ok) deflateEnd(&zs);
+    return NULL;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static ssize_t gzip_write(BlockCopyStream *stream, const char *data, size_t len)
+{
+    GzipStream *s = (GzipStream *) stream;
+    const unsigned char *in = (const unsigned char *) data;
+    if (len == 0) return 0;
+
+    int count = (len + BLOCKCOPY_GZIP_PIECE - 1) / BLOCKCOPY_GZIP_PIECE;
+    if (count > s->pieces_alloc) {
+        GzipPiece *pieces = realloc(s->pieces, count * sizeof(GzipPiece));
+        if (pieces == NULL) return -1;
+        memset(pieces + s->pieces_alloc, 0,
+               (count - s->pieces_alloc) * sizeof(GzipPiece));
+        s->pieces = pieces;
+        s->pieces_alloc = count;
+    }
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        GzipPiece *piece = &s->pieces[i];
+        size_t start = (size_t) i * BLOCKCOPY_GZIP_PIECE;
+        piece->in = in + start;
+        piece->in_len = len - start < BLOCKCOPY_GZIP_PIECE ?
+                len - start : BLOCKCOPY_GZIP_PIECE;
+        if (i == 0) {
+            piece->dict = s->window;
+            piece->dict_len = s->window_len;
+        } else {
+            // Pieces are at least as big as the window.
+            piece->dict = piece->in - GZIP_WINDOW_SIZE;
+            piece->dict_len = GZIP_WINDOW_SIZE;
+        }
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->piece_count = count;
+    s->next_piece = 0;
+    s->pieces_done = 0;
+    pthread_cond_broadcast(&s->work_cond);
+    while (s->pieces_done < count) {
+        pthread_cond_wait(&s->done_cond, &s->lock);
+    }
+    s->piece_count = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    for (i = 0; i < count; ++i) {
+        GzipPiece *piece = &s->pieces[i];
+        if (piece->status != 0) {
+            LOGE("gzip: deflate failed\n");
+            errno = EIO;
+            return -1;
+        }
+        if (s->inner->write(s->inner, (const char *) piece->out,
+                            piece->out_len) != (ssize_t) piece->out_len) {
+            return -1;
+        }
+        s->crc = crc32_combine(s->crc, piece->crc, piece->in_len);
+    }
+    s->isize += len;
+
+    // Keep the tail of this write as the dictionary for the next one.
+    if (len >= GZIP_WINDOW_SIZE) {
+        memcpy(s->window, in + len - GZIP_WINDOW_SIZE, GZIP_WINDOW_SIZE);
+        s->window_len = GZIP_WINDOW_SIZE;
+    } else {
+        size_t keep = GZIP_WINDOW_SIZE - len;
+        if (keep > s->window_len) keep = s->window_len;
+        memmove(s->window, s->window + s->window_len - keep, keep);
+        memcpy(s->window + keep, in, len);
+        s->window_len = keep + len;
+    }
+    return len;
+}
+
+static ssize_t gzip_read(BlockCopyStream *stream, char *data, size_t len)
+{
+    GzipStream *s = (GzipStream *) stream;
+    s->zs.next_out = (Bytef *) data;
+    s->zs.avail_out = len;
+    while (s->zs.avail_out > 0 && !s->stream_end) {
+        if (s->zs.avail_in == 0 && !s->input_eof) {
+            ssize_t r = s->inner->read(s->inner, (char *) s->input, GZIP_INPUT_SIZE);
+            if (r < 0) return -1;
+            if (r < GZIP_INPUT_SIZE) s->input_eof = 1;
+            s->zs.next_in = s->input;
+            s->zs.avail_in = r;
+        }
+        int ret = inflate(&s->zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            s->stream_end = 1;
+        } else if (ret != Z_OK && (ret != Z_BUF_ERROR || s->input_eof)) {
+            LOGE("gzip: corrupt or truncated image (%d)\n", ret);
+            errno = EIO;
+            return -1;
+        }
+    }
+    return len - s->zs.avail_out;
+}
+
+static int gzip_close(BlockCopyStream *stream)
+{
+    GzipStream *s = (GzipStream *) stream;
+    int r = 0;
+
+    if (s->threads != NULL) {
+        int i;
+        pthread_mutex_lock(&s->lock);
+        s->quit = 1;
+        pthread_cond_broadcast(&s->work_cond);
+        pthread_mutex_unlock(&s->lock);
+        for (i = 0; i < s->thread_count; ++i) {
+            pthread_join(s->threads[i], NULL);
+        }
+        free(s->threads);
+
+        // An empty final block ends the deflate stream, then the trailer.
+        if (s->started) {
+            unsigned char tail[10] = { 0x03, 0x00 };
+            put_le32(tail + 2, s->crc);
+            put_le32(tail + 6, (uint32_t) s->isize);
+            if (s->inner->write(s->inner, (const char *) tail,
+                                sizeof(tail)) != sizeof(tail)) {
+                r = -1;
+            }
+        }
+
+        for (i = 0; i < s->pieces_alloc; ++i) {
+            free(s->pieces[i].out);
+        }
+        free(s->pieces);
+        pthread_cond_destroy(&s->done_cond);
+        pthread_cond_destroy(&s->work_cond);
+        pthread_mutex_destroy(&s->lock);
+    }
+    if (s->input != NULL) {
+        inflateEnd(&s->zs);
+        free(s->input);
+    }
+
+    if (blockcopy_close(s->inner)) r = -1;
+    free(s);
+    return r;
+}
+
+static int start_deflate_threads(GzipStream *s)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    if (cpus > BLOCKCOPY_GZIP_MAX_THREADS) cpus = BLOCKCOPY_GZIP_MAX_THREADS;
+
+    s->threads = calloc(cpus, sizeof(pthread_t));
+    if (s->threads == NULL) return -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work_cond, NULL);
+    pthread_cond_init(&s->done_cond, NULL);
+    for (s->thread_count = 0; s->thread_count < cpus; ++s->thread_count) {
+        if (pthread_create(&s->threads[s->thread_count], NULL,
+                           deflate_thread, s)) {
+            break;
+        }
+    }
+    return s->thread_count > 0 ? 0 : -1;
+}
+
+/* Read the uncompressed size (mod 2^32) from the gzip trailer, so the
+ * progress bar can be driven while restoring.
+ */
+static uint64_t gzip_original_size(const char *path)
+{
+    unsigned char trailer[4];
+    uint64_t size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (lseek(fd, -4, SEEK_END) >= 0 && read(fd, trailer, 4) == 4) {
+        size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) |
+               ((uint32_t) trailer[3] << 24);
+    }
+    close(fd);
+    return size;
+}
+
+BlockCopyStream *blockcopy_open_gzip_file(const char *path, int for_write, MD5_CTX *md5)
+{
+    GzipStream *s = calloc(1, sizeof(GzipStream));
+    if (s == NULL) return NULL;
+
+    s->inner = blockcopy_open_file(path, for_write, md5);
+    if (s->inner == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->stream.close = gzip_close;
+
+    if (for_write) {
+        static const unsigned char header[10] = {
+            0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 /* unix */
+        };
+        s->stream.write = gzip_write;
+        s->crc = crc32(0L, Z_NULL, 0);
+        if (start_deflate_threads(s) ||
+            s->inner->write(s->inner, (const char *) header, sizeof(header)) != sizeof(header)) {
+            LOGE("gzip: can't start compressing %s\n", path);
+            gzip_close(&s->stream);
+            return NULL;
+        }
+        s->started = 1;
+    } else {
+        s->stream.read = gzip_read;
+        s->stream.size = gzip_original_size(path);
+        s->input = malloc(GZIP_INPUT_SIZE);
+        if (s->input == NULL || inflateInit2(&s->zs, 16 + MAX_WBITS) != Z_OK) {
+            free(s->input);
+            s->input = NULL;
+            gzip_close(&s->stream);
+            return NULL;
+        }
+    }
+    return &s->stream;
+}
@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "mtdutils/sparse_image.h"
+#include "blockcopy.h"
+
+/* Sparse image streams.  Writing classifies every block as it goes by;
+ * reading hands runs of zero and erased blocks to the sink as fills, so
+ * neither the SD card nor (for erased runs on MTD) the flash is touched.
+ */
+
+typedef struct {
+    BlockCopyStream stream;
+    BlockCopyStream *inner;
+    SparseWriter *writer;
+    SparseReader *reader;
+} SparseStream;
+
+static ssize_t inner_write(void *cookie, const char *data, size_t len)
+{
+    BlockCopyStream *inner = (BlockCopyStream *) cookie;
+    return inner->write(inner, data, len);
+}
+
+static ssize_t inner_read(void *cookie, char *data, size_t len)
+{
+    BlockCopyStream *inner = (BlockCopyStream *) cookie;
+    return inner->read(inner, data, len);
+}
+
+static ssize_t sparse_write(BlockCopyStream *stream, const char *data, size_t len)
+{
+    SparseStream *s = (SparseStream *) stream;
+    return sparse_writer_write(s->writer, data, len);
+}
+
+static ssize_t sparse_read(BlockCopyStream *stream, char *data, size_t len)
+{
+    SparseStream *s = (SparseStream *) stream;
+    return sparse_reader_read(s->reader, data, len);
+}
+
+static ssize_t sparse_read_run(BlockCopyStream *stream, char *data, size_t len, int *fill)
+{
+    SparseStream *s = (SparseStream *) stream;
+    return sparse_reader_next(s->reader, data, len, fill);
+}
+
+static int sparse_close(BlockCopyStream *stream)
+{
+    SparseStream *s = (SparseStream *) stream;
+    int r = 0;
+    if (s->writer != NULL && sparse_writer_close(s->writer)) r = -1;
+    if (s->reader != NULL) sparse_reader_close(s->reader);
+    if (blockcopy_close(s->inner)) r = -1;
+    free(s);
+    return r;
+}
+
+BlockCopyStream *blockcopy_open_sparse_file(const char *path, int for_write, MD5_CTX *md5)
+{
+    SparseStream *s = calloc(1, sizeof(SparseStream));
+    if (s == NULL) return NULL;
+
+    s->inner = blockcopy_open_file(path, for_write, md5);
+    if (s->inner == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->stream.close = sparse_close;
+
+    if (for_write) {
+        s->stream.write = sparse_write;
+        s->writer = sparse_writer_open(inner_write, s->inner);
+    } else {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            s->stream.size = sparse_image_size(fd);
+            close(fd);
+        }
+        s->stream.read = sparse_read;
+        s->stream.read_run = sparse_read_run;
+        s->reader = sparse_reader_open(inner_read, s->inner);
+    }
+    if (s->writer == NULL && s->reader == NULL) {
+        LOGE("Can't open sparse image %s\n", path);
+        sparse_close(&s->stream);
+        return NULL;
+    }
+    return &s->stream;
+}
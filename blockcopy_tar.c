@@ -0,0 +1,1059 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "blockcopy.h"
+
+/* tar archives of a mounted filesystem, as streams for blockcopy_run().
+ *
+ * The source walks the tree and produces the archive on the copier's
+ * reader thread, so file data is read ahead while the previous chunk is
+ * written and many small files go out in one large write.  Each
+ * directory is read completely (and sorted) before descending into it.
+ *
+ * The sink parses the archive as it is written to it and recreates the
+ * entries under a destination directory.  Archives are ustar with pax
+ * extended headers for long names and extended attributes, which is
+ * what busybox and GNU tar produce and understand.
+ */
+
+#define TAR_BLOCK 512
+
+#define TAR_REG     '0'
+#define TAR_LINK    '1'
+#define TAR_SYMLINK '2'
+#define TAR_CHR     '3'
+#define TAR_BLK     '4'
+#define TAR_DIR     '5'
+#define TAR_FIFO    '6'
+#define TAR_CONTIG  '7'
+#define TAR_PAX     'x'
+#define TAR_PAX_GLOBAL 'g'
+#define TAR_GNU_LONGNAME 'L'
+#define TAR_GNU_LONGLINK 'K'
+
+#define PAX_XATTR "SCHILY.xattr."
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+static size_t tar_padding(uint64_t size)
+{
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+static void tar_octal(char *field, size_t size, uint64_t value)
+{
+    field[--size] = '\0';
+    while (size > 0) {
+        field[--size] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+static uint64_t tar_parse_octal(const char *field, size_t size)
+{
+    uint64_t value = 0;
+    size_t i = 0;
+    while (i < size && field[i] == ' ') ++i;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+static unsigned int tar_checksum(const TarHeader *header)
+{
+    const unsigned char *p = (const unsigned char *) header;
+    unsigned int sum = 0;
+    size_t i;
+    for (i = 0; i < TAR_BLOCK; ++i) {
+        if (i >= offsetof(TarHeader, chksum) &&
+                i < offsetof(TarHeader, chksum) + sizeof(header->chksum)) {
+            sum += ' ';
+        } else {
+            sum += p[i];
+        }
+    }
+    return sum;
+}
+
+/* Archive source.
+ */
+typedef struct {
+    char *path;
+    char **names;
+    int count;
+    int next;
+} TarDir;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    char *name;
+} TarHardLink;
+
+typedef struct {
+    BlockCopyStream stream;
+    const char *exclude;
+    const BlockCopyTarHooks *hooks;
+    int root_done;
+    char root[PATH_MAX];
+
+    TarDir *dirs;
+    int depth;
+    int dirs_alloc;
+
+    TarHardLink *links;
+    int link_count;
+    int links_alloc;
+
+    // Bytes queued for the current entry: headers, then file data from
+    // fd, then padding.
+    char *pending;
+    size_t pending_len;
+    size_t pending_pos;
+    size_t pending_alloc;
+    int fd;
+    uint64_t data_left;
+    size_t pad_left;
+    char path[PATH_MAX];
+    struct stat st;
+    MD5_CTX md5;            // of the file data, while fd is open
+
+    int finished;
+    size_t trailer_left;
+    int error;
+} TarSource;
+
+static int name_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void free_dir(TarDir *dir)
+{
+    int i;
+    for (i = 0; i < dir->count; ++i) free(dir->names[i]);
+    free(dir->names);
+    free(dir->path);
+}
+
+static int push_dir(TarSource *s, const char *path)
+{
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        LOGE("tar: can't open %s\n(%s)\n", path, strerror(errno));
+        s->error = 1;
+        return 0;
+    }
+    if (s->depth == s->dirs_alloc) {
+        int alloc = s->dirs_alloc ? s->dirs_alloc * 2 : 16;
+        TarDir *dirs = realloc(s->dirs, alloc * sizeof(TarDir));
+        if (dirs == NULL) {
+            closedir(d);
+            return -1;
+        }
+        s->dirs = dirs;
+        s->dirs_alloc = alloc;
+    }
+
+    TarDir *dir = &s->dirs[s->depth];
+    memset(dir, 0, sizeof(*dir));
+    dir->path = strdup(path);
+    int alloc = 0;
+    struct dirent *de;
+    while (dir->path != NULL && (de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        if (dir->count == alloc) {
+            alloc = alloc ? alloc * 2 : 32;
+            char **names = realloc(dir->names, alloc * sizeof(char *));
+            if (names == NULL) break;
+            dir->names = names;
+        }
+        if ((dir->names[dir->count] = strdup(de->d_name)) == NULL) break;
+        dir->count++;
+    }
+    closedir(d);
+    if (dir->path == NULL || de != NULL) {
+        free_dir(dir);
+        return -1;
+    }
+    qsort(dir->names, dir->count, sizeof(char *), name_compare);
+    s->depth++;
+    return 0;
+}
+
+static char *pending_reserve(TarSource *s, size_t len)
+{
+    if (s->pending_len + len > s->pending_alloc) {
+        size_t alloc = s->pending_alloc ? s->pending_alloc : 4 * TAR_BLOCK;
+        while (alloc < s->pending_len + len) alloc *= 2;
+        char *p = realloc(s->pending, alloc);
+        if (p == NULL) return NULL;
+        s->pending = p;
+        s->pending_alloc = alloc;
+    }
+    char *p = s->pending + s->pending_len;
+    memset(p, 0, len);
+    s->pending_len += len;
+    return p;
+}
+
+static int digits(size_t n)
+{
+    int d = 1;
+    while (n >= 10) {
+        n /= 10;
+        ++d;
+    }
+    return d;
+}
+
+// Appends "<len> <key>=<value>\n" to a pax record buffer.
+static int pax_add(char **buf, size_t *len, const char *key,
+        const char *value, size_t value_len)
+{
+    size_t base = strlen(key) + value_len + 3;
+    size_t n = base + digits(base);
+    if (digits(n) != digits(base)) n = base + digits(n);
+
+    char *p = realloc(*buf, *len + n + 1);
+    if (p == NULL) return -1;
+    *buf = p;
+    p += *len;
+    p += sprintf(p, "%u %s=", (unsigned int) n, key);
+    memcpy(p, value, value_len);
+    p[value_len] = '\n';
+    *len += n;
+    return 0;
+}
+
+static int pax_add_xattrs(char **buf, size_t *len, const char *path)
+{
+    ssize_t list_len = llistxattr(path, NULL, 0);
+    if (list_len <= 0) return 0;
+    char *list = malloc(list_len);
+    if (list == NULL) return -1;
+    list_len = llistxattr(path, list, list_len);
+
+    int ret = 0;
+    char *name;
+    for (name = list; ret == 0 && list_len > 0 && name < list + list_len;
+            name += strlen(name) + 1) {
+        ssize_t value_len = lgetxattr(path, name, NULL, 0);
+        if (value_len < 0) continue;
+        char *value = malloc(value_len + 1);
+        char *key = malloc(strlen(PAX_XATTR) + strlen(name) + 1);
+        if (value == NULL || key == NULL) {
+            ret = -1;
+        } else {
+            value_len = lgetxattr(path, name, value, value_len);
+            if (value_len >= 0) {
+                sprintf(key, "%s%s", PAX_XATTR, name);
+                ret = pax_add(buf, len, key, value, value_len);
+            }
+        }
+        free(value);
+        free(key);
+    }
+    free(list);
+    return ret;
+}
+
+static void fill_header(TarHeader *h, const struct stat *st, char type, uint64_t size)
+{
+    tar_octal(h->mode, sizeof(h->mode), st->st_mode & 07777);
+    tar_octal(h->uid, sizeof(h->uid), st->st_uid);
+    tar_octal(h->gid, sizeof(h->gid), st->st_gid);
+    tar_octal(h->size, sizeof(h->size), size);
+    tar_octal(h->mtime, sizeof(h->mtime), st->st_mtime);
+    h->typeflag = type;
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+    if (type == TAR_CHR || type == TAR_BLK) {
+        tar_octal(h->devmajor, sizeof(h->devmajor), major(st->st_rdev));
+        tar_octal(h->devminor, sizeof(h->devminor), minor(st->st_rdev));
+    }
+}
+
+static void finish_header(TarHeader *h)
+{
+    sprintf(h->chksum, "%06o", tar_checksum(h));
+    h->chksum[7] = ' ';
+}
+
+// Stores name in the ustar name and prefix fields; returns -1 if it
+// doesn't fit and needs a pax path record.
+static int set_ustar_name(TarHeader *h, const char *name)
+{
+    size_t len = strlen(name);
+    if (len <= sizeof(h->name)) {
+        memcpy(h->name, name, len);
+        return 0;
+    }
+    const char *slash = name + len - sizeof(h->name) - 1;
+    if (slash < name) slash = name;
+    for (slash = strchr(slash, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        size_t prefix_len = slash - name;
+        if (prefix_len > sizeof(h->prefix)) break;
+        if (slash[1] != '\0') {
+            memcpy(h->prefix, name, prefix_len);
+            memcpy(h->name, slash + 1, len - prefix_len - 1);
+            return 0;
+        }
+    }
+    memcpy(h->name, name, sizeof(h->name));
+    return -1;
+}
+
+static void report_entry(TarSource *s, const char *path, const struct stat *st,
+        const uint8_t *md5)
+{
+    if (s->hooks != NULL && s->hooks->entry != NULL) {
+        s->hooks->entry(s->hooks->cookie, path + 1, st, md5);
+    }
+}
+
+static int queue_entry(TarSource *s, const char *path, const struct stat *st)
+{
+    char name[PATH_MAX + 1];
+    char link[PATH_MAX];
+    char type;
+    uint64_t size = 0;
+
+    if (S_ISREG(st->st_mode) && s->hooks != NULL && s->hooks->unchanged != NULL &&
+            s->hooks->unchanged(s->hooks->cookie, path + 1, st)) {
+        report_entry(s, path, st, NULL);
+        return 0;
+    }
+
+    snprintf(name, sizeof(name), "%s", path + 1);
+    link[0] = '\0';
+    if (S_ISREG(st->st_mode)) {
+        type = TAR_REG;
+        size = st->st_size;
+        if (st->st_nlink > 1) {
+            int i;
+            for (i = 0; i < s->link_count; ++i) {
+                if (s->links[i].dev == st->st_dev && s->links[i].ino == st->st_ino) {
+                    type = TAR_LINK;
+                    size = 0;
+                    snprintf(link, sizeof(link), "%s", s->links[i].name);
+                    break;
+                }
+            }
+            if (type == TAR_REG) {
+                if (s->link_count == s->links_alloc) {
+                    int alloc = s->links_alloc ? s->links_alloc * 2 : 16;
+                    TarHardLink *links = realloc(s->links, alloc * sizeof(TarHardLink));
+                    if (links == NULL) return -1;
+                    s->links = links;
+                    s->links_alloc = alloc;
+                }
+                TarHardLink *l = &s->links[s->link_count];
+                l->dev = st->st_dev;
+                l->ino = st->st_ino;
+                if ((l->name = strdup(name)) == NULL) return -1;
+                s->link_count++;
+            }
+        }
+    } else if (S_ISDIR(st->st_mode)) {
+        type = TAR_DIR;
+        strcat(name, "/");
+    } else if (S_ISLNK(st->st_mode)) {
+        type = TAR_SYMLINK;
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len < 0) {
+            LOGE("tar: can't read link %s\n(%s)\n", path, strerror(errno));
+            s->error = 1;
+            return 0;
+        }
+        link[len] = '\0';
+    } else if (S_ISCHR(st->st_mode)) {
+        type = TAR_CHR;
+    } else if (S_ISBLK(st->st_mode)) {
+        type = TAR_BLK;
+    } else if (S_ISFIFO(st->st_mode)) {
+        type = TAR_FIFO;
+    } else {
+        LOGW("tar: skipping socket %s\n", path);
+        return 0;
+    }
+
+    if (type == TAR_REG && size > 0) {
+        s->fd = open(path, O_RDONLY);
+        if (s->fd < 0) {
+            LOGE("tar: can't open %s\n(%s)\n", path, strerror(errno));
+            s->error = 1;
+            return 0;
+        }
+    }
+
+    TarHeader header;
+    memset(&header, 0, sizeof(header));
+    fill_header(&header, st, type, size);
+    char *pax = NULL;
+    size_t pax_len = 0;
+    int ret = 0;
+    if (set_ustar_name(&header, name)) {
+        ret = pax_add(&pax, &pax_len, "path", name, strlen(name));
+    }
+    if (strlen(link) > sizeof(header.linkname)) {
+        if (ret == 0) ret = pax_add(&pax, &pax_len, "linkpath", link, strlen(link));
+    }
+    memcpy(header.linkname, link, strnlen(link, sizeof(header.linkname)));
+    if (ret == 0) ret = pax_add_xattrs(&pax, &pax_len, path);
+    finish_header(&header);
+
+    s->pending_len = s->pending_pos = 0;
+    if (ret == 0 && pax_len > 0) {
+        TarHeader x;
+        const char *base = strrchr(path, '/') + 1;
+        memset(&x, 0, sizeof(x));
+        fill_header(&x, st, TAR_PAX, pax_len);
+        tar_octal(x.mode, sizeof(x.mode), 0644);
+        snprintf(x.name, sizeof(x.name), "PaxHeaders/%s", base);
+        finish_header(&x);
+        char *p = pending_reserve(s, TAR_BLOCK + pax_len + tar_padding(pax_len));
+        if (p == NULL) {
+            ret = -1;
+        } else {
+            memcpy(p, &x, TAR_BLOCK);
+            memcpy(p + TAR_BLOCK, pax, pax_len);
+        }
+    }
+    free(pax);
+    char *p = ret == 0 ? pending_reserve(s, TAR_BLOCK) : NULL;
+    if (p == NULL) {
+        if (s->fd >= 0) close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    memcpy(p, &header, TAR_BLOCK);
+    s->data_left = s->fd >= 0 ? size : 0;
+    s->pad_left = s->fd >= 0 ? tar_padding(size) : 0;
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    s->st = *st;
+    MD5_init(&s->md5);
+    if (s->fd < 0) {
+        // Nothing to read; empty files still get their (empty) digest.
+        report_entry(s, path, st, type == TAR_REG ? MD5_final(&s->md5) : NULL);
+    }
+    return 0;
+}
+
+static int excluded(TarSource *s, const char *path)
+{
+    return s->exclude != NULL && fnmatch(s->exclude, path + 1, 0) == 0;
+}
+
+// Queues the next entry of the walk; returns 0 when the walk is done.
+static int next_entry(TarSource *s)
+{
+    struct stat st;
+    if (!s->root_done) {
+        s->root_done = 1;
+        if (lstat(s->root, &st)) {
+            LOGE("tar: can't stat %s\n(%s)\n", s->root, strerror(errno));
+            return -1;
+        }
+        if (queue_entry(s, s->root, &st) || push_dir(s, s->root)) return -1;
+        return 1;
+    }
+
+    while (s->depth > 0) {
+        TarDir *dir = &s->dirs[s->depth - 1];
+        if (dir->next == dir->count) {
+            free_dir(dir);
+            s->depth--;
+            continue;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir->path, dir->names[dir->next++]);
+        if (excluded(s, path)) continue;
+        if (lstat(path, &st)) {
+            LOGE("tar: can't stat %s\n(%s)\n", path, strerror(errno));
+            s->error = 1;
+            continue;
+        }
+        if (queue_entry(s, path, &st)) return -1;
+        if (S_ISDIR(st.st_mode) && push_dir(s, path)) return -1;
+        return 1;
+    }
+    return 0;
+}
+
+static ssize_t tar_source_read(BlockCopyStream *stream, char *data, size_t len)
+{
+    TarSource *s = (TarSource *) stream;
+    size_t got = 0;
+    while (got < len) {
+        size_t want = len - got;
+        if (s->pending_pos < s->pending_len) {
+            size_t n = s->pending_len - s->pending_pos;
+            if (n > want) n = want;
+            memcpy(data + got, s->pending + s->pending_pos, n);
+            s->pending_pos += n;
+            got += n;
+        } else if (s->data_left > 0) {
+            if (want > s->data_left) want = s->data_left;
+            ssize_t r = read(s->fd, data + got, want);
+            if (r <= 0) {
+                // The file shrank (or broke) under us; keep the archive
+                // consistent with the size already in the header.
+                if (r < 0 && errno == EINTR) continue;
+                LOGE("tar: short read on %s\n", s->path);
+                s->error = 1;
+                memset(data + got, 0, want);
+                r = want;
+            }
+            MD5_update(&s->md5, data + got, r);
+            s->data_left -= r;
+            got += r;
+        } else if (s->fd >= 0) {
+            close(s->fd);
+            s->fd = -1;
+            report_entry(s, s->path, &s->st, MD5_final(&s->md5));
+        } else if (s->pad_left > 0) {
+            size_t n = s->pad_left < want ? s->pad_left : want;
+            memset(data + got, 0, n);
+            s->pad_left -= n;
+            got += n;
+        } else if (!s->finished) {
+            int r = next_entry(s);
+            if (r < 0) return -1;
+            if (r == 0) {
+                s->finished = 1;
+                s->trailer_left = 2 * TAR_BLOCK;
+            }
+        } else if (s->trailer_left > 0) {
+            size_t n = s->trailer_left < want ? s->trailer_left : want;
+            memset(data + got, 0, n);
+            s->trailer_left -= n;
+            got += n;
+        } else {
+            break;
+        }
+    }
+    return got;
+}
+
+static int tar_source_close(BlockCopyStream *stream)
+{
+    TarSource *s = (TarSource *) stream;
+    int r = s->error ? -1 : 0;
+    int i;
+    if (s->fd >= 0) close(s->fd);
+    while (s->depth > 0) free_dir(&s->dirs[--s->depth]);
+    free(s->dirs);
+    for (i = 0; i < s->link_count; ++i) free(s->links[i].name);
+    free(s->links);
+    free(s->pending);
+    free(s);
+    return r;
+}
+
+BlockCopyStream *blockcopy_open_tar_source(const char *dir, const char *exclude,
+        const BlockCopyTarHooks *hooks)
+{
+    TarSource *s = calloc(1, sizeof(TarSource));
+    if (s == NULL) return NULL;
+    snprintf(s->root, sizeof(s->root), "%s", dir);
+    size_t len = strlen(s->root);
+    while (len > 1 && s->root[len - 1] == '/') s->root[--len] = '\0';
+    if (s->root[0] != '/' || len < 2) {
+        LOGE("tar: %s is not an absolute directory\n", dir);
+        free(s);
+        return NULL;
+    }
+    s->exclude = exclude;
+    s->hooks = hooks;
+    s->fd = -1;
+    s->stream.read = tar_source_read;
+    s->stream.close = tar_source_close;
+
+    // Only an estimate for the progress bar: the space used on the
+    // filesystem is close to the size of its archive.
+    struct statfs st;
+    if (statfs(s->root, &st) == 0) {
+        s->stream.size = (uint64_t) (st.f_blocks - st.f_bfree) * st.f_bsize;
+    }
+    return &s->stream;
+}
+
+/* Archive sink.
+ */
+enum {
+    SINK_HEADER,
+    SINK_DATA,
+    SINK_META,
+    SINK_SKIP,
+    SINK_DONE,
+};
+
+typedef struct {
+    char *path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+} TarDirFixup;
+
+typedef struct {
+    BlockCopyStream stream;
+    char dest[PATH_MAX];
+
+    int state;
+    TarHeader header;
+    size_t header_len;
+    uint64_t left;
+    size_t pad;
+    int zero_blocks;
+
+    // Extended header data, and what it said about the next entry.
+    char meta_type;
+    char *meta;
+    size_t meta_len;
+    char *long_name;
+    char *long_link;
+    char *xattrs;           // pax records, kept as they came
+    size_t xattrs_len;
+
+    // File being written.
+    int fd;
+    char path[PATH_MAX];
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+
+    TarDirFixup *dirs;
+    int dir_count;
+    int dirs_alloc;
+    int error;
+} TarSink;
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static void make_parents(TarSink *s, char *path)
+{
+    char *p = path + strlen(s->dest);
+    while ((p = strchr(p + 1, '/')) != NULL) {
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+}
+
+// Walks the "<len> key=value\n" records of a pax header.
+static void apply_pax(TarSink *s)
+{
+    char *p = s->meta;
+    char *end = s->meta + s->meta_len;
+    while (p < end) {
+        char *space;
+        unsigned long len = strtoul(p, &space, 10);
+        if (*space != ' ' || len == 0 || len > (unsigned long) (end - p)) break;
+        char *key = space + 1;
+        char *eq = memchr(key, '=', p + len - key);
+        if (eq == NULL) break;
+        char *value = eq + 1;
+        size_t value_len = p + len - 1 - value;
+
+        if (!strncmp(key, "path=", 5)) {
+            free(s->long_name);
+            s->long_name = strndup(value, value_len);
+        } else if (!strncmp(key, "linkpath=", 9)) {
+            free(s->long_link);
+            s->long_link = strndup(value, value_len);
+        } else if (!strncmp(key, PAX_XATTR, strlen(PAX_XATTR))) {
+            char *x = realloc(s->xattrs, s->xattrs_len + len);
+            if (x != NULL) {
+                memcpy(x + s->xattrs_len, p, len);
+                s->xattrs = x;
+                s->xattrs_len += len;
+            }
+        }
+        p += len;
+    }
+}
+
+static void apply_xattrs(TarSink *s, const char *path)
+{
+    char *p = s->xattrs;
+    char *end = s->xattrs + s->xattrs_len;
+    while (p < end) {
+        char *space;
+        unsigned long len = strtoul(p, &space, 10);
+        char *name = space + 1 + strlen(PAX_XATTR);
+        char *eq = memchr(name, '=', p + len - name);
+        *eq = '\0';
+        if (lsetxattr(path, name, eq + 1, p + len - 1 - (eq + 1), 0)) {
+            LOGW("tar: can't set %s on %s (%s)\n", name, path, strerror(errno));
+        }
+        *eq = '=';
+        p += len;
+    }
+}
+
+static void clear_extended(TarSink *s)
+{
+    free(s->long_name);
+    free(s->long_link);
+    free(s->xattrs);
+    s->long_name = s->long_link = s->xattrs = NULL;
+    s->xattrs_len = 0;
+}
+
+static void finish_file(TarSink *s)
+{
+    if (s->fd >= 0) {
+        if (fchown(s->fd, s->uid, s->gid) || fchmod(s->fd, s->mode) || close(s->fd)) {
+            LOGE("tar: can't finish %s\n(%s)\n", s->path, strerror(errno));
+            s->error = 1;
+        }
+        s->fd = -1;
+        apply_xattrs(s, s->path);
+        struct timeval times[2];
+        times[0].tv_sec = times[1].tv_sec = s->mtime;
+        times[0].tv_usec = times[1].tv_usec = 0;
+        utimes(s->path, times);
+    }
+    clear_extended(s);
+}
+
+static void skip(TarSink *s, uint64_t size)
+{
+    s->left = size + tar_padding(size);
+    s->state = s->left > 0 ? SINK_SKIP : SINK_HEADER;
+}
+
+static int handle_header(TarSink *s)
+{
+    TarHeader *h = &s->header;
+    const char *p = (const char *) h;
+    size_t i;
+    for (i = 0; i < TAR_BLOCK && p[i] == 0; ++i) {
+    }
+    if (i == TAR_BLOCK) {
+        if (++s->zero_blocks == 2) s->state = SINK_DONE;
+        return 0;
+    }
+    s->zero_blocks = 0;
+    if (tar_parse_octal(h->chksum, sizeof(h->chksum)) != tar_checksum(h)) {
+        LOGE("tar: bad header checksum\n");
+        return -1;
+    }
+
+    uint64_t size = tar_parse_octal(h->size, sizeof(h->size));
+    char type = h->typeflag;
+    if (type == TAR_PAX || type == TAR_GNU_LONGNAME || type == TAR_GNU_LONGLINK) {
+        free(s->meta);
+        s->meta = malloc(size + 1);
+        if (s->meta == NULL) return -1;
+        s->meta_type = type;
+        s->meta_len = 0;
+        s->left = size;
+        s->pad = tar_padding(size);
+        s->state = size > 0 ? SINK_META : SINK_HEADER;
+        return 0;
+    }
+    if (type == TAR_PAX_GLOBAL) {
+        skip(s, size);
+        return 0;
+    }
+
+    char name[PATH_MAX];
+    if (s->long_name != NULL) {
+        snprintf(name, sizeof(name), "%s", s->long_name);
+    } else if (h->prefix[0] != '\0') {
+        snprintf(name, sizeof(name), "%.*s/%.*s", (int) strnlen(h->prefix, sizeof(h->prefix)),
+                h->prefix, (int) strnlen(h->name, sizeof(h->name)), h->name);
+    } else {
+        snprintf(name, sizeof(name), "%.*s", (int) strnlen(h->name, sizeof(h->name)), h->name);
+    }
+    char linkname[PATH_MAX];
+    if (s->long_link != NULL) {
+        snprintf(linkname, sizeof(linkname), "%s", s->long_link);
+    } else {
+        snprintf(linkname, sizeof(linkname), "%.*s", (int) strnlen(h->linkname, sizeof(h->linkname)),
+                h->linkname);
+    }
+
+    const char *rel = name;
+    while (*rel == '/') ++rel;
+    size_t len = strlen(rel);
+    while (len > 0 && rel[len - 1] == '/') --len;
+    if (!strcmp(rel, "..") || !strncmp(rel, "../", 3) || strstr(rel, "/../") != NULL) {
+        LOGE("tar: refusing to extract %s\n", name);
+        s->error = 1;
+        clear_extended(s);
+        skip(s, size);
+        return 0;
+    }
+    snprintf(s->path, sizeof(s->path), "%s/%.*s", s->dest, (int) len, rel);
+    s->mode = tar_parse_octal(h->mode, sizeof(h->mode)) & 07777;
+    s->uid = tar_parse_octal(h->uid, sizeof(h->uid));
+    s->gid = tar_parse_octal(h->gid, sizeof(h->gid));
+    s->mtime = tar_parse_octal(h->mtime, sizeof(h->mtime));
+    make_parents(s, s->path);
+
+    int r = 0;
+    struct stat st;
+    switch (type) {
+    case TAR_REG:
+    case TAR_CONTIG:
+    case '\0':
+        unlink(s->path);
+        s->fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (s->fd < 0) {
+            r = -1;
+            skip(s, size);
+        } else if (size == 0) {
+            finish_file(s);
+        } else {
+            s->left = size;
+            s->pad = tar_padding(size);
+            s->state = SINK_DATA;
+        }
+        break;
+
+    case TAR_DIR:
+        if (lstat(s->path, &st) || !S_ISDIR(st.st_mode)) {
+            unlink(s->path);
+            r = mkdir(s->path, 0700);
+        }
+        if (r == 0) {
+            if (s->dir_count == s->dirs_alloc) {
+                int alloc = s->dirs_alloc ? s->dirs_alloc * 2 : 64;
+                TarDirFixup *dirs = realloc(s->dirs, alloc * sizeof(TarDirFixup));
+                if (dirs == NULL) return -1;
+                s->dirs = dirs;
+                s->dirs_alloc = alloc;
+            }
+            TarDirFixup *d = &s->dirs[s->dir_count];
+            if ((d->path = strdup(s->path)) == NULL) return -1;
+            d->mode = s->mode;
+            d->uid = s->uid;
+            d->gid = s->gid;
+            d->mtime = s->mtime;
+            s->dir_count++;
+            apply_xattrs(s, s->path);
+        }
+        skip(s, size);
+        break;
+
+    case TAR_LINK: {
+        char target[PATH_MAX];
+        const char *t = linkname;
+        while (*t == '/') ++t;
+        snprintf(target, sizeof(target), "%s/%s", s->dest, t);
+        unlink(s->path);
+        r = link(target, s->path);
+        skip(s, size);
+        break;
+    }
+
+    case TAR_SYMLINK:
+        unlink(s->path);
+        r = symlink(linkname, s->path);
+        if (r == 0) {
+            lchown(s->path, s->uid, s->gid);
+            apply_xattrs(s, s->path);
+        }
+        skip(s, size);
+        break;
+
+    case TAR_CHR:
+    case TAR_BLK:
+    case TAR_FIFO: {
+        mode_t fmt = type == TAR_CHR ? S_IFCHR : type == TAR_BLK ? S_IFBLK : S_IFIFO;
+        dev_t dev = makedev(tar_parse_octal(h->devmajor, sizeof(h->devmajor)),
+                            tar_parse_octal(h->devminor, sizeof(h->devminor)));
+        unlink(s->path);
+        r = mknod(s->path, fmt | s->mode, dev);
+        if (r == 0) {
+            chown(s->path, s->uid, s->gid);
+            chmod(s->path, s->mode);
+            apply_xattrs(s, s->path);
+        }
+        skip(s, size);
+        break;
+    }
+
+    default:
+        LOGW("tar: skipping %s of unknown type '%c'\n", name, type);
+        skip(s, size);
+        break;
+    }
+
+    if (r != 0) {
+        LOGE("tar: can't create %s\n(%s)\n", s->path, strerror(errno));
+        s->error = 1;
+    }
+    if (s->state != SINK_DATA) clear_extended(s);
+    return 0;
+}
+
+static void finish_meta(TarSink *s)
+{
+    s->meta[s->meta_len] = '\0';
+    if (s->meta_type == TAR_PAX) {
+        apply_pax(s);
+    } else if (s->meta_type == TAR_GNU_LONGNAME) {
+        free(s->long_name);
+        s->long_name = strdup(s->meta);
+    } else {
+        free(s->long_link);
+        s->long_link = strdup(s->meta);
+    }
+    free(s->meta);
+    s->meta = NULL;
+}
+
+static ssize_t tar_sink_write(BlockCopyStream *stream, const char *data, size_t len)
+{
+    TarSink *s = (TarSink *) stream;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t n = len - pos;
+        switch (s->state) {
+        case SINK_HEADER:
+            if (n > TAR_BLOCK - s->header_len) n = TAR_BLOCK - s->header_len;
+            memcpy((char *) &s->header + s->header_len, data + pos, n);
+            s->header_len += n;
+            if (s->header_len == TAR_BLOCK) {
+                s->header_len = 0;
+                if (handle_header(s)) {
+                    errno = EINVAL;
+                    return -1;
+                }
+            }
+            break;
+
+        case SINK_DATA:
+        case SINK_META:
+            if (n > s->left) n = s->left;
+            if (s->state == SINK_META) {
+                memcpy(s->meta + s->meta_len, data + pos, n);
+                s->meta_len += n;
+            } else if (s->fd >= 0 && write_all(s->fd, data + pos, n)) {
+                LOGE("tar: can't write %s\n(%s)\n", s->path, strerror(errno));
+                s->error = 1;
+                close(s->fd);
+                s->fd = -1;
+            }
+            s->left -= n;
+            if (s->left == 0) {
+                if (s->state == SINK_META) {
+                    finish_meta(s);
+                } else {
+                    finish_file(s);
+                }
+                s->left = s->pad;
+                s->state = s->left > 0 ? SINK_SKIP : SINK_HEADER;
+            }
+            break;
+
+        case SINK_SKIP:
+            if (n > s->left) n = s->left;
+            s->left -= n;
+            if (s->left == 0) s->state = SINK_HEADER;
+            break;
+
+        default:
+            // Anything after the end-of-archive blocks is ignored.
+            break;
+        }
+        pos += n;
+    }
+    return len;
+}
+
+static int tar_sink_close(BlockCopyStream *stream)
+{
+    TarSink *s = (TarSink *) stream;
+    int r = s->error ? -1 : 0;
+    if (s->state != SINK_DONE && (s->state != SINK_HEADER || s->header_len != 0)) {
+        LOGE("tar: archive is truncated\n");
+        r = -1;
+    }
+    if (s->fd >= 0) close(s->fd);
+
+    // Directories last, innermost first, so creating their contents
+    // doesn't undo their times and a read-only mode doesn't get in the way.
+    while (s->dir_count > 0) {
+        TarDirFixup *d = &s->dirs[--s->dir_count];
+        struct timeval times[2];
+        times[0].tv_sec = times[1].tv_sec = d->mtime;
+        times[0].tv_usec = times[1].tv_usec = 0;
+        chown(d->path, d->uid, d->gid);
+        chmod(d->path, d->mode);
+        utimes(d->path, times);
+        free(d->path);
+    }
+    free(s->dirs);
+    free(s->meta);
+    clear_extended(s);
+    free(s);
+    return r;
+}
+
+BlockCopyStream *blockcopy_open_tar_sink(const char *dest)
+{
+    TarSink *s = calloc(1, sizeof(TarSink));
+    if (s == NULL) return NULL;
+    snprintf(s->dest, sizeof(s->dest), "%s", dest);
+    size_t len = strlen(s->dest);
+    while (len > 0 && s->dest[len - 1] == '/') s->dest[--len] = '\0';
+    s->fd = -1;
+    s->state = SINK_HEADER;
+    s->stream.write = tar_sink_write;
+    s->stream.close = tar_sink_close;
+    return &s->stream;
+}
@@ -0,0 +1,35 @@
+LOCAL_PATH := $(call my-dir)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := digest.c
+LOCAL_C_INCLUDES += external/zlib
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE := libdigestutils
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := digest.c
+LOCAL_C_INCLUDES += external/zlib
+LOCAL_MODULE := libdigestutils
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := digest_bench.c
+LOCAL_MODULE := digest_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libdigestutils libmincrypt libz libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := digest_bench.c
+LOCAL_MODULE := digest_bench
+LOCAL_STATIC_LIBRARIES := libdigestutils libmincrypt libz
+
+include $(BUILD_HOST_EXECUTABLE)
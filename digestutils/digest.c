@@ -0,0 +1,506 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "zlib.h"
+#include "mincrypt/sha.h"
+
+#include "digest.h"
+
+/* The accelerated kernels are compiled with per-function target
+ * attributes, so the rest of the binary still runs on CPUs without the
+ * extensions.  That needs GCC 4.9 or clang; older compilers (the ARMv6
+ * device toolchain among them) only get the fallbacks.
+ */
+#if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#if defined(__x86_64__) || defined(__i386__)
+#define DIGEST_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define DIGEST_ARMV8 1
+#include <arm_acle.h>
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    void (*blocks)(uint32_t state[5], const uint8_t *data, size_t blocks);
+} Sha1Impl;
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    uint32_t (*update)(uint32_t crc, const uint8_t *data, size_t len);
+} Crc32Impl;
+
+static int always(void)
+{
+    return 1;
+}
+
+// mincrypt only takes whole messages, but starting it from our state
+// and feeding it whole blocks leaves the new state in ctx.state.
+#define MINCRYPT_MAX_BLOCKS (1 << 20)
+
+static void sha1_blocks_mincrypt(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    memcpy(ctx.state, state, 5 * sizeof(uint32_t));
+    while (blocks > 0) {
+        size_t n = blocks < MINCRYPT_MAX_BLOCKS ? blocks : MINCRYPT_MAX_BLOCKS;
+        SHA_update(&ctx, data, n * 64);
+        data += n * 64;
+        blocks -= n;
+    }
+    memcpy(state, ctx.state, 5 * sizeof(uint32_t));
+}
+
+static uint32_t crc32_zlib(uint32_t crc, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        uInt n = len < (1U << 30) ? len : (1U << 30);
+        crc = crc32(crc, data, n);
+        data += n;
+        len -= n;
+    }
+    return crc;
+}
+
+#ifdef DIGEST_X86
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+
+static int x86_has(int leaf, int reg, unsigned int bit)
+{
+    unsigned int r[4];
+    if ((int) __get_cpuid_max(0, NULL) < leaf) return 0;
+    __cpuid_count(leaf, 0, r[0], r[1], r[2], r[3]);
+    return (r[reg] & bit) != 0;
+}
+
+static int x86_has_sha(void)
+{
+    return x86_has(7, 1, bit_SHA) && x86_has(1, 2, bit_SSSE3) && x86_has(1, 2, bit_SSE4_1);
+}
+
+static int x86_has_pclmul(void)
+{
+    return x86_has(1, 2, bit_PCLMUL) && x86_has(1, 2, bit_SSE4_1);
+}
+
+// Four rounds starting at round 4*g (g >= 4), which also advance the
+// message schedule: m0 holds the words for these rounds, m1-m3 the
+// ones after.  e0 carries E into the rounds and e1 receives it for the
+// next group.
+#define SHA_NI_ROUNDS(f, m0, m1, m2, m3, e0, e1) \
+    e0 = _mm_sha1nexte_epu32(e0, m0); \
+    e1 = abcd; \
+    m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, f); \
+    m3 = _mm_sha1msg1_epu32(m3, m0); \
+    m2 = _mm_xor_si128(m2, m0)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1_blocks_shani(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i e1, m0, m1, m2, m3;
+
+    while (blocks-- > 0) {
+        __m128i abcd_saved = abcd;
+        __m128i e_saved = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), mask);
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        m0 = _mm_sha1msg2_epu32(m0, m3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m2 = _mm_sha1msg1_epu32(m2, m3);
+        m1 = _mm_xor_si128(m1, m3);
+
+        // The schedule runs a few words past round 79; they go unused.
+        SHA_NI_ROUNDS(0, m0, m1, m2, m3, e0, e1);
+        SHA_NI_ROUNDS(1, m1, m2, m3, m0, e1, e0);
+        SHA_NI_ROUNDS(1, m2, m3, m0, m1, e0, e1);
+        SHA_NI_ROUNDS(1, m3, m0, m1, m2, e1, e0);
+        SHA_NI_ROUNDS(1, m0, m1, m2, m3, e0, e1);
+        SHA_NI_ROUNDS(1, m1, m2, m3, m0, e1, e0);
+        SHA_NI_ROUNDS(2, m2, m3, m0, m1, e0, e1);
+        SHA_NI_ROUNDS(2, m3, m0, m1, m2, e1, e0);
+        SHA_NI_ROUNDS(2, m0, m1, m2, m3, e0, e1);
+        SHA_NI_ROUNDS(2, m1, m2, m3, m0, e1, e0);
+        SHA_NI_ROUNDS(2, m2, m3, m0, m1, e0, e1);
+        SHA_NI_ROUNDS(3, m3, m0, m1, m2, e1, e0);
+        SHA_NI_ROUNDS(3, m0, m1, m2, m3, e0, e1);
+        SHA_NI_ROUNDS(3, m1, m2, m3, m0, e1, e0);
+        SHA_NI_ROUNDS(3, m2, m3, m0, m1, e0, e1);
+        SHA_NI_ROUNDS(3, m3, m0, m1, m2, e1, e0);
+
+        e0 = _mm_sha1nexte_epu32(e0, e_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+// Folds len bytes (a multiple of 16, at least 64) into crc, which is
+// taken and returned without zlib's pre- and post-inversion.  This is
+// the carry-less multiply scheme from Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ", with the bit-reflected constants
+// for the zlib polynomial.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(const uint8_t *data, size_t len, uint32_t crc)
+{
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *) data);
+    x2 = _mm_loadu_si128((const __m128i *) (data + 16));
+    x3 = _mm_loadu_si128((const __m128i *) (data + 32));
+    x4 = _mm_loadu_si128((const __m128i *) (data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i *) k1k2);
+    data += 64;
+    len -= 64;
+
+    // Four lanes of 128 bits each, folded forward 512 bits at a time.
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) data));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (data + 48)));
+        data += 64;
+        len -= 64;
+    }
+
+    // Fold the lanes into one, then the remaining 16-byte blocks.
+    x0 = _mm_load_si128((const __m128i *) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) data)), x5);
+        data += 16;
+        len -= 16;
+    }
+
+    // 128 bits down to 64, then a Barrett reduction to 32.
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_load_si128((const __m128i *) poly);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t len)
+{
+    if (len >= 64) {
+        size_t n = len & ~(size_t) 15;
+        crc = ~crc32_fold_pclmul(data, n, ~crc);
+        data += n;
+        len -= n;
+    }
+    return crc32_zlib(crc, data, len);
+}
+
+#endif  // DIGEST_X86
+
+#ifdef DIGEST_ARMV8
+
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+#ifdef __clang__
+#define DIGEST_TARGET_CRYPTO "crypto"
+#define DIGEST_TARGET_CRC "crc"
+#else
+#define DIGEST_TARGET_CRYPTO "+crypto"
+#define DIGEST_TARGET_CRC "+crc"
+#endif
+
+static int armv8_has_sha1(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+
+static int armv8_has_crc32(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+__attribute__((target(DIGEST_TARGET_CRYPTO)))
+static void sha1_blocks_armv8(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    static const uint32_t k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e = state[4];
+
+    while (blocks-- > 0) {
+        uint32x4_t abcd_saved = abcd;
+        uint32_t e_saved = e;
+        uint32x4_t w[4];
+        int i;
+        for (i = 0; i < 4; ++i) {
+            w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        }
+        // Four rounds per step; w[i & 3] holds their message words and
+        // is then replaced by the words four steps on.
+        for (i = 0; i < 20; ++i) {
+            uint32x4_t wk = vaddq_u32(w[i & 3], vdupq_n_u32(k[i / 5]));
+            uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (i < 5) {
+                abcd = vsha1cq_u32(abcd, e, wk);
+            } else if (i >= 10 && i < 15) {
+                abcd = vsha1mq_u32(abcd, e, wk);
+            } else {
+                abcd = vsha1pq_u32(abcd, e, wk);
+            }
+            e = e_next;
+            if (i < 16) {
+                w[i & 3] = vsha1su1q_u32(vsha1su0q_u32(w[i & 3], w[(i + 1) & 3], w[(i + 2) & 3]),
+                                         w[(i + 3) & 3]);
+            }
+        }
+        abcd = vaddq_u32(abcd, abcd_saved);
+        e += e_saved;
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+
+__attribute__((target(DIGEST_TARGET_CRC)))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *data, size_t len)
+{
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = __crc32b(crc, *data++);
+        --len;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        crc = __crc32d(crc, v);
+        data += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc = __crc32b(crc, *data++);
+    return ~crc;
+}
+
+#endif  // DIGEST_ARMV8
+
+static const Sha1Impl sha1_impls[] = {
+#ifdef DIGEST_X86
+    { "sha-ni", x86_has_sha, sha1_blocks_shani },
+#endif
+#ifdef DIGEST_ARMV8
+    { "armv8", armv8_has_sha1, sha1_blocks_armv8 },
+#endif
+    { "mincrypt", always, sha1_blocks_mincrypt },
+};
+
+static const Crc32Impl crc32_impls[] = {
+#ifdef DIGEST_X86
+    { "pclmul", x86_has_pclmul, crc32_pclmul },
+#endif
+#ifdef DIGEST_ARMV8
+    { "armv8", armv8_has_crc32, crc32_armv8 },
+#endif
+    { "zlib", always, crc32_zlib },
+};
+
+#define NUM_SHA1_IMPLS (int) (sizeof(sha1_impls) / sizeof(sha1_impls[0]))
+#define NUM_CRC32_IMPLS (int) (sizeof(crc32_impls) / sizeof(crc32_impls[0]))
+
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+static const Sha1Impl *sha1_impl;
+static const Crc32Impl *crc32_impl;
+
+static void select_impls(void)
+{
+    int i;
+    for (i = 0; !sha1_impls[i].supported(); ++i) ;
+    sha1_impl = &sha1_impls[i];
+    for (i = 0; !crc32_impls[i].supported(); ++i) ;
+    crc32_impl = &crc32_impls[i];
+}
+
+static void sha1_blocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+    pthread_once(&select_once, select_impls);
+    sha1_impl->blocks(state, data, blocks);
+}
+
+void digest_sha1_init(DigestSha1 *ctx)
+{
+    ctx->count = 0;
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+}
+
+void digest_sha1_update(DigestSha1 *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    size_t used = ctx->count & 63;
+    ctx->count += len;
+
+    if (used > 0) {
+        size_t n = 64 - used;
+        if (n > len) n = len;
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64) return;
+        sha1_blocks(ctx->state, ctx->buf, 1);
+    }
+    if (len >= 64) {
+        sha1_blocks(ctx->state, p, len / 64);
+        p += len & ~(size_t) 63;
+        len &= 63;
+    }
+    memcpy(ctx->buf, p, len);
+}
+
+const uint8_t *digest_sha1_final(DigestSha1 *ctx)
+{
+    uint64_t bits = ctx->count * 8;
+    uint8_t pad[72];
+    size_t n = 64 - (ctx->count & 63);
+    int i;
+    if (n < 9) n += 64;
+    memset(pad, 0, n);
+    pad[0] = 0x80;
+    for (i = 0; i < 8; ++i) pad[n - 1 - i] = bits >> (8 * i);
+    digest_sha1_update(ctx, pad, n);
+
+    for (i = 0; i < 5; ++i) {
+        ctx->digest[4 * i] = ctx->state[i] >> 24;
+        ctx->digest[4 * i + 1] = ctx->state[i] >> 16;
+        ctx->digest[4 * i + 2] = ctx->state[i] >> 8;
+        ctx->digest[4 * i + 3] = ctx->state[i];
+    }
+    return ctx->digest;
+}
+
+const uint8_t *digest_sha1(const void *data, size_t len, uint8_t *digest)
+{
+    DigestSha1 ctx;
+    digest_sha1_init(&ctx);
+    digest_sha1_update(&ctx, data, len);
+    memcpy(digest, digest_sha1_final(&ctx), DIGEST_SHA1_SIZE);
+    return digest;
+}
+
+uint32_t digest_crc32(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&select_once, select_impls);
+    return crc32_impl->update(crc, (const uint8_t *) data, len);
+}
+
+const char *digest_sha1_impl(int index)
+{
+    int i;
+    for (i = 0; i < NUM_SHA1_IMPLS; ++i) {
+        if (sha1_impls[i].supported() && index-- == 0) return sha1_impls[i].name;
+    }
+    return NULL;
+}
+
+const char *digest_crc32_impl(int index)
+{
+    int i;
+    for (i = 0; i < NUM_CRC32_IMPLS; ++i) {
+        if (crc32_impls[i].supported() && index-- == 0) return crc32_impls[i].name;
+    }
+    return NULL;
+}
+
+int digest_use_sha1(const char *name)
+{
+    int i;
+    pthread_once(&select_once, select_impls);
+    for (i = 0; i < NUM_SHA1_IMPLS; ++i) {
+        if (strcmp(sha1_impls[i].name, name) == 0 && sha1_impls[i].supported()) {
+            sha1_impl = &sha1_impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int digest_use_crc32(const char *name)
+{
+    int i;
+    pthread_once(&select_once, select_impls);
+    for (i = 0; i < NUM_CRC32_IMPLS; ++i) {
+        if (strcmp(crc32_impls[i].name, name) == 0 && crc32_impls[i].supported()) {
+            crc32_impl = &crc32_impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,45 @@
+#ifndef RECOVERY_DIGEST_H_
+#define RECOVERY_DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* SHA-1 and CRC-32 for the integrity checks (package signatures,
+ * applypatch, zip entry CRCs).  The block functions are picked at run
+ * time from what the CPU offers: the ARMv8 SHA1/CRC32 instructions on
+ * arm64, SHA-NI/PCLMULQDQ on x86 hosts, and mincrypt's SHA-1 and zlib's
+ * crc32 everywhere else.  The results are the same whichever is used.
+ */
+
+#define DIGEST_SHA1_SIZE 20
+
+typedef struct DigestSha1 {
+    uint64_t count;
+    uint32_t state[5];
+    uint8_t buf[64];
+    uint8_t digest[DIGEST_SHA1_SIZE];
+} DigestSha1;
+
+/* Same shape as SHA_init/SHA_update/SHA_final in mincrypt; the context
+ * may be copied to take the digest of a prefix.
+ */
+void digest_sha1_init(DigestSha1 *ctx);
+void digest_sha1_update(DigestSha1 *ctx, const void *data, size_t len);
+const uint8_t *digest_sha1_final(DigestSha1 *ctx);
+const uint8_t *digest_sha1(const void *data, size_t len, uint8_t *digest);
+
+/* Same as zlib's crc32(): pass 0 to start, the previous value to continue.
+ */
+uint32_t digest_crc32(uint32_t crc, const void *data, size_t len);
+
+/* Names of the implementations this CPU can run, fastest first, or NULL
+ * past the end.  The first one is used unless digest_use_*() picks
+ * another (digest_bench compares them this way).  digest_use_*()
+ * returns -1 if the name is unknown or the CPU can't run it.
+ */
+const char *digest_sha1_impl(int index);
+const char *digest_crc32_impl(int index);
+int digest_use_sha1(const char *name);
+int digest_use_crc32(const char *name);
+
+#endif  // RECOVERY_DIGEST_H_
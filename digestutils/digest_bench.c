@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "digest.h"
+
+/* Times every SHA-1 and CRC-32 implementation the CPU can run over the
+ * same buffer and checks that they agree.
+ *
+ *     digest_bench [size in KB] [passes]
+ */
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void print_rate(const char *what, const char *name, size_t bytes, double secs)
+{
+    printf("%-6s %-10s %8.1f MB/s\n", what, name,
+           secs > 0 ? bytes / secs / (1024 * 1024) : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = (argc > 1 ? strtoul(argv[1], NULL, 0) : 8192) * 1024;
+    int passes = argc > 2 ? atoi(argv[2]) : 8;
+    unsigned char *data = malloc(size);
+    if (size == 0 || passes <= 0 || data == NULL) {
+        fprintf(stderr, "usage: %s [size in KB] [passes]\n", argv[0]);
+        return 1;
+    }
+
+    size_t i;
+    unsigned int seed = 1;
+    for (i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+
+    int failed = 0;
+    int n, p;
+    const char *name;
+    uint8_t expected[DIGEST_SHA1_SIZE];
+    for (n = 0; (name = digest_sha1_impl(n)) != NULL; ++n) {
+        uint8_t digest[DIGEST_SHA1_SIZE];
+        digest_use_sha1(name);
+        double start = now();
+        for (p = 0; p < passes; ++p) digest_sha1(data, size, digest);
+        print_rate("sha1", name, size * passes, now() - start);
+
+        // Odd-sized pieces exercise the partial block handling.
+        DigestSha1 ctx;
+        digest_sha1_init(&ctx);
+        for (i = 0; i < size; i += 1000) {
+            digest_sha1_update(&ctx, data + i, size - i < 1000 ? size - i : 1000);
+        }
+        if (n == 0) memcpy(expected, digest, DIGEST_SHA1_SIZE);
+        if (memcmp(digest, expected, DIGEST_SHA1_SIZE) != 0 ||
+                memcmp(digest_sha1_final(&ctx), expected, DIGEST_SHA1_SIZE) != 0) {
+            printf("sha1   %-10s MISMATCH\n", name);
+            failed = 1;
+        }
+    }
+
+    uint32_t expected_crc = 0;
+    for (n = 0; (name = digest_crc32_impl(n)) != NULL; ++n) {
+        uint32_t crc = 0;
+        digest_use_crc32(name);
+        double start = now();
+        for (p = 0; p < passes; ++p) crc = digest_crc32(0, data, size);
+        print_rate("crc32", name, size * passes, now() - start);
+
+        uint32_t pieces = 0;
+        for (i = 0; i < size; i += 1000) {
+            pieces = digest_crc32(pieces, data + i, size - i < 1000 ? size - i : 1000);
+        }
+        if (n == 0) expected_crc = crc;
+        if (crc != expected_crc || pieces != expected_crc) {
+            printf("crc32  %-10s MISMATCH\n", name);
+            failed = 1;
+        }
+    }
+
+    free(data);
+    return failed;
+}
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "expr.h"
 
@@ -58,8 +59,43 @@ Value* StringValue(char* str) {
     return v;
 }
 
+// Blobs whose data is a read-only mmap() rather than malloc()'d
+// memory.  Only a handful are ever alive at once.
+typedef struct MappedBlob {
+    char* data;
+    size_t size;
+    struct MappedBlob* next;
+} MappedBlob;
+
+static MappedBlob* mapped_blobs = NULL;
+
+Value* MappedBlobValue(char* data, ssize_t size) {
+    MappedBlob* m = malloc(sizeof(MappedBlob));
+    m->data = data;
+    m->size = size;
+    m->next = mapped_blobs;
+    mapped_blobs = m;
+
+    Value* v = malloc(sizeof(Value));
+    v->type = VAL_BLOB;
+    v->size = size;
+    v->data = data;
+    return v;
+}
+
 void FreeValue(Value* v) {
     if (v == NULL) return;
+    MappedBlob** p;
+    for (p = &mapped_blobs; *p != NULL; p = &(*p)->next) {
+        if ((*p)->data == v->data) {
+            MappedBlob* m = *p;
+            *p = m->next;
+            munmap(m->data, m->size);
+            free(m);
+            free(v);
+            return;
+        }
+    }
     free(v->data);
     free(v);
 }
@@ -157,6 +157,10 @@ Value* ErrorAbort(State* state, char* format, ...);
 // Wrap a string into a Value, taking ownership of the string.
 Value* StringValue(char* str);
 
+// Wrap a read-only mmap() of size bytes into a blob Value, taking
+// ownership of the mapping; FreeValue() will munmap() it.
+Value* MappedBlobValue(char* data, ssize_t size);
+
 // Free a Value object.
 void FreeValue(Value* v);
 
@@ -41,9 +41,15 @@
 
 #include "extendedcommands.h"
 #include "nandroid.h"
+#include "blockcopy.h"
 
 int signature_check_enabled = 1;
 int script_assert_enabled = 1;
+int nandroid_compression_enabled = 0;
+int nandroid_dedup_enabled = 0;
+int nandroid_sparse_enabled = 0;
+int nandroid_dedup_verify_enabled = 0;
+int zip_check_enabled = 0;
 static const char *SDCARD_PACKAGE_FILE = "SDCARD:update.zip";
 
 void
@@ -59,6 +65,36 @@ void toggle_script_asserts()
     ui_print("Script Asserts: %s\n", script_assert_enabled ? "Enabled" : "Disabled");
 }
 
+void toggle_zip_check()
+{
+    zip_check_enabled = !zip_check_enabled;
+    ui_print("Package Contents Check: %s\n", zip_check_enabled ? "Enabled" : "Disabled");
+}
+
+void toggle_nandroid_compression()
+{
+    nandroid_compression_enabled = !nandroid_compression_enabled;
+    ui_print("Backup Compression: %s\n", nandroid_compression_enabled ? "Enabled" : "Disabled");
+}
+
+void toggle_nandroid_dedup()
+{
+    nandroid_dedup_enabled = !nandroid_dedup_enabled;
+    ui_print("Backup Deduplication: %s\n", nandroid_dedup_enabled ? "Enabled" : "Disabled");
+}
+
+void toggle_nandroid_dedup_verify()
+{
+    nandroid_dedup_verify_enabled = !nandroid_dedup_verify_enabled;
+    ui_print("Verify Deduplicated Chunks: %s\n", nandroid_dedup_verify_enabled ? "Enabled" : "Disabled");
+}
+
+void toggle_nandroid_sparse()
+{
+    nandroid_sparse_enabled = !nandroid_sparse_enabled;
+    ui_print("Sparse Backup Images: %s\n", nandroid_sparse_enabled ? "Enabled" : "Disabled");
+}
+
 int install_zip(const char* packagefilepath)
 {
     ui_print("\n-- Installing: %s\n", packagefilepath);
@@ -86,11 +122,13 @@ char* INSTALL_MENU_ITEMS[] = {  "choose zip from sdcard",
                                 "apply sdcard:update.zip",
                                 "toggle signature verification",
                                 "toggle script asserts",
+                                "toggle package contents check",
                                 NULL };
 #define ITEM_CHOOSE_ZIP       0
 #define ITEM_APPLY_SDCARD     1
 #define ITEM_SIG_CHECK        2
 #define ITEM_ASSERTS          3
+#define ITEM_ZIP_CHECK        4
 
 void show_install_update_menu()
 {
@@ -109,6 +147,9 @@ void show_install_update_menu()
             case ITEM_SIG_CHECK:
                 toggle_signature_check();
                 break;
+            case ITEM_ZIP_CHECK:
+                toggle_zip_check();
+                break;
             case ITEM_APPLY_SDCARD:
             {
                 if (confirm_selection("Confirm install?", "Yes - Install /sdcard/update.zip"))
@@ -573,13 +614,12 @@ int convert_mtd_device(const char *root, const char* fs_list)
     		return -1;
     	}
 
-        ui_show_progress(0.3, root_fsize*30/(140*1024*1024));
+        ui_show_progress(0.3, 0);
 
     	// backup
     	ui_print("Backuping %s...\n", root);
-    	char br_exec[256];
-    	sprintf(br_exec, "tar -c --exclude=*RFS_LOG.LO* -f /sdcard/samdroid/tmp/ctmp.tar %s", get_mount_point_for_root(root)+1);
-    	if (0 != __system(br_exec)) {
+    	if (0 != blockcopy_tar_create(get_mount_point_for_root(root), "*RFS_LOG.LO*", NULL,
+    			"/sdcard/samdroid/tmp/ctmp.tar", NULL, NULL)) {
     		ui_print("Can't create backup file\n");
     		return -1;
     	}
@@ -607,9 +647,9 @@ int convert_mtd_device(const char *root, const char* fs_list)
     	}
 
     	// restore $root
-        ui_show_progress(0.65, root_fsize*500/(140*1024*1024));
+        ui_show_progress(0.65, 0);
     	ui_print("Restoring %s...\n", root);
-    	if (0 != __system("tar -x -f /sdcard/samdroid/tmp/ctmp.tar")) {
+    	if (0 != blockcopy_tar_extract("/sdcard/samdroid/tmp/ctmp.tar", "/", NULL, NULL)) {
     		ui_print("Can't restore backup file\n");
     		return -1;
     	}
@@ -955,6 +995,10 @@ void show_nandroid_menu()
     static char* list[] = { "Backup", 
                             "Restore",
                             "Advanced Restore",
+                            "toggle backup compression",
+                            "toggle backup deduplication",
+                            "toggle sparse backup images",
+                            "toggle chunk store verification",
                             NULL
     };
 
@@ -985,6 +1029,18 @@ void show_nandroid_menu()
         case 2:
             show_nandroid_advanced_restore_menu(1);
             break;
+        case 3:
+            toggle_nandroid_compression();
+            break;
+        case 4:
+            toggle_nandroid_dedup();
+            break;
+        case 5:
+            toggle_nandroid_sparse();
+            break;
+        case 6:
+            toggle_nandroid_dedup_verify();
+            break;
     }
 }
 
@@ -1038,19 +1094,19 @@ void show_tarbackup_advanced_restore_menu()
     {
         case 0:
             if (confirm_selection(confirm_restore, "Yes - Backup system"))
-            	tarbackup_backup(backup_path, 1, 0, 0, 0);
+            	tarbackup_backup(backup_path, 1, 0, 0, 0, 0);
             break;
         case 1:
             if (confirm_selection(confirm_restore, "Yes - Backup data"))
-            	tarbackup_backup(backup_path, 0, 1, 0, 0);
+            	tarbackup_backup(backup_path, 0, 1, 0, 0, 0);
             break;
         case 2:
             if (confirm_selection(confirm_restore, "Yes - Backup cache"))
-            	tarbackup_backup(backup_path, 0, 0, 1, 0);
+            	tarbackup_backup(backup_path, 0, 0, 1, 0, 0);
             break;
         case 3:
             if (confirm_selection(confirm_restore, "Yes - Backup sd-ext"))
-            	tarbackup_backup(backup_path, 0, 0, 0, 1);
+            	tarbackup_backup(backup_path, 0, 0, 0, 1, 0);
             break;
     }
 }
@@ -1063,6 +1119,7 @@ void show_tarbackup_menu()
     };
 
     static char* list[] = { "Backup",
+                            "Incremental Backup",
     						"Advanced Backup",
                             "Advanced Restore",
                             NULL
@@ -1072,6 +1129,7 @@ void show_tarbackup_menu()
     switch (chosen_item)
     {
         case 0:
+        case 1:
             {
                 char backup_path[PATH_MAX];
                 time_t t = time(NULL);
@@ -1086,13 +1144,13 @@ void show_tarbackup_menu()
                 {
                     strftime(backup_path, sizeof(backup_path), "/sdcard/samdroid/backup/%F.%H.%M.%S", tmp);
                 }
-                tarbackup_backup(backup_path, 1, 1, 1, 1);
+                tarbackup_backup(backup_path, 1, 1, 1, 1, chosen_item == 1);
             }
             break;
-        case 1:
+        case 2:
         	show_tarbackup_advanced_restore_menu();
         	break;
-        case 2:
+        case 3:
             show_nandroid_advanced_restore_menu(0);
             break;
     }
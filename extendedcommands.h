@@ -1,5 +1,10 @@
 extern int signature_check_enabled;
 extern int script_assert_enabled;
+extern int nandroid_compression_enabled;
+extern int nandroid_dedup_enabled;
+extern int nandroid_sparse_enabled;
+extern int nandroid_dedup_verify_enabled;
+extern int zip_check_enabled;
 
 void
 toggle_signature_check();
@@ -7,6 +12,21 @@ toggle_signature_check();
 void
 toggle_script_asserts();
 
+void
+toggle_zip_check();
+
+void
+toggle_nandroid_compression();
+
+void
+toggle_nandroid_dedup();
+
+void
+toggle_nandroid_sparse();
+
+void
+toggle_nandroid_dedup_verify();
+
 void
 show_choose_zip_menu();
 
@@ -40,6 +60,9 @@ show_advanced_menu();
 int
 format_non_mtd_device(const char* root);
 
+int
+confirm_selection(const char* title, const char* confirm);
+
 void
 wipe_battery_stats();
 
@@ -18,6 +18,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -104,16 +106,18 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
     return INSTALL_SUCCESS;
 }
 
-// If the package contains an update binary, extract it and run it.
+#define STAGED_UPDATE_BINARY "/tmp/update_binary"
+
+// If the package contains an update binary, extract it to /tmp.
 static int
-try_update_binary(const char *path, ZipArchive *zip) {
+extract_update_binary(ZipArchive *zip) {
     const ZipEntry* binary_entry =
             mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
     if (binary_entry == NULL) {
         return INSTALL_UPDATE_BINARY_MISSING;
     }
 
-    char* binary = "/tmp/update_binary";
+    char* binary = STAGED_UPDATE_BINARY;
     unlink(binary);
     int fd = creat(binary, 0755);
     if (fd < 0) {
@@ -127,6 +131,13 @@ try_update_binary(const char *path, ZipArchive *zip) {
         LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
         return 1;
     }
+    return INSTALL_SUCCESS;
+}
+
+// Run the update binary extract_update_binary() staged.
+static int
+run_update_binary(const char *path, ZipArchive *zip) {
+    char* binary = STAGED_UPDATE_BINARY;
 
     int pipefd[2];
     pipe(pipefd);
@@ -224,14 +235,55 @@ try_update_binary(const char *path, ZipArchive *zip) {
     return INSTALL_SUCCESS;
 }
 
+/* Everything install_package() gets ready while the signature is still
+ * being checked.  Staging only writes to /tmp and memory; nothing in it
+ * is run until the package has been verified.
+ */
+typedef struct {
+    int parse_result;       // mzParseZipArchive()
+    int binary_result;      // extract_update_binary()
+    int script_result;      // load_update_script(), without a binary
+    UpdateScript *script;
+} StagedUpdate;
+
+static void
+stage_update_package(ZipArchive *zip, StagedUpdate *staged)
+{
+    memset(staged, 0, sizeof(*staged));
+    staged->parse_result = mzParseZipArchive(zip);
+    if (staged->parse_result != 0) {
+        return;
+    }
+
+    LOGI("Trying update-binary.\n");
+    staged->binary_result = extract_update_binary(zip);
+    if (staged->binary_result == INSTALL_UPDATE_BINARY_MISSING) {
+        LOGI("Trying update-script.\n");
+        staged->script_result = load_update_script(zip,
+                find_update_script(zip), &staged->script);
+    }
+}
+
+static void
+discard_staged_update(StagedUpdate *staged)
+{
+    if (staged->parse_result == 0 && staged->binary_result == INSTALL_SUCCESS) {
+        unlink(STAGED_UPDATE_BINARY);
+    }
+    free_update_script(staged->script);
+    staged->script = NULL;
+}
+
 static int
-handle_update_package(const char *path, ZipArchive *zip)
+handle_update_package(const char *path, ZipArchive *zip, StagedUpdate *staged)
 {
     // Update should take the rest of the progress bar.
     ui_print("Installing update...\n");
 
-    LOGI("Trying update-binary.\n");
-    int result = try_update_binary(path, zip);
+    int result = staged->binary_result;
+    if (result == INSTALL_SUCCESS) {
+        result = run_update_binary(path, zip);
+    }
 
     if (result == INSTALL_UPDATE_BINARY_MISSING)
     {
@@ -240,10 +292,9 @@ handle_update_package(const char *path, ZipArchive *zip)
             LOGE("Can't register package root\n");
             return INSTALL_ERROR;
         }
-        const ZipEntry *script_entry;
-        script_entry = find_update_script(zip);
-        LOGI("Trying update-script.\n");
-        result = handle_update_script(zip, script_entry);
+        result = staged->script_result;
+        if (result == INSTALL_SUCCESS)
+            result = run_update_script(staged->script);
         if (result == INSTALL_UPDATE_SCRIPT_MISSING)
             result = INSTALL_ERROR;
     }
@@ -326,6 +377,29 @@ exit:
     return NULL;
 }
 
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    RSAPublicKey* keys;
+    int numKeys;
+    int result;
+} VerifyJob;
+
+static void*
+verify_thread(void* cookie)
+{
+    VerifyJob* job = (VerifyJob*) cookie;
+    job->result = verify_data(job->data, job->length, job->keys, job->numKeys);
+    return NULL;
+}
+
+static bool
+report_bad_entry(const ZipEntry* entry, void* cookie)
+{
+    ui_print("Bad entry: %.*s\n", entry->fileNameLen, entry->fileName);
+    return true;
+}
+
 int
 install_package(const char *root_path)
 {
@@ -348,16 +422,29 @@ install_package(const char *root_path)
     ui_print("Opening update package...\n");
     LOGI("Update file path: %s\n", path);
 
-    int err;
+    /* Map the package once.  The signature is checked against the
+     * mapping on a separate thread while the package is staged from the
+     * same pages, so by the time the signature is confirmed the update
+     * binary (or script) is ready to go.
+     */
+    ZipArchive zip;
+    int err = mzMapZipArchive(path, &zip);
+    if (err != 0) {
+        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        return INSTALL_CORRUPT;
+    }
 
+    VerifyJob verify;
+    pthread_t verifier;
+    int verifying = 0;
     if (signature_check_enabled) {
-        int numKeys;
-        RSAPublicKey* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
-        if (loadedKeys == NULL) {
+        verify.keys = load_keys(PUBLIC_KEYS_FILE, &verify.numKeys);
+        if (verify.keys == NULL) {
             LOGE("Failed to load keys\n");
+            mzCloseZipArchive(&zip);
             return INSTALL_CORRUPT;
         }
-        LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
+        LOGI("%d key(s) loaded from %s\n", verify.numKeys, PUBLIC_KEYS_FILE);
 
         // Give verification half the progress bar...
         ui_print("Verifying update package...\n");
@@ -365,27 +452,52 @@ install_package(const char *root_path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
-        free(loadedKeys);
-        LOGI("verify_file returned %d\n", err);
-        if (err != VERIFY_SUCCESS) {
+        verify.data = zip.map.addr;
+        verify.length = zip.map.length;
+        verifying = 1;
+        if (pthread_create(&verifier, NULL, verify_thread, &verify) != 0) {
+            verify_thread(&verify);
+            verifying = 0;
+        }
+    }
+
+    StagedUpdate staged;
+    stage_update_package(&zip, &staged);
+
+    if (signature_check_enabled) {
+        if (verifying) {
+            pthread_join(verifier, NULL);
+        }
+        free(verify.keys);
+        LOGI("verify_data returned %d\n", verify.result);
+        if (verify.result != VERIFY_SUCCESS) {
             LOGE("signature verification failed\n");
+            discard_staged_update(&staged);
+            mzCloseZipArchive(&zip);
             return INSTALL_CORRUPT;
         }
     }
 
-    /* Try to open the package.
-     */
-    ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
-    if (err != 0) {
-        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+    if (staged.parse_result != 0) {
+        LOGE("Can't open %s\n(bad)\n", path);
+        mzCloseZipArchive(&zip);
         return INSTALL_CORRUPT;
     }
 
+    if (zip_check_enabled) {
+        ui_print("Checking package contents...\n");
+        if (!mzVerifyArchive(&zip, report_bad_entry, NULL)) {
+            LOGE("update package is corrupt\n");
+            discard_staged_update(&staged);
+            mzCloseZipArchive(&zip);
+            return INSTALL_CORRUPT;
+        }
+    }
+
     /* Verify and install the contents of the package.
      */
-    int status = handle_update_package(path, &zip);
+    int status = handle_update_package(path, &zip, &staged);
+    free_update_script(staged.script);
     mzCloseZipArchive(&zip);
     return status;
 }
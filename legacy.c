@@ -33,6 +33,7 @@
 #include "roots.h"
 #include "verifier.h"
 #include "firmware.h"
+#include "legacy.h"
 
 #include "amend/amend.h"
 #include "common.h"
@@ -72,9 +73,20 @@ static int read_data(ZipArchive *zip, const ZipEntry *entry,
     return 0;
 }
 
+struct UpdateScript {
+    char* data;
+    int len;
+    const AmCommandList *commands;
+};
+
 int
-handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
+load_update_script(ZipArchive *zip, const ZipEntry *update_script_entry,
+        UpdateScript **script)
 {
+    if (update_script_entry == NULL) {
+        return INSTALL_UPDATE_SCRIPT_MISSING;
+    }
+
     /* Read the entire script into a buffer.
      */
     int script_len;
@@ -84,20 +96,52 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
         return INSTALL_UPDATE_SCRIPT_MISSING;
     }
 
-    /* Parse the script.  Note that the script and parse tree are never freed.
+    /* Parse the script.  Note that the parse tree is never freed; amend
+     * has no way to.
      */
     const AmCommandList *commands = parseAmendScript(script_data, script_len);
     if (commands == NULL) {
         LOGE("Syntax error in update script\n");
+        free(script_data);
         return INSTALL_ERROR;
     } else {
         UnterminatedString name = mzGetZipEntryFileName(update_script_entry);
         LOGI("Parsed %.*s\n", name.len, name.str);
     }
 
+    *script = malloc(sizeof(UpdateScript));
+    if (*script == NULL) {
+        free(script_data);
+        return INSTALL_ERROR;
+    }
+    (*script)->data = script_data;
+    (*script)->len = script_len;
+    (*script)->commands = commands;
+    return INSTALL_SUCCESS;
+}
+
+int
+handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
+{
+    UpdateScript *script;
+    int ret = load_update_script(zip, update_script_entry, &script);
+    if (ret != INSTALL_SUCCESS) {
+        return ret;
+    }
+    ret = run_update_script(script);
+    free_update_script(script);
+    return ret;
+}
+
+int
+run_update_script(UpdateScript *script)
+{
+    char *script_data = script->data;
+    int script_len = script->len;
+
     /* Execute the script.
      */
-    int ret = execCommandList((ExecContext *)1, commands);
+    int ret = execCommandList((ExecContext *)1, script->commands);
     if (ret != 0) {
         int num = ret;
         char *line, *next = script_data;
@@ -114,6 +158,15 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
     return INSTALL_SUCCESS;
 }
 
+void
+free_update_script(UpdateScript *script)
+{
+    if (script != NULL) {
+        free(script->data);
+        free(script);
+    }
+}
+
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 
 const ZipEntry *
@@ -1,5 +1,23 @@
 int
 handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry);
 
+/* handle_update_script() in two steps: load_update_script() reads and
+ * parses the script without running any of it, run_update_script()
+ * executes it.  Both return one of the INSTALL_ values.
+ */
+typedef struct UpdateScript UpdateScript;
+
+int
+load_update_script(ZipArchive *zip, const ZipEntry *update_script_entry,
+        UpdateScript **script);
+
+int
+run_update_script(UpdateScript *script);
+
+/* Frees a script from load_update_script(), run or not.
+ */
+void
+free_update_script(UpdateScript *script);
+
 const ZipEntry *
 find_update_script(ZipArchive *zip);
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef RECOVERY_MD5_H_
+#define RECOVERY_MD5_H_
+
+#include <stdint.h>
+
+/* MD5 (RFC 1321), for the digests kept in nandroid.md5.  Same shape as
+ * the SHA_CTX functions in mincrypt.
+ */
+
+#define MD5_DIGEST_SIZE 16
+
+typedef struct MD5_CTX {
+    uint64_t count;
+    uint32_t state[4];
+    uint8_t buf[64];
+} MD5_CTX;
+
+void MD5_init(MD5_CTX *ctx);
+void MD5_update(MD5_CTX *ctx, const void *data, int len);
+const uint8_t *MD5_final(MD5_CTX *ctx);
+
+/* Format a digest the way md5sum prints it; hex needs 33 bytes.
+ */
+void MD5_hex(const uint8_t *digest, char *hex);
+
+#endif  // RECOVERY_MD5_H_
@@ -7,6 +7,18 @@ LOCAL_C_INCLUDES +=\
     external/libpng\
     external/zlib
 
+ifeq ($(BOARD_USE_DOUBLE_BUFFERED_FB),true)
+  LOCAL_CFLAGS += -DRECOVERY_DOUBLE_BUFFER
+endif
+
 LOCAL_MODULE := libminui
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := text_bench.c
+LOCAL_MODULE := minui_text_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_STATIC_LIBRARIES := libminui libpixelflinger_static libpng libz libcutils libc
+include $(BUILD_EXECUTABLE)
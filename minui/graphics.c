@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -37,6 +38,9 @@ typedef struct {
     unsigned cwidth;
     unsigned cheight;
     unsigned ascent;
+    /* one bitmask per scanline of each glyph, bit n set if column n is
+     * inked; NULL if the font is too wide and we go through GGL instead */
+    unsigned *rows;
 } GRFont;
 
 static GRFont *gr_font = 0;
@@ -45,12 +49,33 @@ static GGLSurface gr_font_texture;
 static GGLSurface gr_framebuffer[2];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
+static unsigned short gr_text_color = 0xffff;  /* gr_color() as RGB565 */
 
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
 static struct fb_var_screeninfo vi;
 
+/* Rectangles drawn since the last flip, which is all gr_flip() copies.
+ * When there are more than GR_MAX_DAMAGE they collapse into one. */
+#define GR_MAX_DAMAGE 8
+
+typedef struct {
+    int left, top, right, bottom;
+} GRRect;
+
+static GRRect gr_damage[GR_MAX_DAMAGE];
+static int gr_damage_count = 0;
+
+/* With two framebuffers, the one we're about to draw into last saw the
+ * frame before the previous one, so it also needs the previous damage. */
+static int gr_double_buffered = 0;
+static GRRect gr_prev_damage[GR_MAX_DAMAGE];
+static int gr_prev_damage_count = 0;
+
+static GRRect gr_clip_rect;
+static int gr_clipping = 0;
+
 static int get_framebuffer(GGLSurface *fb)
 {
     int fd;
@@ -98,6 +123,21 @@ static int get_framebuffer(GGLSurface *fb)
     fb->data = (void*) (((unsigned) bits) + vi.yres * vi.xres * 2);
     fb->format = GGL_PIXEL_FORMAT_RGB_565;
 
+#ifdef RECOVERY_DOUBLE_BUFFER
+    /* Only page-flip if the driver gave us room for a second buffer
+     * and will let us pan to it. */
+    if (fi.smem_len >= vi.yres * vi.xres * 2 * 2) {
+        vi.yres_virtual = vi.yres * 2;
+        vi.yoffset = 0;
+        vi.bits_per_pixel = 16;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
+            perror("can't enable second framebuffer");
+        } else {
+            gr_double_buffered = 1;
+        }
+    }
+#endif
+
     return fd;
 }
 
@@ -112,8 +152,7 @@ static void get_memory_surface(GGLSurface* ms) {
 
 static void set_active_framebuffer(unsigned n)
 {
-	return;
-    if (n > 1) return;
+    if (!gr_double_buffered || n > 1) return;
     vi.yres_virtual = vi.yres * 2;
     vi.yoffset = n * vi.yres;
     vi.bits_per_pixel = 16;
@@ -122,23 +161,116 @@ static void set_active_framebuffer(unsigned n)
     }
 }
 
+static void rect_union(GRRect *r, const GRRect *o)
+{
+    if (o->left < r->left) r->left = o->left;
+    if (o->top < r->top) r->top = o->top;
+    if (o->right > r->right) r->right = o->right;
+    if (o->bottom > r->bottom) r->bottom = o->bottom;
+}
+
+/* Record that [left, right) x [top, bottom) of the memory surface has
+ * been drawn on since the last flip. */
+static void add_damage(int left, int top, int right, int bottom)
+{
+    GRRect r = { left, top, right, bottom };
+    int i;
+
+    if (gr_clipping) {
+        if (r.left < gr_clip_rect.left) r.left = gr_clip_rect.left;
+        if (r.top < gr_clip_rect.top) r.top = gr_clip_rect.top;
+        if (r.right > gr_clip_rect.right) r.right = gr_clip_rect.right;
+        if (r.bottom > gr_clip_rect.bottom) r.bottom = gr_clip_rect.bottom;
+    }
+    if (r.left < 0) r.left = 0;
+    if (r.top < 0) r.top = 0;
+    if (r.right > (int) vi.xres) r.right = vi.xres;
+    if (r.bottom > (int) vi.yres) r.bottom = vi.yres;
+    if (r.left >= r.right || r.top >= r.bottom) return;
+
+    /* Fold it into any rectangle it touches. */
+    for (i = 0; i < gr_damage_count; ++i) {
+        GRRect *d = &gr_damage[i];
+        if (r.left <= d->right && d->left <= r.right &&
+            r.top <= d->bottom && d->top <= r.bottom) {
+            rect_union(d, &r);
+            return;
+        }
+    }
+
+    if (gr_damage_count == GR_MAX_DAMAGE) {
+        for (i = 1; i < gr_damage_count; ++i) {
+            rect_union(&gr_damage[0], &gr_damage[i]);
+        }
+        rect_union(&gr_damage[0], &r);
+        gr_damage_count = 1;
+        return;
+    }
+    gr_damage[gr_damage_count++] = r;
+}
+
+static void copy_rect(GGLSurface *fb, const GRRect *r)
+{
+    unsigned short *dst = (unsigned short *) fb->data;
+    unsigned short *src = (unsigned short *) gr_mem_surface.data;
+    int y;
+
+    if (r->left == 0 && r->right == (int) vi.xres) {
+        /* whole rows are contiguous */
+        memcpy(dst + r->top * vi.xres, src + r->top * vi.xres,
+               (r->bottom - r->top) * vi.xres * 2);
+        return;
+    }
+    for (y = r->top; y < r->bottom; ++y) {
+        memcpy(dst + y * vi.xres + r->left, src + y * vi.xres + r->left,
+               (r->right - r->left) * 2);
+    }
+}
+
 void gr_flip(void)
 {
-    GGLContext *gl = gr_context;
+    int i;
 
-    /* swap front and back buffers */
-    // disable two buffers
-    // gr_active_fb = (gr_active_fb + 1) & 1;
+    if (gr_double_buffered) {
+        /* swap front and back buffers */
+        gr_active_fb = (gr_active_fb + 1) & 1;
+        for (i = 0; i < gr_prev_damage_count; ++i) {
+            copy_rect(&gr_framebuffer[gr_active_fb], &gr_prev_damage[i]);
+        }
+        memcpy(gr_prev_damage, gr_damage, sizeof(GRRect) * gr_damage_count);
+        gr_prev_damage_count = gr_damage_count;
+    }
 
-    /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres * vi.yres * 2);
+    /* copy whatever changed from the in-memory surface to the buffer
+     * we're about to make active. */
+    for (i = 0; i < gr_damage_count; ++i) {
+        copy_rect(&gr_framebuffer[gr_active_fb], &gr_damage[i]);
+    }
+    gr_damage_count = 0;
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
 }
 
+void gr_clip(int x, int y, int w, int h)
+{
+    GGLContext *gl = gr_context;
+    gr_clip_rect.left = x;
+    gr_clip_rect.top = y;
+    gr_clip_rect.right = x + w;
+    gr_clip_rect.bottom = y + h;
+    gr_clipping = 1;
+    gl->scissor(gl, x, y, w, h);
+    gl->enable(gl, GGL_SCISSOR_TEST);
+}
+
+void gr_noclip(void)
+{
+    GGLContext *gl = gr_context;
+    gr_clipping = 0;
+    gl->disable(gl, GGL_SCISSOR_TEST);
+}
+
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
     GGLContext *gl = gr_context;
@@ -148,6 +280,10 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+
+    /* Text ignores alpha: glyph pixels are either untouched or replaced
+     * outright, just as GGL's A8 texture with GGL_REPLACE does. */
+    gr_text_color = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
 }
 
 int gr_measure(const char *s)
@@ -155,20 +291,20 @@ int gr_measure(const char *s)
     return gr_font->cwidth * strlen(s);
 }
 
-int gr_text(int x, int y, const char *s)
+/* Used only for fonts too wide for the glyph masks. */
+static int gr_text_ggl(int x, int y, const char *s)
 {
     GGLContext *gl = gr_context;
     GRFont *font = gr_font;
     unsigned off;
 
-    y -= font->ascent;
-
     gl->bindTexture(gl, &font->texture);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->enable(gl, GGL_TEXTURE_2D);
 
+    int left = x;
     while((off = *s++)) {
         off -= 32;
         if (off < 96) {
@@ -177,15 +313,80 @@ int gr_text(int x, int y, const char *s)
         }
         x += font->cwidth;
     }
+    add_damage(left, y, x, y + font->cheight);
 
     return x;
 }
 
+/* Draws straight into the memory surface from the pre-rasterized glyph
+ * masks, a scanline of the whole string at a time. */
+int gr_text(int x, int y, const char *s)
+{
+    GRFont *font = gr_font;
+    unsigned short *surface = (unsigned short *) gr_mem_surface.data;
+    unsigned short color = gr_text_color;
+    int cwidth = font->cwidth;
+    int right_edge = x + cwidth * strlen(s);
+    int left, top, right, bottom, row;
+
+    y -= font->ascent;
+    if (font->rows == NULL) {
+        return gr_text_ggl(x, y, s);
+    }
+
+    left = x;
+    top = y;
+    right = right_edge;
+    bottom = y + font->cheight;
+    if (gr_clipping) {
+        if (left < gr_clip_rect.left) left = gr_clip_rect.left;
+        if (top < gr_clip_rect.top) top = gr_clip_rect.top;
+        if (right > gr_clip_rect.right) right = gr_clip_rect.right;
+        if (bottom > gr_clip_rect.bottom) bottom = gr_clip_rect.bottom;
+    }
+    if (left < 0) left = 0;
+    if (top < 0) top = 0;
+    if (right > (int) vi.xres) right = vi.xres;
+    if (bottom > (int) vi.yres) bottom = vi.yres;
+
+    for (row = top; row < bottom; ++row) {
+        unsigned short *line = surface + row * vi.xres;
+        const unsigned *masks = font->rows + (row - y);
+        const unsigned char *p = (const unsigned char *) s;
+        int cx;
+
+        for (cx = x; *p != '\0' && cx < right; ++p, cx += cwidth) {
+            unsigned off = *p - 32;
+            unsigned bits;
+            unsigned short *d;
+
+            if (off >= 96 || cx + cwidth <= left) continue;
+            bits = masks[off * font->cheight];
+            if (cx + cwidth > right) {
+                bits &= (1u << (right - cx)) - 1;
+            }
+            d = line + cx;
+            if (cx < left) {
+                bits >>= left - cx;
+                d += left - cx;
+            }
+            for (; bits != 0; bits >>= 1, ++d) {
+                if (bits & 1) *d = color;
+            }
+        }
+    }
+    add_damage(x, y, right_edge, y + font->cheight);
+
+    return right_edge;
+}
+
 void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x, y, w, h);
+    /* despite the names, recti() takes the right and bottom edges */
+    add_damage(x, y, w, h);
 }
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
@@ -201,6 +402,7 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
     gl->enable(gl, GGL_TEXTURE_2D);
     gl->texCoord2i(gl, sx - dx, sy - dy);
     gl->recti(gl, dx, dy, dx + w, dy + h);
+    add_damage(dx, dy, dx + w, dy + h);
 }
 
 unsigned int gr_get_width(gr_surface surface) {
@@ -244,6 +446,24 @@ static void gr_init_font(void)
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
+
+    /* Boil the texture down to per-scanline bitmasks for gr_text(). */
+    if (font.cwidth < 32) {
+        unsigned char *tex = ftex->data;
+        unsigned c, r, i;
+        gr_font->rows = calloc(96 * font.cheight, sizeof(unsigned));
+        for (c = 0; c < 96 && gr_font->rows != NULL; ++c) {
+            for (r = 0; r < font.cheight; ++r) {
+                unsigned mask = 0;
+                for (i = 0; i < font.cwidth; ++i) {
+                    if (tex[r * font.width + c * font.cwidth + i]) {
+                        mask |= 1u << i;
+                    }
+                }
+                gr_font->rows[c * font.cheight + r] = mask;
+            }
+        }
+    }
 }
 
 int gr_init(void)
@@ -271,6 +491,11 @@ int gr_init(void)
 
     get_memory_surface(&gr_mem_surface);
 
+    /* nothing on either framebuffer is ours yet */
+    add_damage(0, 0, vi.xres, vi.yres);
+    gr_prev_damage[0] = gr_damage[0];
+    gr_prev_damage_count = 1;
+
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
 
@@ -313,3 +538,34 @@ gr_pixel *gr_fb_data(void)
 {
     return (unsigned short *) gr_mem_surface.data;
 }
+
+static int rect_on_screen(int x, int y, int w, int h)
+{
+    return x >= 0 && y >= 0 && w > 0 && h > 0 &&
+           x + w <= (int) vi.xres && y + h <= (int) vi.yres;
+}
+
+void gr_get_pixels(int x, int y, int w, int h, gr_pixel *dst)
+{
+    gr_pixel *src = (gr_pixel *) gr_mem_surface.data + y * vi.xres + x;
+    if (!rect_on_screen(x, y, w, h)) return;
+    for (; h > 0; --h, src += vi.xres, dst += w) {
+        memcpy(dst, src, w * sizeof(gr_pixel));
+    }
+}
+
+void gr_put_pixels(int x, int y, int w, int h, const gr_pixel *src)
+{
+    gr_pixel *dst = (gr_pixel *) gr_mem_surface.data + y * vi.xres + x;
+    int row;
+    if (!rect_on_screen(x, y, w, h)) return;
+    for (row = 0; row < h; ++row, dst += vi.xres, src += w) {
+        memcpy(dst, src, w * sizeof(gr_pixel));
+    }
+
+    /* the copy wasn't clipped, so neither is its damage */
+    int clipping = gr_clipping;
+    gr_clipping = 0;
+    add_damage(x, y, x + w, y + h);
+    gr_clipping = clipping;
+}
@@ -26,8 +26,20 @@ void gr_exit(void);
 int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
+// Copies only what was drawn since the last flip to the screen.
 void gr_flip(void);
 
+// Confine drawing, and the damage it records, to a rectangle until
+// gr_noclip(), so one region can be redrawn without touching the rest.
+void gr_clip(int x, int y, int w, int h);
+void gr_noclip(void);
+
+// Copy a w x h block of the drawing surface out to, or back in from,
+// w*h pixels of caller memory.  Both do nothing unless the block is
+// wholly on screen; gr_put_pixels() ignores the clip but records damage.
+void gr_get_pixels(int x, int y, int w, int h, gr_pixel *dst);
+void gr_put_pixels(int x, int y, int w, int h, const gr_pixel *src);
+
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_fill(int x, int y, int w, int h);
 int gr_text(int x, int y, const char *s);
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "minui.h"
+
+/* Times redraws of a full text console the way recovery's ui.c draws
+ * it: every row of text alone, then the whole frame (background, dimmed
+ * overlay, text) including the flip.  Run it with recovery stopped.
+ *
+ *     minui_text_bench [passes]
+ */
+
+#define CHAR_WIDTH 10
+#define CHAR_HEIGHT 18
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void draw_text(char **lines, int rows)
+{
+    int row;
+    gr_color(140, 140, 140, 255);
+    for (row = 0; row < rows; ++row) {
+        gr_text(0, (row+1)*CHAR_HEIGHT-1, lines[row]);
+    }
+}
+
+static void draw_frame(char **lines, int rows)
+{
+    gr_color(0, 0, 0, 255);
+    gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    gr_color(0, 0, 0, 160);
+    gr_fill(0, 0, gr_fb_width(), gr_fb_height());
+    draw_text(lines, rows);
+}
+
+static void report(const char *what, int passes, double secs)
+{
+    printf("%-12s %8.2f ms/redraw\n", what, secs * 1000 / passes);
+}
+
+int main(int argc, char **argv)
+{
+    int passes = argc > 1 ? atoi(argv[1]) : 200;
+    if (passes <= 0) {
+        fprintf(stderr, "usage: %s [passes]\n", argv[0]);
+        return 1;
+    }
+    if (gr_init() != 0) {
+        fprintf(stderr, "can't open the framebuffer\n");
+        return 1;
+    }
+
+    int rows = gr_fb_height() / CHAR_HEIGHT;
+    int cols = gr_fb_width() / CHAR_WIDTH;
+    char **lines = malloc(rows * sizeof(char *));
+    int row, col, p;
+    for (row = 0; row < rows; ++row) {
+        lines[row] = malloc(cols + 1);
+        for (col = 0; col < cols; ++col) {
+            lines[row][col] = 33 + (row * 7 + col) % 94;
+        }
+        lines[row][cols] = '\0';
+    }
+    printf("console %d x %d\n", cols, rows);
+
+    double start = now();
+    for (p = 0; p < passes; ++p) draw_text(lines, rows);
+    report("text", passes, now() - start);
+
+    start = now();
+    for (p = 0; p < passes; ++p) {
+        draw_frame(lines, rows);
+        gr_flip();
+    }
+    report("frame+flip", passes, now() - start);
+
+    gr_exit();
+    return 0;
+}
@@ -9,6 +9,7 @@ LOCAL_SRC_FILES := \
 	Zip.c
 
 LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
 	external/zlib \
 	external/safe-iop/include
 	
@@ -17,3 +18,33 @@ LOCAL_MODULE := libminzip
 LOCAL_CFLAGS += -Wall
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	Hash.c \
+	SysUtil.c \
+	DirUtil.c \
+	Inlines.c \
+	Zip.c
+
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH)/.. \
+	external/zlib \
+	external/safe-iop/include
+
+LOCAL_MODULE := libminzip
+
+LOCAL_CFLAGS += -Wall
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+# Checks whole packages on the build machines.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := zipverify.c
+LOCAL_MODULE := zipverify
+LOCAL_STATIC_LIBRARIES := libminzip libdigestutils libmincrypt libz
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -22,7 +22,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "DirUtil.h"
 
@@ -224,57 +226,468 @@ dirUnlinkHierarchy(const char *path)
 int
 dirSetHierarchyPermissions(const char *path,
         int uid, int gid, int dirMode, int fileMode)
+{
+    DirPermissions perms;
+    perms.path = path;
+    perms.uid = uid;
+    perms.gid = gid;
+    perms.dirMode = dirMode;
+    perms.fileMode = fileMode;
+    perms.recursive = true;
+    return dirSetPermissionsBatch(&perms, 1, 0, NULL, NULL);
+}
+
+/* A directory waiting to be read, and the last recursive pass that
+ * covers its contents.
+ */
+typedef struct {
+    char *path;
+    int pass;
+} PermsJob;
+
+typedef struct {
+    const DirPermissions *perms;
+    int count;
+    char **paths;           // pass paths without trailing or doubled '/'
+    size_t *pathLens;
+    bool *reached;          // under lock while the walk runs
+    int flags;
+    PermsJob *jobs;         // a stack, so the walk stays mostly depth-first
+    int numJobs;
+    int allocJobs;
+    int busy;               // workers reading a directory
+    int error;
+    DirPermsFailureFn onFailure;
+    void *cookie;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} PermsWalk;
+
+/* Record a failure of <what> on <name> (relative to <dirPath>, or in
+ * full if that's NULL) and report it.
+ */
+static void
+permsFailed(PermsWalk *walk, const char *dirPath, const char *name,
+        const char *what, int err)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->error == 0) {
+        walk->error = err;
+    }
+    if (walk->onFailure != NULL) {
+        char path[PATH_MAX];
+        if (dirPath == NULL) {
+            snprintf(path, sizeof(path), "%s", name);
+        } else {
+            size_t len = strlen(dirPath);
+            snprintf(path, sizeof(path), "%s%s%s", dirPath,
+                    len > 0 && dirPath[len - 1] == '/' ? "" : "/", name);
+        }
+        walk->onFailure(walk->cookie, path, what, err);
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static bool
+pushPermsJob(PermsWalk *walk, char *path, int pass)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->numJobs == walk->allocJobs) {
+        int allocJobs = walk->allocJobs ? walk->allocJobs * 2 : 64;
+        PermsJob *jobs = (PermsJob *) realloc(walk->jobs,
+                allocJobs * sizeof(PermsJob));
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&walk->lock);
+            permsFailed(walk, NULL, path, "walk", ENOMEM);
+            return false;
+        }
+        walk->jobs = jobs;
+        walk->allocJobs = allocJobs;
+    }
+    walk->jobs[walk->numJobs].path = path;
+    walk->jobs[walk->numJobs].pass = pass;
+    walk->numJobs++;
+    pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+    return true;
+}
+
+static void
+setIfChanged(PermsWalk *walk, int dirfd, const char *dirPath,
+        const char *name, const struct stat *st, int uid, int gid, int mode,
+        int atFlags)
+{
+    if ((walk->flags & DIR_PERMS_SKIP_UNCHANGED) &&
+            st->st_uid == (uid_t) uid && st->st_gid == (gid_t) gid &&
+            (st->st_mode & 07777) == (mode & 07777)) {
+        return;
+    }
+    if (fchownat(dirfd, name, uid, gid, atFlags)) {
+        permsFailed(walk, dirPath, name, "chown", errno);
+    }
+    if (fchmodat(dirfd, name, mode, 0)) {
+        permsFailed(walk, dirPath, name, "chmod", errno);
+    }
+}
+
+/* Set one inode, named <name> relative to <dirfd> (and to <dirPath>,
+ * NULL if <name> is a full path) and <path> in full, which may be NULL
+ * unless <exact>.
+ * <pass> is the last recursive pass covering it from above, and
+ * <exact> whether any pass might name <path> itself.  Returns the pass
+ * that covers the inode's children, or -1 if it's not a directory to
+ * descend into.
+ */
+static int
+setPermsEntry(PermsWalk *walk, int dirfd, const char *dirPath,
+        const char *name, const char *path, int pass, bool exact)
 {
     struct stat st;
-    if (lstat(path, &st)) {
+    int single = -1;
+    int i;
+
+    if (exact) {
+        size_t len = strlen(path);
+        for (i = 0; i < walk->count; i++) {
+            if (walk->pathLens[i] == len &&
+                    memcmp(walk->paths[i], path, len) == 0) {
+                pthread_mutex_lock(&walk->lock);
+                walk->reached[i] = true;
+                pthread_mutex_unlock(&walk->lock);
+                if (walk->perms[i].recursive) {
+                    if (i > pass) {
+                        pass = i;
+                    }
+                } else {
+                    single = i;
+                }
+            }
+        }
+    }
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        permsFailed(walk, dirPath, name, "stat", errno);
         return -1;
     }
 
-    /* ignore symlinks */
+    /* Recursive passes skip symlinks; a single-path pass follows them. */
     if (S_ISLNK(st.st_mode)) {
-        return 0;
+        if (single >= 0) {
+            const DirPermissions *p = &walk->perms[single];
+            if (fstatat(dirfd, name, &st, 0)) {
+                permsFailed(walk, dirPath, name, "stat", errno);
+            } else {
+                setIfChanged(walk, dirfd, dirPath, name, &st, p->uid, p->gid,
+                        p->fileMode, 0);
+            }
+        }
+        return -1;
     }
 
-    /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
-        return -1;
+    if (single > pass) {
+        const DirPermissions *p = &walk->perms[single];
+        setIfChanged(walk, dirfd, dirPath, name, &st, p->uid, p->gid,
+                p->fileMode, AT_SYMLINK_NOFOLLOW);
+    } else if (pass >= 0) {
+        const DirPermissions *p = &walk->perms[pass];
+        setIfChanged(walk, dirfd, dirPath, name, &st, p->uid, p->gid,
+                S_ISDIR(st.st_mode) ? p->dirMode : p->fileMode,
+                AT_SYMLINK_NOFOLLOW);
     }
+    return S_ISDIR(st.st_mode) ? pass : -1;
+}
 
-    /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
-            return -1;
+/* True if some pass names a path strictly below <path>. */
+static bool
+hasPassBelow(const PermsWalk *walk, const char *path)
+{
+    size_t len = strlen(path);
+    int i;
+    if (len == 1) {
+        len = 0;    // "/"
+    }
+    for (i = 0; i < walk->count; i++) {
+        if (walk->pathLens[i] > len + 1 && walk->paths[i][len] == '/' &&
+                memcmp(walk->paths[i], path, len) == 0) {
+            return true;
         }
+    }
+    return false;
+}
 
-        errno = 0;
-        const struct dirent *de;
-        while (errno == 0 && (de = readdir(dir)) != NULL) {
-            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+static void
+readPermsDir(PermsWalk *walk, const PermsJob *job)
+{
+    DIR *dir = opendir(job->path);
+    if (dir == NULL) {
+        permsFailed(walk, NULL, job->path, "opendir", errno);
+        return;
+    }
+
+    /* Full paths are only needed to match passes further down and to
+     * queue subdirectories.
+     */
+    bool exact = hasPassBelow(walk, job->path);
+    size_t len = strlen(job->path);
+    const char *sep = job->path[len - 1] == '/' ? "" : "/";
+    const struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+        char *path = NULL;
+        if (exact || de->d_type == DT_DIR || de->d_type == DT_UNKNOWN) {
+            path = (char *) malloc(len + strlen(de->d_name) + 2);
+            if (path == NULL) {
+                permsFailed(walk, job->path, de->d_name, "walk", ENOMEM);
                 continue;
             }
+            sprintf(path, "%s%s%s", job->path, sep, de->d_name);
+        }
+        int pass = setPermsEntry(walk, dirfd(dir), job->path, de->d_name,
+                path, job->pass, exact);
+        if (pass < 0 || path == NULL || !pushPermsJob(walk, path, pass)) {
+            free(path);
+        }
+    }
+    closedir(dir);
+}
+
+static void *
+permsWorker(void *arg)
+{
+    PermsWalk *walk = (PermsWalk *) arg;
+
+    pthread_mutex_lock(&walk->lock);
+    for (;;) {
+        while (walk->numJobs == 0 && walk->busy > 0) {
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        }
+        if (walk->numJobs == 0) {
+            break;
+        }
+        PermsJob job = walk->jobs[--walk->numJobs];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        readPermsDir(walk, &job);
+        free(job.path);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+    }
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+/* Set the roots (the passes flagged in <isRoot>) and walk everything
+ * below them.
+ */
+static void
+walkPerms(PermsWalk *walk, const bool *isRoot)
+{
+    pthread_t threads[DIR_PERMS_MAX_THREADS];
+    int numThreads = 0;
+    int i, j;
+
+    for (i = 0; i < walk->count; i++) {
+        if (!isRoot[i]) {
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (isRoot[j] && !strcmp(walk->paths[i], walk->paths[j])) {
+                break;
+            }
+        }
+        if (j < i) {
+            continue;
+        }
+        int pass = setPermsEntry(walk, AT_FDCWD, NULL, walk->paths[i],
+                walk->paths[i], -1, true);
+        if (pass >= 0) {
+            char *path = strdup(walk->paths[i]);
+            if (path == NULL) {
+                permsFailed(walk, NULL, walk->paths[i], "walk", ENOMEM);
+            } else if (!pushPermsJob(walk, path, pass)) {
+                free(path);
+            }
+        }
+    }
+
+    /* The walk is mostly waiting on the filesystem, so one thread more
+     * than there are cores.
+     */
+    long wanted = sysconf(_SC_NPROCESSORS_ONLN) + 1;
+    if (wanted > DIR_PERMS_MAX_THREADS) {
+        wanted = DIR_PERMS_MAX_THREADS;
+    }
+    while (numThreads < wanted - 1 &&
+            pthread_create(&threads[numThreads], NULL,
+                           permsWorker, walk) == 0) {
+        numThreads++;
+    }
+    permsWorker(walk);
+    for (i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Copy <path> without trailing slashes and with runs of slashes
+ * squeezed, so that it matches the paths the walk builds.
+ */
+static char *
+normalizePermsPath(const char *path)
+{
+    char *out = (char *) malloc(strlen(path) + 1);
+    char *p = out;
+    if (out == NULL) {
+        return NULL;
+    }
+    for (; *path != '\0'; path++) {
+        if (*path != '/' || p == out || p[-1] != '/') {
+            *p++ = *path;
+        }
+    }
+    while (p > out + 1 && p[-1] == '/') {
+        p--;
+    }
+    *p = '\0';
+    return out;
+}
+
+/* One walk over passes whose paths have no symlinks in them, which it
+ * therefore reaches in place.  Returns 0 or the first errno.
+ */
+static int
+setPermsSegment(const DirPermissions *perms, int count, int flags,
+        DirPermsFailureFn onFailure, void *cookie)
+{
+    PermsWalk walk;
+    bool *isRoot;
+    int i, j;
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
-                errno = 0;
-            } else if (errno == 0) {
-                errno = -1;
+    memset(&walk, 0, sizeof(walk));
+    walk.perms = perms;
+    walk.count = count;
+    walk.flags = flags;
+    walk.onFailure = onFailure;
+    walk.cookie = cookie;
+    walk.paths = (char **) calloc(count, sizeof(char *));
+    walk.pathLens = (size_t *) calloc(count, sizeof(size_t));
+    walk.reached = (bool *) calloc(count, sizeof(bool));
+    isRoot = (bool *) calloc(count, sizeof(bool));
+    if (walk.paths == NULL || walk.pathLens == NULL ||
+            walk.reached == NULL || isRoot == NULL) {
+        walk.error = ENOMEM;
+        if (onFailure != NULL) {
+            onFailure(cookie, perms[0].path, "walk", ENOMEM);
+        }
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        if ((walk.paths[i] = normalizePermsPath(perms[i].path)) == NULL) {
+            walk.error = ENOMEM;
+            if (onFailure != NULL) {
+                onFailure(cookie, perms[i].path, "walk", ENOMEM);
             }
+            goto done;
         }
+        walk.pathLens[i] = strlen(walk.paths[i]);
+    }
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
 
-        if (errno != 0) {
-            int save = errno;
-            closedir(dir);
-            errno = save;
-            return -1;
+    /* Start from every pass that isn't below a recursive one... */
+    for (i = 0; i < count; i++) {
+        isRoot[i] = true;
+        for (j = 0; j < count; j++) {
+            size_t len = walk.pathLens[j];
+            if (perms[j].recursive && walk.pathLens[i] > len &&
+                    memcmp(walk.paths[i], walk.paths[j], len) == 0 &&
+                    (walk.paths[i][len] == '/' || len == 1)) {
+                isRoot[i] = false;
+                break;
+            }
         }
+    }
+    walkPerms(&walk, isRoot);
 
-        if (closedir(dir)) {
-            return -1;
+    /* ...then from any pass the walk didn't get to, which can only be
+     * one that appeared or became unreachable while it ran.
+     */
+    bool again = false;
+    for (i = 0; i < count; i++) {
+        isRoot[i] = !walk.reached[i];
+        again = again || isRoot[i];
+    }
+    if (again) {
+        walkPerms(&walk, isRoot);
+    }
+
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.lock);
+
+done:
+    if (walk.paths != NULL) {
+        for (i = 0; i < count; i++) {
+            free(walk.paths[i]);
         }
     }
+    free(walk.paths);
+    free(walk.pathLens);
+    free(walk.reached);
+    free(isRoot);
+    free(walk.jobs);
+    return walk.error;
+}
 
+/* True if <path> names itself: it exists and neither it nor any
+ * directory on the way to it is a symlink.
+ */
+static bool
+isPermsPathCanonical(const char *path)
+{
+    char resolved[PATH_MAX];
+    char *normal = normalizePermsPath(path);
+    bool canonical = normal != NULL && realpath(path, resolved) != NULL &&
+            strcmp(resolved, normal) == 0;
+    free(normal);
+    return canonical;
+}
+
+int
+dirSetPermissionsBatch(const DirPermissions *perms, int count, int flags,
+        DirPermsFailureFn onFailure, void *cookie)
+{
+    int error = 0;
+    int start = 0;
+    int i;
+
+    /* A pass the walk can't reach in place (through a symlink, or not
+     * there at all) runs on its own, with the passes before it flushed
+     * first, so the batch still behaves like the passes in order.
+     */
+    for (i = 0; i <= count; i++) {
+        if (i < count && isPermsPathCanonical(perms[i].path)) {
+            continue;
+        }
+        int err = start < i ? setPermsSegment(perms + start, i - start,
+                flags, onFailure, cookie) : 0;
+        if (error == 0) {
+            error = err;
+        }
+        if (i < count) {
+            err = setPermsSegment(perms + i, 1, flags, onFailure, cookie);
+            if (error == 0) {
+                error = err;
+            }
+        }
+        start = i + 1;
+    }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
     return 0;
 }
@@ -48,4 +48,51 @@ int dirUnlinkHierarchy(const char *path);
 int dirSetHierarchyPermissions(const char *path,
          int uid, int gid, int dirMode, int fileMode);
 
+/* One pass of a permission batch.  A recursive pass is the same as
+ * dirSetHierarchyPermissions(); otherwise <path> alone (following a
+ * symlink) is set to <fileMode>.
+ */
+typedef struct {
+    const char *path;
+    int uid;
+    int gid;
+    int dirMode;
+    int fileMode;
+    bool recursive;
+} DirPermissions;
+
+enum {
+    /* Leave alone inodes that already have the right owner and mode. */
+    DIR_PERMS_SKIP_UNCHANGED = 1,
+};
+
+/* Most threads a permission walk uses.
+ */
+#ifndef DIR_PERMS_MAX_THREADS
+#define DIR_PERMS_MAX_THREADS 4
+#endif
+
+/* Told about each inode the walk couldn't stat, open, chown or chmod
+ * (<what>), with errno in <err>, and about running out of memory
+ * ("walk") while at one.  Calls are serialized.
+ */
+typedef void (*DirPermsFailureFn)(void *cookie, const char *path,
+        const char *what, int err);
+
+/* Apply <count> passes in one walk over their trees, with the outcome
+ * of applying them one after another: each inode ends up as the last
+ * pass covering it says.  Passes are matched by path as given, so a
+ * pass whose path goes through a symlink (or doesn't exist) is applied
+ * on its own, in its place in the order, between walks over the rest.
+ *
+ * Directories are read on several threads, with every inode handled
+ * relative to its directory's fd.
+ *
+ * Carries on past failures, reporting each to <onFailure> if it isn't
+ * NULL; returns 0 if every inode could be set, otherwise -1 with errno
+ * from the first failure.
+ */
+int dirSetPermissionsBatch(const DirPermissions *perms, int count, int flags,
+        DirPermsFailureFn onFailure, void *cookie);
+
 #endif  // MINZIP_DIRUTIL_H_
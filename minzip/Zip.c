@@ -5,10 +5,12 @@
  */
 #include "safe_iop.h"
 #include "zlib.h"
+#include "digestutils/digest.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -429,12 +431,27 @@ bail:
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
-    MemMapping map;
+    int err = mzMapZipArchive(fileName, pArchive);
+    if (err == 0) {
+        err = mzParseZipArchive(pArchive);
+        if (err != 0)
+            mzCloseZipArchive(pArchive);
+    }
+    return err;
+}
+
+/*
+ * Open and map "fileName" without looking inside it.
+ *
+ * On failure the archive is closed again and a nonzero errno value (or
+ * -1) is returned.
+ */
+int mzMapZipArchive(const char* fileName, ZipArchive* pArchive)
+{
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
 
-    map.addr = NULL;
     memset(pArchive, 0, sizeof(*pArchive));
 
     pArchive->fd = open(fileName, O_RDONLY, 0);
@@ -444,36 +461,43 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
+    if (sysMapFileInShmem(pArchive->fd, &pArchive->map) != 0) {
         err = -1;
+        pArchive->map.addr = NULL;
         LOGW("Map of '%s' failed\n", fileName);
         goto bail;
     }
 
-    if (map.length < ENDHDR) {
+    if (pArchive->map.length < ENDHDR) {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
-        goto bail;
-    }
-
-    if (!parseZipArchive(pArchive, &map)) {
-        err = -1;
-        LOGV("Parsing '%s' failed\n", fileName);
+        LOGV("File '%s' too small to be zip (%zd)\n", fileName,
+                pArchive->map.length);
         goto bail;
     }
 
     err = 0;
-    sysCopyMap(&pArchive->map, &map);
-    map.addr = NULL;
 
 bail:
     if (err != 0)
         mzCloseZipArchive(pArchive);
-    if (map.addr != NULL)
-        sysReleaseShmem(&map);
     return err;
 }
 
+/*
+ * Parse the central directory of an archive opened by mzMapZipArchive().
+ *
+ * On failure -1 is returned and the archive is left for the caller to
+ * close.
+ */
+int mzParseZipArchive(ZipArchive* pArchive)
+{
+    if (!parseZipArchive(pArchive, &pArchive->map)) {
+        LOGV("Parsing %p failed\n", pArchive);
+        return -1;
+    }
+    return 0;
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -493,6 +517,7 @@ void mzCloseZipArchive(ZipArchive* pArchive)
     mzHashTableFree(pArchive->pHash);
 
     pArchive->fd = -1;
+    pArchive->map.addr = NULL;
     pArchive->pHash = NULL;
     pArchive->pEntries = NULL;
 }
@@ -523,34 +548,20 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
 }
 
 /* Call processFunction on the uncompressed data of a STORED entry.
+ * The data is handed over straight from the archive's mapping; the
+ * extent was checked against the mapping when the archive was opened.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
-    while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
-
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
-        }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
-            return false;
-        }
-        bytesLeft -= count;
+    const unsigned char *data =
+        (const unsigned char *)pArchive->map.addr + pEntry->offset;
+
+    if (pEntry->compLen == 0) {
+        return true;
     }
-    return true;
+    return processFunction(data, pEntry->compLen, cookie);
 }
 
 static bool processDeflatedEntry(const ZipArchive *pArchive,
@@ -558,23 +569,20 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     void *cookie)
 {
     long result = -1;
-    unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
-
-    compRemaining = pEntry->compLen;
 
     /*
-     * Initialize the zlib stream.
+     * Initialize the zlib stream.  The whole compressed entry is
+     * already mapped, so inflate reads it in place.
      */
     memset(&zstream, 0, sizeof(zstream));
     zstream.zalloc = Z_NULL;
     zstream.zfree = Z_NULL;
     zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
+    zstream.next_in = (Bytef*) pArchive->map.addr + pEntry->offset;
+    zstream.avail_in = pEntry->compLen;
     zstream.next_out = (Bytef*) procBuf;
     zstream.avail_out = sizeof(procBuf);
     zstream.data_type = Z_UNKNOWN;
@@ -598,25 +606,6 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
      * Loop while we have data.
      */
     do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
         /* uncompress the data */
         zerr = inflate(&zstream, Z_NO_FLUSH);
         if (zerr != Z_OK && zerr != Z_STREAM_END) {
@@ -674,13 +663,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,15 +677,13 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
 static bool crcProcessFunction(const unsigned char *data, int dataLen,
         void *crc)
 {
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
+    *(unsigned long *)crc = digest_crc32(*(unsigned long *)crc, data, dataLen);
     return true;
 }
 
@@ -716,7 +696,7 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     unsigned long crc;
     bool ret;
 
-    crc = crc32(0L, Z_NULL, 0);
+    crc = 0;
     ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
             (void *)&crc);
     if (!ret) {
@@ -731,6 +711,131 @@ bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
     return true;
 }
 
+/*
+ * Run worker(arg) on up to maxThreads threads, the calling thread
+ * included, and wait for all of them.  Returns the number of threads
+ * that ran; if none could be started, the caller's thread did it all.
+ */
+static int runWorkers(void *(*worker)(void *), void *arg, long maxThreads)
+{
+    pthread_t *threads = NULL;
+    int numThreads = 0;
+    int i;
+
+    if (maxThreads > 1) {
+        threads = (pthread_t *)malloc((maxThreads - 1) * sizeof(pthread_t));
+    }
+    while (threads != NULL && numThreads < maxThreads - 1 &&
+            pthread_create(&threads[numThreads], NULL, worker, arg) == 0) {
+        numThreads++;
+    }
+    worker(arg);
+    for (i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return numThreads + 1;
+}
+
+/*
+ * Shared state of mzVerifyArchive().  Workers take the next entry under
+ * the lock and report failures under it.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    const ZipEntry **entries;
+    unsigned int numEntries;
+    unsigned int nextEntry;
+    bool ok;
+    bool stop;
+    MzVerifyCallback callback;
+    void *cookie;
+    pthread_mutex_t lock;
+} MzVerifyQueue;
+
+/* Largest first, as for extraction. */
+static int compareVerifyEntries(const void *a, const void *b)
+{
+    long lenA = (*(const ZipEntry * const *)a)->uncompLen;
+    long lenB = (*(const ZipEntry * const *)b)->uncompLen;
+    return (lenA < lenB) - (lenA > lenB);
+}
+
+static void *verifyWorker(void *arg)
+{
+    MzVerifyQueue *queue = (MzVerifyQueue *)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        if (queue->stop || queue->nextEntry == queue->numEntries) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        const ZipEntry *pEntry = queue->entries[queue->nextEntry++];
+        pthread_mutex_unlock(&queue->lock);
+
+        if (mzIsZipEntryIntact(queue->pArchive, pEntry)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        queue->ok = false;
+        if (!queue->stop && (queue->callback == NULL ||
+                !queue->callback(pEntry, queue->cookie))) {
+            queue->stop = true;
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Check the CRC of every entry, on as many threads as there are cores
+ * (up to MZ_VERIFY_MAX_THREADS).  Entries are inflated straight from
+ * the archive mapping into per-call buffers, so the workers share
+ * nothing but the queue.
+ */
+bool mzVerifyArchive(const ZipArchive *pArchive, MzVerifyCallback callback,
+        void *cookie)
+{
+    MzVerifyQueue queue;
+    unsigned int i;
+
+    memset(&queue, 0, sizeof(queue));
+    queue.pArchive = pArchive;
+    queue.ok = true;
+    queue.callback = callback;
+    queue.cookie = cookie;
+    queue.numEntries = pArchive->numEntries;
+    queue.entries = (const ZipEntry **)malloc(
+            (queue.numEntries + 1) * sizeof(const ZipEntry *));
+    if (queue.entries == NULL) {
+        LOGE("Can't allocate verify queue for %u entries\n",
+                queue.numEntries);
+        return false;
+    }
+    for (i = 0; i < queue.numEntries; i++) {
+        queue.entries[i] = &pArchive->pEntries[i];
+    }
+    qsort(queue.entries, queue.numEntries, sizeof(const ZipEntry *),
+            compareVerifyEntries);
+    pthread_mutex_init(&queue.lock, NULL);
+
+    long wanted = sysconf(_SC_NPROCESSORS_ONLN);
+    if (wanted > MZ_VERIFY_MAX_THREADS) {
+        wanted = MZ_VERIFY_MAX_THREADS;
+    }
+    if (wanted > (long)queue.numEntries) {
+        wanted = queue.numEntries;
+    }
+    int numThreads = runWorkers(verifyWorker, &queue, wanted);
+    LOGD("Checked %u entries on %d threads: %s\n", queue.numEntries,
+            numThreads, queue.ok ? "intact" : "corrupt");
+
+    pthread_mutex_destroy(&queue.lock);
+    free(queue.entries);
+    return queue.ok;
+}
+
 typedef struct {
     char *buf;
     int bufLen;
@@ -907,6 +1012,150 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/*
+ * Extract a regular file entry to targetFile, whose directory must
+ * already exist.  Safe to call from several threads at once.
+ */
+static bool extractFileEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, const char *targetFile,
+    const struct utimbuf *timestamp)
+{
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    if (close(fd) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/*
+ * Regular files queued for extraction by MZ_EXTRACT_PARALLEL.  Workers
+ * take the next job under the lock; the callback is also called under
+ * it, so callbacks never run concurrently.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    MzExtractJob *jobs;
+    int numJobs;
+    int allocJobs;
+    int nextJob;
+    bool ok;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+    pthread_mutex_t lock;
+} MzExtractQueue;
+
+static bool queueExtractJob(MzExtractQueue *queue, const ZipEntry *pEntry,
+    const char *targetFile)
+{
+    if (queue->numJobs == queue->allocJobs) {
+        int allocJobs = queue->allocJobs ? queue->allocJobs * 2 : 256;
+        MzExtractJob *jobs = (MzExtractJob *)realloc(queue->jobs,
+                allocJobs * sizeof(MzExtractJob));
+        if (jobs == NULL) {
+            return false;
+        }
+        queue->jobs = jobs;
+        queue->allocJobs = allocJobs;
+    }
+    MzExtractJob *job = &queue->jobs[queue->numJobs];
+    job->pEntry = pEntry;
+    job->targetFile = strdup(targetFile);
+    if (job->targetFile == NULL) {
+        return false;
+    }
+    queue->numJobs++;
+    return true;
+}
+
+/* Largest first, so a big file picked up last doesn't leave the other
+ * workers idle at the end.
+ */
+static int compareExtractJobs(const void *a, const void *b)
+{
+    long lenA = ((const MzExtractJob *)a)->pEntry->uncompLen;
+    long lenB = ((const MzExtractJob *)b)->pEntry->uncompLen;
+    return (lenA < lenB) - (lenA > lenB);
+}
+
+static void *extractWorker(void *arg)
+{
+    MzExtractQueue *queue = (MzExtractQueue *)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        if (!queue->ok || queue->nextJob == queue->numJobs) {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        MzExtractJob *job = &queue->jobs[queue->nextJob++];
+        pthread_mutex_unlock(&queue->lock);
+
+        bool ok = extractFileEntry(queue->pArchive, job->pEntry,
+                job->targetFile, queue->timestamp);
+
+        pthread_mutex_lock(&queue->lock);
+        if (!ok) {
+            queue->ok = false;
+        } else if (queue->callback != NULL) {
+            queue->callback(job->targetFile, queue->cookie);
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Extract every queued file on up to MZ_EXTRACT_MAX_THREADS threads,
+ * the calling thread included.  Each job inflates on its own stack and
+ * writes through its own fd, and the archive is only read through its
+ * mapping, so the jobs share nothing but the queue.
+ */
+static bool runExtractQueue(MzExtractQueue *queue)
+{
+    qsort(queue->jobs, queue->numJobs, sizeof(MzExtractJob),
+            compareExtractJobs);
+
+    /* One thread more than there are cores keeps the CPU busy while
+     * another worker waits for the filesystem.
+     */
+    long wanted = sysconf(_SC_NPROCESSORS_ONLN) + 1;
+    if (wanted > MZ_EXTRACT_MAX_THREADS) {
+        wanted = MZ_EXTRACT_MAX_THREADS;
+    }
+    if (wanted > queue->numJobs) {
+        wanted = queue->numJobs;
+    }
+    int numThreads = runWorkers(extractWorker, queue, wanted);
+    LOGD("Extracted %d files on %d threads\n", queue->numJobs, numThreads);
+    return queue->ok;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -976,6 +1225,18 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
+    /* In parallel mode, directories and symlinks are still made in this
+     * loop, so every directory exists before any file is written; the
+     * regular files are queued and extracted afterwards.
+     */
+    MzExtractQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.pArchive = pArchive;
+    queue.timestamp = timestamp;
+    queue.ok = true;
+    queue.callback = callback;
+    queue.cookie = cookie;
+
     /* Walk through the entries and extract anything whose path begins
      * with zpath.
 //TODO: since the entries are sorted, binary search for the first match
@@ -1040,8 +1301,6 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
                 int ret = dirCreateHierarchy(
@@ -1109,39 +1368,40 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
                         targetFile, linkTarget);
                 free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
+            } else if (flags & MZ_EXTRACT_PARALLEL) {
+                /* The entry is a regular file; leave it to the workers,
+                 * which call the callback once it's written.
                  */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
+                if (!queueExtractJob(&queue, pEntry, targetFile)) {
+                    LOGE("Can't queue \"%s\" for extraction\n", targetFile);
                     ok = false;
                     break;
                 }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                continue;
+            } else {
+                /* The entry is a regular file.
+                 */
+                if (!extractFileEntry(pArchive, pEntry, targetFile,
+                        timestamp)) {
                     ok = false;
                     break;
                 }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
             }
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && queue.numJobs > 0) {
+        pthread_mutex_init(&queue.lock, NULL);
+        ok = runExtractQueue(&queue);
+        pthread_mutex_destroy(&queue.lock);
+    }
+    for (i = 0; i < (unsigned int)queue.numJobs; i++) {
+        free(queue.jobs[i].targetFile);
+    }
+    free(queue.jobs);
+
     free(helper.buf);
     free(zpath);
 
@@ -63,6 +63,18 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * The two halves of mzOpenZipArchive(), for callers that need to check
+ * the raw archive (in pArchive->map) before its contents are trusted.
+ * mzMapZipArchive() opens and maps the file; mzParseZipArchive() then
+ * reads the central directory out of the mapping.  Both return 0 on
+ * success.  mzMapZipArchive() closes the archive if it fails; after
+ * a failed mzParseZipArchive() the mapping stays valid until the caller
+ * calls mzCloseZipArchive().
+ */
+int mzMapZipArchive(const char* fileName, ZipArchive* pArchive);
+int mzParseZipArchive(ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -162,6 +174,27 @@ bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
  */
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry);
 
+/*
+ * Check the CRC of every entry in the archive, several at a time.
+ *
+ * If callback is non-NULL, it is called with each entry that fails the
+ * check, never two at once.  Returning true from it carries on so that
+ * every bad entry is reported; returning false stops at that one.
+ * Without a callback the check stops at the first bad entry.
+ *
+ * Returns true if every entry is intact.
+ */
+typedef bool (*MzVerifyCallback)(const ZipEntry *pEntry, void *cookie);
+
+/* Most threads mzVerifyArchive() uses.
+ */
+#ifndef MZ_VERIFY_MAX_THREADS
+#define MZ_VERIFY_MAX_THREADS 8
+#endif
+
+bool mzVerifyArchive(const ZipArchive *pArchive, MzVerifyCallback callback,
+        void *cookie);
+
 /*
  * Inflate and write an entry to a file.
  */
@@ -197,14 +230,29 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - create directories first, then inflate the
+ *         regular files on several threads
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
  * If callback is non-NULL, it will be invoked with each unpacked file.
+ * With MZ_EXTRACT_PARALLEL, files are reported in the order they finish,
+ * from whichever thread wrote them, but never two at once.
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum {
+    MZ_EXTRACT_FILES_ONLY = 1,
+    MZ_EXTRACT_DRY_RUN = 2,
+    MZ_EXTRACT_PARALLEL = 4,
+};
+
+/* Most threads MZ_EXTRACT_PARALLEL uses.
+ */
+#ifndef MZ_EXTRACT_MAX_THREADS
+#define MZ_EXTRACT_MAX_THREADS 4
+#endif
+
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
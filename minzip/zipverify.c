@@ -0,0 +1,61 @@
+/*
+ * Check the CRC of every entry of one or more zip files.
+ *
+ *     zipverify [-a] file.zip...
+ *
+ * Stops at the first bad entry of each file unless -a is given.  Exits
+ * non-zero if any file couldn't be opened or has a bad entry.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "Zip.h"
+
+static bool reportBadEntry(const ZipEntry *pEntry, void *cookie)
+{
+    const char *fileName = (const char *)cookie;
+    printf("%s: %.*s: bad CRC\n", fileName, pEntry->fileNameLen,
+            pEntry->fileName);
+    return true;
+}
+
+static bool reportFirstBadEntry(const ZipEntry *pEntry, void *cookie)
+{
+    reportBadEntry(pEntry, cookie);
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    bool all = false;
+    int status = 0;
+    int i = 1;
+
+    if (i < argc && strcmp(argv[i], "-a") == 0) {
+        all = true;
+        i++;
+    }
+    if (i == argc) {
+        fprintf(stderr, "usage: %s [-a] file.zip...\n", argv[0]);
+        return 2;
+    }
+
+    for (; i < argc; i++) {
+        ZipArchive zip;
+        int err = mzOpenZipArchive(argv[i], &zip);
+        if (err != 0) {
+            printf("%s: can't open (%s)\n", argv[i],
+                    err != -1 ? strerror(err) : "bad");
+            status = 1;
+            continue;
+        }
+        if (mzVerifyArchive(&zip,
+                all ? reportBadEntry : reportFirstBadEntry, argv[i])) {
+            printf("%s: OK (%u entries)\n", argv[i], zip.numEntries);
+        } else {
+            status = 1;
+        }
+        mzCloseZipArchive(&zip);
+    }
+    return status;
+}
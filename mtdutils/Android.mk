@@ -6,10 +6,16 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
 	mtdutils.c \
-	mounts.c
+	mounts.c \
+	sparse_image.c
 
 LOCAL_MODULE := libmtdutils
 
+# ALWAYS, SAMPLE or HASH; see mtd_write_set_verify() in mtdutils.h
+ifdef BOARD_MTD_WRITE_VERIFY
+  LOCAL_CFLAGS += -DMTD_WRITE_VERIFY=MTD_VERIFY_$(BOARD_MTD_WRITE_VERIFY)
+endif
+
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
@@ -36,6 +42,14 @@ LOCAL_STATIC_LIBRARIES := libmtdutils
 LOCAL_SHARED_LIBRARIES := libcutils libc
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := mtd_read_bench.c
+LOCAL_MODULE := mtd_read_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libmtdutils
+LOCAL_SHARED_LIBRARIES := libcutils libc
+include $(BUILD_EXECUTABLE)
+
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := flash_image.c
 LOCAL_MODULE_TAGS := optional
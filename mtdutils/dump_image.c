@@ -24,6 +24,7 @@
 
 #include "cutils/log.h"
 #include "mtdutils.h"
+#include "sparse_image.h"
 #include "dump_image.h"
 
 #ifdef LOG_TAG
@@ -32,9 +33,6 @@
 
 #define LOG_TAG "dump_image"
 
-#define BLOCK_SIZE    2048
-#define SPARE_SIZE    (BLOCK_SIZE >> 5)
-
 static int die(const char *msg, ...) {
     int err = errno;
     va_list args;
@@ -52,18 +50,33 @@ static int die(const char *msg, ...) {
     return 1;
 }
 
-/* Read a flash partition and write it to an image file. */
+static ssize_t write_fd(void *cookie, const char *data, size_t len) {
+    int fd = *(int *) cookie;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = write(fd, data + done, len - done);
+        if (r <= 0) return -1;
+        done += r;
+    }
+    return done;
+}
+
+/* Read a flash partition and write it to an image file.  Files named
+ * *.simg are written as sparse images.
+ */
 
 int dump_image(char* partition_name, char* filename, dump_image_callback callback) {
     MtdReadContext *in;
     const MtdPartition *partition;
-    char buf[BLOCK_SIZE + SPARE_SIZE];
+    char *buf;
+    size_t buf_size;
     size_t partition_size;
-    size_t read_size;
+    size_t erase_size;
     size_t total;
     int fd;
     int wrote;
     int len;
+    SparseWriter *sparse = NULL;
     
     if (mtd_scan_partitions() <= 0)
         return die("error scanning partitions");
@@ -72,7 +85,7 @@ int dump_image(char* partition_name, char* filename, dump_image_callback callbac
     if (partition == NULL)
         return die("can't find %s partition", partition_name);
 
-    if (mtd_partition_info(partition, &partition_size, NULL, NULL)) {
+    if (mtd_partition_info(partition, &partition_size, &erase_size, NULL)) {
         return die("can't get info of partition %s", partition_name);
     }
 
@@ -86,28 +99,56 @@ int dump_image(char* partition_name, char* filename, dump_image_callback callbac
     if (fd < 0)
         return die("error opening %s", filename);
 
-    in = mtd_read_partition(partition);
+    len = strlen(filename);
+    if (len > 5 && !strcmp(filename + len - 5, ".simg")) {
+        sparse = sparse_writer_open(write_fd, &fd);
+        if (sparse == NULL) {
+            close(fd);
+            unlink(filename);
+            return die("error writing %s", filename);
+        }
+    }
+
+    // Read whole erase blocks, a batch at a time, so mtd_read_data can
+    // fetch them with one read() straight into buf.
+    buf_size = erase_size * MTD_READ_BATCH_BLOCKS;
+    buf = malloc(buf_size);
+    in = buf != NULL ? mtd_read_partition(partition) : NULL;
     if (in == NULL) {
+        free(buf);
+        if (sparse != NULL) sparse_writer_close(sparse);
         close(fd);
         unlink(filename);
         return die("error opening %s: %s\n", partition_name, strerror(errno));
     }
 
     total = 0;
-    while ((len = mtd_read_data(in, buf, BLOCK_SIZE)) > 0) {
-        wrote = write(fd, buf, len);
+    while ((len = mtd_read_data(in, buf, buf_size)) > 0) {
+        if (sparse != NULL)
+            wrote = sparse_writer_write(sparse, buf, len);
+        else
+            wrote = write_fd(&fd, buf, len);
         if (wrote != len) {
+            mtd_read_close(in);
+            free(buf);
+            if (sparse != NULL) sparse_writer_close(sparse);
             close(fd);
             unlink(filename);
             return die("error writing %s", filename);
         }
-        total += BLOCK_SIZE;
+        total += len;
         if (callback != NULL)
             callback(total, partition_size);
     }
 
     mtd_read_close(in);
+    free(buf);
 
+    if (sparse != NULL && sparse_writer_close(sparse)) {
+        close(fd);
+        unlink(filename);
+        return die("error writing %s", filename);
+    }
     if (close(fd)) {
         unlink(filename);
         return die("error closing %s", filename);
@@ -117,17 +158,6 @@ int dump_image(char* partition_name, char* filename, dump_image_callback callbac
 
 int main(int argc, char **argv)
 {
-    ssize_t (*read_func) (MtdReadContext *, char *, size_t);
-    MtdReadContext *in;
-    const MtdPartition *partition;
-    char buf[BLOCK_SIZE + SPARE_SIZE];
-    size_t partition_size;
-    size_t read_size;
-    size_t total;
-    int fd;
-    int wrote;
-    int len;
-
     if (argc != 3) {
         fprintf(stderr, "usage: %s partition file.img\n", argv[0]);
         return 2;
@@ -23,6 +23,7 @@
 
 #include "cutils/log.h"
 #include "mtdutils.h"
+#include "sparse_image.h"
 
 #define LOG_TAG "flash_image"
 
@@ -46,6 +47,45 @@ void die(const char *msg, ...) {
     exit(1);
 }
 
+/* Image files are read through these so that sparse images (see
+ * sparse_image.h) are expanded transparently.
+ */
+typedef struct {
+    int fd;
+    SparseReader *sparse;
+} ImageFile;
+
+static ssize_t read_fd(void *cookie, char *data, size_t len) {
+    int fd = *(int *) cookie;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, data + got, len - got);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return got;
+}
+
+static int image_rewind(ImageFile *image) {
+    char header[SPARSE_HEADER_SIZE];
+    if (image->sparse != NULL) sparse_reader_close(image->sparse);
+    image->sparse = NULL;
+    if (lseek(image->fd, 0, SEEK_SET) != 0) return -1;
+    if (read_fd(&image->fd, header, sizeof(header)) == sizeof(header) &&
+        sparse_is_image(header, sizeof(header))) {
+        if (lseek(image->fd, 0, SEEK_SET) != 0) return -1;
+        image->sparse = sparse_reader_open(read_fd, &image->fd);
+        return image->sparse == NULL ? -1 : 0;
+    }
+    return lseek(image->fd, 0, SEEK_SET) == 0 ? 0 : -1;
+}
+
+static ssize_t image_read(ImageFile *image, char *data, size_t len) {
+    if (image->sparse != NULL) return sparse_reader_read(image->sparse, data, len);
+    return read(image->fd, data, len);
+}
+
 /* Read an image file and write it to a flash partition. */
 
 int main(int argc, char **argv) {
@@ -65,11 +105,12 @@ int main(int argc, char **argv) {
 
     // If the first part of the file matches the partition, skip writing
 
-    int fd = open(argv[2], O_RDONLY);
-    if (fd < 0) die("error opening %s", argv[2]);
+    ImageFile image = { open(argv[2], O_RDONLY), NULL };
+    if (image.fd < 0) die("error opening %s", argv[2]);
+    if (image_rewind(&image)) die("error reading %s", argv[2]);
 
     char header[HEADER_SIZE];
-    int headerlen = read(fd, header, sizeof(header));
+    int headerlen = image_read(&image, header, sizeof(header));
     if (headerlen <= 0) die("error reading %s header", argv[2]);
 
     MtdReadContext *in = mtd_read_partition(partition);
@@ -100,12 +141,23 @@ int main(int argc, char **argv) {
     int wrote = mtd_write_data(out, buf, headerlen);
     if (wrote != headerlen) die("error writing %s", argv[1]);
 
+    size_t block_size;
+    if (mtd_partition_info(partition, NULL, &block_size, NULL))
+        die("error getting %s block size", argv[1]);
+
+    // Hand the writer several erase blocks at a time so it can erase
+    // ahead of the data.
+    size_t chunk_size = block_size * MTD_WRITE_ERASE_AHEAD;
+    char *chunk = malloc(chunk_size);
+    if (chunk == NULL) die("out of memory");
+
     int len;
-    while ((len = read(fd, buf, sizeof(buf))) > 0) {
-        wrote = mtd_write_data(out, buf, len);
+    while ((len = image_read(&image, chunk, chunk_size)) > 0) {
+        wrote = mtd_write_data(out, chunk, len);
         if (wrote != len) die("error writing %s", argv[1]);
     }
     if (len < 0) die("error reading %s", argv[2]);
+    free(chunk);
 
     if (mtd_write_close(out)) die("error closing %s", argv[1]);
 
@@ -118,17 +170,14 @@ int main(int argc, char **argv) {
     if (wrote != headerlen) die("error re-writing %s", argv[1]);
 
     // Need to write a complete block, so write the rest of the first block
-    size_t block_size;
-    if (mtd_partition_info(partition, NULL, &block_size, NULL))
-        die("error getting %s block size", argv[1]);
 
-    if (lseek(fd, headerlen, SEEK_SET) != headerlen)
+    if (image_rewind(&image) || image_read(&image, buf, headerlen) != headerlen)
         die("error rewinding %s", argv[2]);
 
     int left = block_size - headerlen;
     while (left < 0) left += block_size;
     while (left > 0) {
-        len = read(fd, buf, left > (int)sizeof(buf) ? (int)sizeof(buf) : left);
+        len = image_read(&image, buf, left > (int)sizeof(buf) ? (int)sizeof(buf) : left);
         if (len <= 0) die("error reading %s", argv[2]);
         if (mtd_write_data(out, buf, len) != len)
             die("error writing %s", argv[1]);
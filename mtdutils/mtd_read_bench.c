@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "mtdutils.h"
+
+/* Times a full read of an MTD partition through mtd_read_data, the way
+ * dump_image and the backup code read it, at a few request sizes.
+ *
+ *     mtd_read_bench partition [passes]
+ */
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Reads the whole partition in len-byte requests.  Returns the number of
+ * bytes read, or -1 on error.
+ */
+static long long read_partition(const MtdPartition *partition, char *buf, size_t len)
+{
+    MtdReadContext *in = mtd_read_partition(partition);
+    if (in == NULL) return -1;
+
+    long long total = 0;
+    ssize_t r;
+    while ((r = mtd_read_data(in, buf, len)) > 0) total += r;
+    if (errno != ENOSPC) total = -1;
+    mtd_read_close(in);
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s partition [passes]\n", argv[0]);
+        return 2;
+    }
+    int passes = argc > 2 ? atoi(argv[2]) : 3;
+    if (passes <= 0) passes = 1;
+
+    if (mtd_scan_partitions() <= 0) {
+        fprintf(stderr, "error scanning partitions\n");
+        return 1;
+    }
+    const MtdPartition *partition = mtd_find_partition_by_name(argv[1]);
+    size_t erase_size;
+    if (partition == NULL ||
+            mtd_partition_info(partition, NULL, &erase_size, NULL)) {
+        fprintf(stderr, "can't find %s partition\n", argv[1]);
+        return 1;
+    }
+
+    const size_t sizes[] = {
+        2048, erase_size, erase_size * MTD_READ_BATCH_BLOCKS,
+    };
+    char *buf = malloc(erase_size * MTD_READ_BATCH_BLOCKS);
+    if (buf == NULL) return 1;
+
+    int failed = 0;
+    long long expected = -1;
+    size_t i;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        long long total = 0;
+        int p;
+        double start = now();
+        for (p = 0; p < passes; ++p) {
+            total = read_partition(partition, buf, sizes[i]);
+            if (total < 0) break;
+        }
+        double secs = now() - start;
+        if (total < 0) {
+            printf("%8zu bytes/read: read error (%s)\n", sizes[i], strerror(errno));
+            failed = 1;
+            continue;
+        }
+        printf("%8zu bytes/read: %lld bytes, %8.1f MB/s\n", sizes[i], total,
+               secs > 0 ? total * passes / secs / (1024 * 1024) : 0.0);
+        if (expected < 0) expected = total;
+        if (total != expected) {
+            printf("%8zu bytes/read: MISMATCH\n", sizes[i]);
+            failed = 1;
+        }
+    }
+
+    free(buf);
+    return failed;
+}
@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
 #include <mtd/mtd-user.h>
@@ -30,36 +32,132 @@
 
 struct MtdReadContext {
     const MtdPartition *partition;
-    char *buffer;
+    char *buffer;           // buffer_blocks erase blocks
+    int buffer_blocks;
+    size_t buffered;        // good data in buffer
     size_t consumed;
     int fd;
+
+    loff_t pos;             // next block to read
+    int block_count;
 };
 
+enum { VERIFY_PENDING, VERIFY_OK, VERIFY_FAILED };
+
+/* A written block waiting to be read back.  Its data is kept until it
+ * passes, in case it has to be written again.
+ */
+typedef struct {
+    loff_t pos;
+    char *data;
+    int tries;              // earlier failures of this data at pos
+    int check;              // 0 if the sampling policy skips this block
+    int state;              // VERIFY_*
+} VerifySlot;
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
     size_t stored;
     int fd;
 
-    off_t* bad_block_offsets;
-    int bad_block_alloc;
-    int bad_block_count;
+    loff_t pos;             // next block to write
+    loff_t erased_to;       // good blocks from pos up to here are erased
+    int verify;             // MTD_VERIFY_*
+    int written;            // blocks written, for MTD_VERIFY_SAMPLE
+    loff_t hash_start;      // MTD_VERIFY_HASH: first block in hash
+    uint32_t hash;
+
+    // Read-back verification, a few blocks behind the writes
+    pthread_t verifier;
+    int verifier_running;
+    int verify_fd;
+    char *verify_buffer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    VerifySlot slots[MTD_WRITE_VERIFY_DEPTH];
+    int first;              // oldest slot in use
+    int count;              // slots in use
+    int checked;            // slots from first the verifier is done with
+    int stop;
 };
 
+#define HASH_SEED 0x4d544431    // "MTD1"
+
 typedef struct {
     MtdPartition *partitions;
+    unsigned char **bad_blocks;  // per partition, see load_bad_blocks()
     int partitions_allocd;
     int partition_count;
 } MtdState;
 
 static MtdState g_mtd_state = {
     NULL,   // partitions
+    NULL,   // bad_blocks
     0,      // partitions_allocd
     -1      // partition_count
 };
 
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
+/* Bad block table for each partition: one bit per erase block, read from
+ * the device when the partition is first opened and shared by every read
+ * and write context after that.  Blocks that fail to erase or write are
+ * added, so later writers skip them and readers don't pick up whatever
+ * was left in them.
+ */
+static pthread_mutex_t g_bad_block_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void drop_bad_blocks(int index)
+{
+    free(g_mtd_state.bad_blocks[index]);
+    g_mtd_state.bad_blocks[index] = NULL;
+}
+
+static int load_bad_blocks(const MtdPartition *partition, int fd)
+{
+    int r = 0;
+    pthread_mutex_lock(&g_bad_block_lock);
+    if (g_mtd_state.bad_blocks[partition->device_index] == NULL) {
+        const int count = partition->size / partition->erase_size;
+        unsigned char *table = calloc((count + 7) / 8, 1);
+        if (table == NULL) {
+            r = -1;
+        } else {
+            int i;
+            for (i = 0; i < count; ++i) {
+                loff_t pos = (loff_t) i * partition->erase_size;
+                int mgbb = ioctl(fd, MEMGETBADBLOCK, &pos);
+                if (mgbb) {
+                    fprintf(stderr,
+                            "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
+                            mgbb, pos, errno);
+                }
+                if (mgbb > 0) table[i / 8] |= 1 << (i % 8);
+            }
+            g_mtd_state.bad_blocks[partition->device_index] = table;
+        }
+    }
+    pthread_mutex_unlock(&g_bad_block_lock);
+    return r;
+}
+
+static int is_bad_block(const MtdPartition *partition, loff_t pos)
+{
+    const unsigned char *table = g_mtd_state.bad_blocks[partition->device_index];
+    const int block = pos / partition->erase_size;
+    return table[block / 8] & (1 << (block % 8));
+}
+
+static void mark_bad_block(const MtdPartition *partition, loff_t pos)
+{
+    unsigned char *table = g_mtd_state.bad_blocks[partition->device_index];
+    const int block = pos / partition->erase_size;
+    pthread_mutex_lock(&g_bad_block_lock);
+    table[block / 8] |= 1 << (block % 8);
+    pthread_mutex_unlock(&g_bad_block_lock);
+}
+
 int
 mtd_scan_partitions()
 {
@@ -72,11 +170,15 @@ mtd_scan_partitions()
     if (g_mtd_state.partitions == NULL) {
         const int nump = 32;
         MtdPartition *partitions = malloc(nump * sizeof(*partitions));
-        if (partitions == NULL) {
+        unsigned char **bad_blocks = calloc(nump, sizeof(*bad_blocks));
+        if (partitions == NULL || bad_blocks == NULL) {
+            free(partitions);
+            free(bad_blocks);
             errno = ENOMEM;
             return -1;
         }
         g_mtd_state.partitions = partitions;
+        g_mtd_state.bad_blocks = bad_blocks;
         g_mtd_state.partitions_allocd = nump;
         memset(partitions, 0, nump * sizeof(*partitions));
     }
@@ -134,6 +236,11 @@ mtd_scan_partitions()
          */
         if (matches == 4) {
             MtdPartition *p = &g_mtd_state.partitions[mtdnum];
+            // Keep the bad block table unless the partition changed.
+            if (p->size != (unsigned int) mtdsize ||
+                    p->erase_size != (unsigned int) mtderasesize) {
+                drop_bad_blocks(mtdnum);
+            }
             p->device_index = mtdnum;
             p->size = mtdsize;
             p->erase_size = mtderasesize;
@@ -157,6 +264,9 @@ mtd_scan_partitions()
         }
     }
 
+    for (i = 0; i < g_mtd_state.partitions_allocd; i++) {
+        if (g_mtd_state.partitions[i].device_index < 0) drop_bad_blocks(i);
+    }
     return g_mtd_state.partition_count;
 
 bail:
@@ -249,7 +359,7 @@ mtd_partition_info(const MtdPartition *partition,
 
 MtdReadContext *mtd_read_partition(const MtdPartition *partition)
 {
-    MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
+    MtdReadContext *ctx = (MtdReadContext*) calloc(1, sizeof(MtdReadContext));
     if (ctx == NULL) return NULL;
 
     ctx->buffer = malloc(partition->erase_size);
@@ -262,17 +372,53 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
     ctx->fd = open(mtddevname, O_RDONLY);
     if (ctx->fd < 0) {
+        free(ctx->buffer);
         free(ctx);
+        return NULL;
+    }
+
+    if (load_bad_blocks(partition, ctx->fd)) {
+        close(ctx->fd);
         free(ctx->buffer);
+        free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    ctx->block_count = partition->size / partition->erase_size;
+    ctx->buffer_blocks = 1;
     return ctx;
 }
 
-static int read_block(const MtdPartition *partition, int fd, char *data)
+/* Returns non-zero if every byte of the block is zero, a word at a time.
+ */
+static int block_is_zero(const char *data, size_t size)
+{
+    while (size > 0 && (unsigned long) data % sizeof(unsigned long) != 0) {
+        if (*data++ != 0) return 0;
+        --size;
+    }
+
+    const unsigned long *word = (const unsigned long *) data;
+    while (size >= 4 * sizeof(unsigned long)) {
+        if (word[0] | word[1] | word[2] | word[3]) return 0;
+        word += 4;
+        size -= 4 * sizeof(unsigned long);
+    }
+
+    data = (const char *) word;
+    while (size > 0) {
+        if (*data++ != 0) return 0;
+        --size;
+    }
+    return 1;
+}
+
+/* Reads count adjacent erase blocks at pos with a single read(), checking
+ * the ECC stats once for the whole run.  Returns 0 on success, 1 if the
+ * run couldn't be read cleanly, or -1 if the ECC stats are unavailable.
+ */
+static int read_run(int fd, loff_t pos, char *data, size_t size)
 {
     struct mtd_ecc_stats before, after;
     if (ioctl(fd, ECCGETSTATS, &before)) {
@@ -280,74 +426,124 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
         return -1;
     }
 
-    loff_t pos = lseek64(fd, 0, SEEK_CUR);
-
-    ssize_t size = partition->erase_size;
-    int mgbb;
+    if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != (ssize_t) size) {
+        fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
+                pos, strerror(errno));
+        return 1;
+    }
+    if (ioctl(fd, ECCGETSTATS, &after)) {
+        fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+        return -1;
+    }
+    if (after.failed != before.failed) {
+        fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
+                after.corrected - before.corrected,
+                after.failed - before.failed, pos);
+        return 1;
+    }
+    return 0;
+}
 
-    while (pos + size <= (int) partition->size) {
-        if (lseek64(fd, pos, SEEK_SET) != pos || read(fd, data, size) != size) {
-            fprintf(stderr, "mtd: read error at 0x%08llx (%s)\n",
-                    pos, strerror(errno));
-        } else if (ioctl(fd, ECCGETSTATS, &after)) {
-            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+/* Reads up to count good erase blocks from the current position into
+ * data, skipping bad, unreadable and all-zero blocks.  Returns the number
+ * of blocks stored (at least one), or -1 with errno set to ENOSPC at the
+ * end of the partition.
+ */
+static int read_blocks(MtdReadContext *ctx, char *data, int count)
+{
+    const size_t size = ctx->partition->erase_size;
+    int stored = 0;
+
+    while (stored == 0) {
+        int block = ctx->pos / size;
+        while (block < ctx->block_count &&
+               is_bad_block(ctx->partition, (loff_t) block * size)) {
+            ++block;
+        }
+        if (block >= ctx->block_count) {
+            ctx->pos = (loff_t) block * size;
+            errno = ENOSPC;
             return -1;
-        } else if (after.failed != before.failed) {
-            fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08llx\n",
-                    after.corrected - before.corrected,
-                    after.failed - before.failed, pos);
-        } else if ((mgbb = ioctl(fd, MEMGETBADBLOCK, &pos))) {
-            fprintf(stderr,
-                    "mtd: MEMGETBADBLOCK returned %d at 0x%08llx (errno=%d)\n",
-                    mgbb, pos, errno);
-        } else {
-            int i;
-            for (i = 0; i < size; ++i) {
-                if (data[i] != 0) {
-                    return 0;  // Success!
-                }
-            }
-            fprintf(stderr, "mtd: read all-zero block at 0x%08llx; skipping\n",
-                    pos);
         }
 
-        pos += partition->erase_size;
-    }
+        int run = 1;
+        while (run < count && block + run < ctx->block_count &&
+               !is_bad_block(ctx->partition, (loff_t) (block + run) * size)) {
+            ++run;
+        }
+        loff_t pos = (loff_t) block * size;
+        ctx->pos = pos + (loff_t) run * size;
 
-    errno = ENOSPC;
-    return -1;
+        int r = read_run(ctx->fd, pos, data, run * size);
+        if (r < 0) return -1;
+
+        int i;
+        for (i = 0; i < run; ++i) {
+            char *dest = data + stored * size;
+            if (r != 0) {
+                // Find the block that failed, one at a time.
+                if (run == 1) break;
+                int rb = read_run(ctx->fd, pos + (loff_t) i * size, dest, size);
+                if (rb < 0) return -1;
+                if (rb != 0) continue;
+            } else if (i != stored) {
+                memmove(dest, data + i * size, size);
+            }
+
+            if (block_is_zero(dest, size)) {
+                fprintf(stderr, "mtd: read all-zero block at 0x%08llx; skipping\n",
+                        pos + (loff_t) i * size);
+                continue;
+            }
+            ++stored;
+        }
+    }
+    return stored;
 }
 
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
-    ssize_t read = 0;
-    while (read < (int) len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
+    const size_t size = ctx->partition->erase_size;
+    size_t read = 0;
+    while (read < len) {
+        if (ctx->consumed < ctx->buffered) {
+            size_t avail = ctx->buffered - ctx->consumed;
             size_t copy = len - read < avail ? len - read : avail;
             memcpy(data + read, ctx->buffer + ctx->consumed, copy);
             ctx->consumed += copy;
             read += copy;
+            continue;
         }
 
         // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
-        }
-
-        if (read >= len) {
-            return read;
+        if (len - read >= size) {
+            size_t want = (len - read) / size;
+            if (want > MTD_READ_BATCH_BLOCKS) want = MTD_READ_BATCH_BLOCKS;
+            int got = read_blocks(ctx, data + read, want);
+            if (got < 0) break;
+            read += got * size;
+            continue;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
-            ctx->consumed = 0;
+        // Refill the buffer, reading further ahead each time so small
+        // readers of a few bytes don't pay for a large buffer.
+        if (ctx->buffered > 0 && ctx->buffer_blocks < MTD_READ_BATCH_BLOCKS) {
+            int blocks = ctx->buffer_blocks * 2;
+            if (blocks > MTD_READ_BATCH_BLOCKS) blocks = MTD_READ_BATCH_BLOCKS;
+            char *buffer = realloc(ctx->buffer, blocks * size);
+            if (buffer != NULL) {
+                ctx->buffer = buffer;
+                ctx->buffer_blocks = blocks;
+            }
         }
+        int got = read_blocks(ctx, ctx->buffer, ctx->buffer_blocks);
+        if (got < 0) break;
+        ctx->buffered = got * size;
+        ctx->consumed = 0;
     }
 
+    // Hand back what was read before running off the end.
+    if (read < len && (read == 0 || errno != ENOSPC)) return -1;
     return read;
 }
 
@@ -360,13 +556,9 @@ void mtd_read_close(MtdReadContext *ctx)
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
-    MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
+    MtdWriteContext *ctx = (MtdWriteContext*) calloc(1, sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
-    ctx->bad_block_offsets = NULL;
-    ctx->bad_block_alloc = 0;
-    ctx->bad_block_count = 0;
-
     ctx->buffer = malloc(partition->erase_size);
     if (ctx->buffer == NULL) {
         free(ctx);
@@ -382,78 +574,332 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
         return NULL;
     }
 
+    if (load_bad_blocks(partition, ctx->fd)) {
+        close(ctx->fd);
+        free(ctx->buffer);
+        free(ctx);
+        return NULL;
+    }
+
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->verify = MTD_WRITE_VERIFY;
+    ctx->hash = HASH_SEED;
+    ctx->verify_fd = -1;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
     return ctx;
 }
 
-static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
-    if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
-        ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
-        ctx->bad_block_offsets = realloc(ctx->bad_block_offsets,
-                                         ctx->bad_block_alloc * sizeof(off_t));
+void mtd_write_set_verify(MtdWriteContext *ctx, int policy)
+{
+    ctx->verify = policy;
+}
+
+/* Running hash for MTD_VERIFY_HASH, the MurmurHash3 block mix over 32-bit
+ * words.  It only has to notice blocks that read back differently from how
+ * they were written, but a flipped bit must not be able to cancel out
+ * another one, as they can with a plain multiply.
+ */
+static uint32_t hash_block(uint32_t hash, const char *data, size_t size)
+{
+    size_t i;
+    for (i = 0; i + sizeof(uint32_t) <= size; i += sizeof(uint32_t)) {
+        uint32_t k;
+        memcpy(&k, data + i, sizeof(k));
+        k *= 0xcc9e2d51;
+        k = (k << 15) | (k >> 17);
+        k *= 0x1b873593;
+        hash ^= k;
+        hash = (hash << 13) | (hash >> 19);
+        hash = hash * 5 + 0xe6546b64;
     }
-    ctx->bad_block_offsets[ctx->bad_block_count++] = pos;
+    for (; i < size; ++i) hash = (hash ^ (unsigned char) data[i]) * 0x01000193;
+    return hash;
 }
 
-static int write_block(MtdWriteContext *ctx, const char *data)
+/* Erases count good blocks starting at pos with one MEMERASE.  If that
+ * fails, each block gets two tries of its own and the ones that still
+ * won't erase are added to the bad block table.
+ */
+static void erase_run(MtdWriteContext *ctx, loff_t pos, int count)
 {
-    const MtdPartition *partition = ctx->partition;
-    int fd = ctx->fd;
-
-    off_t pos = lseek(fd, 0, SEEK_CUR);
-    if (pos == (off_t) -1) return 1;
-
-    ssize_t size = partition->erase_size;
-    while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        if (ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
-            add_bad_block_offset(ctx, pos);
-            fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
-            pos += partition->erase_size;
-            continue;  // Don't try to erase known factory-bad blocks.
-        }
+    const size_t size = ctx->partition->erase_size;
+    struct erase_info_user erase_info;
+    erase_info.start = pos;
+    erase_info.length = count * size;
+    if (ioctl(ctx->fd, MEMERASE, &erase_info) == 0) return;
 
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
+    int i;
+    for (i = 0; i < count; ++i) {
+        erase_info.start = pos + (loff_t) i * size;
         erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
-                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
-                fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-            }
+            if (ioctl(ctx->fd, MEMERASE, &erase_info) == 0) break;
+            fprintf(stderr, "mtd: erase failure at 0x%08x (%s)\n",
+                    erase_info.start, strerror(errno));
+        }
+        if (retry == 2) mark_bad_block(ctx->partition, erase_info.start);
+    }
+}
 
-            char verify[size];
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
-                fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
-            if (memcmp(data, verify, size) != 0) {
-                fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
+/* Erases the good blocks from ctx->pos on, in runs, so writes don't wait
+ * on an erase for every block.  Only the blocks the caller already has
+ * data for are erased (ahead, up to MTD_WRITE_ERASE_AHEAD): anything past
+ * the end of the data must be left alone.
+ */
+static void erase_ahead(MtdWriteContext *ctx, int ahead)
+{
+    const MtdPartition *partition = ctx->partition;
+    const size_t size = partition->erase_size;
+    if (ahead > MTD_WRITE_ERASE_AHEAD) ahead = MTD_WRITE_ERASE_AHEAD;
+    if (ahead < 1) ahead = 1;
+
+    loff_t pos = ctx->pos;
+    while (ahead > 0 && pos + size <= partition->size) {
+        if (is_bad_block(partition, pos)) {
+            pos += size;
+            continue;
+        }
+        loff_t start = pos;
+        int run = 0;
+        while (run < ahead && pos + size <= partition->size &&
+               !is_bad_block(partition, pos)) {
+            ++run;
+            pos += size;
+        }
+        erase_run(ctx, start, run);
+        ahead -= run;
+    }
+    ctx->erased_to = pos;
+}
+
+/* Gives up on the block at pos after repeated failures: it goes into the
+ * bad block table and writing moves on to the next block.
+ */
+static void skip_block(MtdWriteContext *ctx, loff_t pos)
+{
+    struct erase_info_user erase_info;
+    erase_info.start = pos;
+    erase_info.length = ctx->partition->erase_size;
+
+    // Try to erase it once more as we give up on this block
+    mark_bad_block(ctx->partition, pos);
+    fprintf(stderr, "mtd: skipping write block at 0x%08llx\n", pos);
+    ioctl(ctx->fd, MEMERASE, &erase_info);
+    ctx->pos = pos + ctx->partition->erase_size;
+}
+
+/* Reads written blocks back through a second fd and compares them with
+ * what was written, while the caller goes on writing the blocks after
+ * them.  Slots marked check == 0 (skipped by MTD_VERIFY_SAMPLE) pass
+ * without being read.
+ */
+static void *verify_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) cookie;
+    const size_t size = ctx->partition->erase_size;
+    char *scratch = ctx->verify_buffer + MTD_WRITE_VERIFY_DEPTH * size;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (!ctx->stop && ctx->checked == ctx->count) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->checked == ctx->count) break;
+        VerifySlot *slot =
+                &ctx->slots[(ctx->first + ctx->checked) % MTD_WRITE_VERIFY_DEPTH];
+        pthread_mutex_unlock(&ctx->lock);
+
+        int state = VERIFY_OK;
+        if (slot->check) {
+            if (lseek64(ctx->verify_fd, slot->pos, SEEK_SET) != slot->pos ||
+                read(ctx->verify_fd, scratch, size) != (ssize_t) size) {
+                fprintf(stderr, "mtd: re-read error at 0x%08llx (%s)\n",
+                        slot->pos, strerror(errno));
+                state = VERIFY_FAILED;
+            } else if (memcmp(slot->data, scratch, size) != 0) {
+                fprintf(stderr, "mtd: verification error at 0x%08llx\n",
+                        slot->pos);
+                state = VERIFY_FAILED;
             }
+        }
 
-            if (retry > 0) {
-                fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
+        pthread_mutex_lock(&ctx->lock);
+        slot->state = state;
+        ++ctx->checked;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static int start_verifier(MtdWriteContext *ctx)
+{
+    const MtdPartition *partition = ctx->partition;
+    char mtddevname[32];
+    sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
+    ctx->verify_fd = open(mtddevname, O_RDONLY);
+    if (ctx->verify_fd < 0) return -1;
+
+    // One block per slot, plus one to read back into.
+    ctx->verify_buffer = malloc((MTD_WRITE_VERIFY_DEPTH + 1) * partition->erase_size);
+    if (ctx->verify_buffer == NULL) goto fail;
+    int i;
+    for (i = 0; i < MTD_WRITE_VERIFY_DEPTH; ++i) {
+        ctx->slots[i].data = ctx->verify_buffer + i * partition->erase_size;
+    }
+
+    int err = pthread_create(&ctx->verifier, NULL, verify_thread, ctx);
+    if (err != 0) {
+        errno = err;
+        goto fail;
+    }
+    ctx->verifier_running = 1;
+    return 0;
+
+fail:
+    fprintf(stderr, "mtd: can't start verifier (%s)\n", strerror(errno));
+    close(ctx->verify_fd);
+    ctx->verify_fd = -1;
+    free(ctx->verify_buffer);
+    ctx->verify_buffer = NULL;
+    return -1;
+}
+
+static int write_block(MtdWriteContext *ctx, const char *data, int ahead, int tries);
+
+/* Retires verified blocks from the front of the queue.  Waits for the
+ * verifier if all is set or the queue is full, so on success there is
+ * room for another block.  A block that failed verification is written
+ * again (at the same place, or at the next good block on its second
+ * failure) and so is everything queued after it, since those blocks are
+ * now in the wrong place.
+ */
+static int retire_verified(MtdWriteContext *ctx, int all)
+{
+    const size_t size = ctx->partition->erase_size;
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->count > 0) {
+        VerifySlot *slot = &ctx->slots[ctx->first];
+        if (ctx->checked == 0) {
+            if (!all && ctx->count < MTD_WRITE_VERIFY_DEPTH) break;
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+            continue;
+        }
+        if (slot->state == VERIFY_OK) {
+            ctx->first = (ctx->first + 1) % MTD_WRITE_VERIFY_DEPTH;
+            --ctx->count;
+            --ctx->checked;
+            continue;
+        }
+
+        while (ctx->checked < ctx->count) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        const int n = ctx->count;
+        char *rewrite = malloc(n * size);
+        if (rewrite == NULL) {
+            pthread_mutex_unlock(&ctx->lock);
+            return -1;
+        }
+        int i;
+        for (i = 0; i < n; ++i) {
+            memcpy(rewrite + i * size,
+                   ctx->slots[(ctx->first + i) % MTD_WRITE_VERIFY_DEPTH].data, size);
+        }
+        const loff_t pos = slot->pos;
+        int tries = slot->tries + 1;
+        ctx->count = ctx->checked = 0;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (tries < 2) {
+            ctx->pos = pos;
+        } else {
+            skip_block(ctx, pos);
+            tries = 0;
+        }
+        ctx->erased_to = ctx->pos;
+
+        int r = 0;
+        for (i = 0; i < n && r == 0; ++i) {
+            r = write_block(ctx, rewrite + i * size, n - i, i == 0 ? tries : 0);
+        }
+        free(rewrite);
+        if (r) return -1;
+        pthread_mutex_lock(&ctx->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+static int queue_verify(MtdWriteContext *ctx, loff_t pos, const char *data,
+        int tries, int check)
+{
+    if (!ctx->verifier_running && start_verifier(ctx)) return -1;
+
+    // The slot is free, so the verifier isn't looking at it.
+    VerifySlot *slot = &ctx->slots[(ctx->first + ctx->count) % MTD_WRITE_VERIFY_DEPTH];
+    memcpy(slot->data, data, ctx->partition->erase_size);
+    slot->pos = pos;
+    slot->tries = tries;
+    slot->check = check;
+
+    pthread_mutex_lock(&ctx->lock);
+    slot->state = VERIFY_PENDING;
+    ++ctx->count;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return 0;
+}
+
+/* Writes one erase block at the next good block.  ahead is how many
+ * blocks, this one included, the caller has data for; tries counts
+ * earlier failures of this data at ctx->pos.
+ */
+static int write_block(MtdWriteContext *ctx, const char *data, int ahead, int tries)
+{
+    const MtdPartition *partition = ctx->partition;
+    const size_t size = partition->erase_size;
+
+    if (retire_verified(ctx, 0)) return -1;
+
+    while (ctx->pos + size <= partition->size) {
+        loff_t pos = ctx->pos;
+        if (is_bad_block(partition, pos)) {
+            fprintf(stderr, "mtd: not writing bad block at 0x%08llx\n", pos);
+            ctx->pos += size;
+            tries = 0;
+            continue;  // Don't try to erase known factory-bad blocks.
+        }
+        if (pos >= ctx->erased_to) {
+            erase_ahead(ctx, ahead);
+            continue;
+        }
+
+        if (lseek64(ctx->fd, pos, SEEK_SET) != pos ||
+            write(ctx->fd, data, size) != (ssize_t) size) {
+            fprintf(stderr, "mtd: write error at 0x%08llx (%s)\n",
+                    pos, strerror(errno));
+            if (++tries < 2) {
+                ctx->erased_to = pos;  // erase it again and retry
+            } else {
+                skip_block(ctx, pos);
+                tries = 0;
             }
-            return 0;  // Success!
+            continue;
         }
 
-        // Try to erase it once more as we give up on this block
-        add_bad_block_offset(ctx, pos);
-        fprintf(stderr, "mtd: skipping write block at 0x%08lx\n", pos);
-        ioctl(fd, MEMERASE, &erase_info);
-        pos += partition->erase_size;
+        ctx->pos = pos + size;
+        int check = ctx->verify == MTD_VERIFY_ALWAYS ||
+                ctx->written % MTD_WRITE_VERIFY_SAMPLE == 0;
+        ++ctx->written;
+        if (ctx->verify == MTD_VERIFY_HASH) {
+            ctx->hash = hash_block(ctx->hash, data, size);
+            return 0;
+        }
+        return queue_verify(ctx, pos, data, tries, check);
     }
 
     // Ran out of space on the device
@@ -461,13 +907,49 @@ static int write_block(MtdWriteContext *ctx, const char *data)
     return -1;
 }
 
+/* For MTD_VERIFY_HASH: reads back everything written since the last
+ * check and compares its hash with the one taken while writing.
+ * ctx->buffer must be empty.
+ */
+static int check_hash(MtdWriteContext *ctx)
+{
+    const MtdPartition *partition = ctx->partition;
+    const size_t size = partition->erase_size;
+    if (ctx->verify != MTD_VERIFY_HASH || ctx->hash_start == ctx->pos) return 0;
+
+    uint32_t hash = HASH_SEED;
+    loff_t pos;
+    for (pos = ctx->hash_start; pos < ctx->pos; pos += size) {
+        if (is_bad_block(partition, pos)) continue;
+        if (lseek64(ctx->fd, pos, SEEK_SET) != pos ||
+            read(ctx->fd, ctx->buffer, size) != (ssize_t) size) {
+            fprintf(stderr, "mtd: re-read error at 0x%08llx (%s)\n",
+                    pos, strerror(errno));
+            return -1;
+        }
+        hash = hash_block(hash, ctx->buffer, size);
+    }
+
+    int r = 0;
+    if (hash != ctx->hash) {
+        fprintf(stderr, "mtd: verification error between 0x%08llx and 0x%08llx\n",
+                ctx->hash_start, ctx->pos);
+        errno = EIO;
+        r = -1;
+    }
+    ctx->hash_start = ctx->pos;
+    ctx->hash = HASH_SEED;
+    return r;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
+    const size_t size = ctx->partition->erase_size;
     size_t wrote = 0;
     while (wrote < len) {
         // Coalesce partial writes into complete blocks
-        if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->stored;
+        if (ctx->stored > 0 || len - wrote < size) {
+            size_t avail = size - ctx->stored;
             size_t copy = len - wrote < avail ? len - wrote : avail;
             memcpy(ctx->buffer + ctx->stored, data + wrote, copy);
             ctx->stored += copy;
@@ -475,59 +957,99 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
         }
 
         // If a complete block was accumulated, write it
-        if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx, ctx->buffer)) return -1;
+        if (ctx->stored == size) {
+            if (write_block(ctx, ctx->buffer, 1 + (len - wrote) / size, 0)) return -1;
             ctx->stored = 0;
         }
 
         // Write complete blocks directly from the user's buffer
-        while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx, data + wrote)) return -1;
-            wrote += ctx->partition->erase_size;
+        while (ctx->stored == 0 && len - wrote >= size) {
+            if (write_block(ctx, data + wrote, (len - wrote) / size, 0)) return -1;
+            wrote += size;
         }
     }
 
     return wrote;
 }
 
+int mtd_write_erased_blocks(MtdWriteContext *ctx, int blocks)
+{
+    const MtdPartition *partition = ctx->partition;
+    const size_t size = partition->erase_size;
+    if (ctx->stored > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (retire_verified(ctx, 1)) return -1;
+
+    if (ctx->verify == MTD_VERIFY_HASH) memset(ctx->buffer, 0xff, size);
+    while (blocks > 0) {
+        loff_t pos = ctx->pos;
+        if (pos + size > partition->size) {
+            errno = ENOSPC;
+            return -1;
+        }
+
+        // Bad blocks are skipped exactly as write_block() would.
+        if (is_bad_block(partition, pos)) {
+            fprintf(stderr, "mtd: not erasing bad block at 0x%08llx\n", pos);
+            ctx->pos += size;
+            continue;
+        }
+        if (pos >= ctx->erased_to) {
+            erase_ahead(ctx, blocks);
+            continue;  // blocks that wouldn't erase are bad now
+        }
+
+        if (ctx->verify == MTD_VERIFY_HASH) {
+            ctx->hash = hash_block(ctx->hash, ctx->buffer, size);
+        }
+        ctx->pos += size;
+        --blocks;
+    }
+    return 0;
+}
+
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
+    const size_t size = ctx->partition->erase_size;
+
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
-        size_t zero = ctx->partition->erase_size - ctx->stored;
-        memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx, ctx->buffer)) return -1;
+        memset(ctx->buffer + ctx->stored, 0, size - ctx->stored);
+        if (write_block(ctx, ctx->buffer, 1, 0)) return -1;
         ctx->stored = 0;
     }
+    if (retire_verified(ctx, 1) || check_hash(ctx)) return -1;
 
-    off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
-    if ((off_t) pos == (off_t) -1) return pos;
-
-    const int total = (ctx->partition->size - pos) / ctx->partition->erase_size;
+    loff_t pos = ctx->pos;
+    const int total = (ctx->partition->size - pos) / size;
     if (blocks < 0) blocks = total;
     if (blocks > total) {
         errno = ENOSPC;
         return -1;
     }
 
-    // Erase the specified number of blocks
-    while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
-            fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
-            pos += ctx->partition->erase_size;
+    // Erase the specified number of blocks, a run of good ones at a time
+    const loff_t end = pos + (loff_t) blocks * size;
+    while (pos < end) {
+        if (is_bad_block(ctx->partition, pos)) {
+            fprintf(stderr, "mtd: not erasing bad block at 0x%08llx\n", pos);
+            pos += size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
-
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        loff_t start = pos;
+        int run = 0;
+        while (pos < end && !is_bad_block(ctx->partition, pos)) {
+            ++run;
+            pos += size;
         }
-        pos += ctx->partition->erase_size;
+        erase_run(ctx, start, run);
     }
 
+    // Writing carries on from where it was, over blocks now known to be
+    // erased.
+    if (end > ctx->erased_to) ctx->erased_to = end;
     return pos;
 }
 
@@ -536,8 +1058,18 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+    if (ctx->verifier_running) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->stop = 1;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->verifier, NULL);
+        close(ctx->verify_fd);
+        free(ctx->verify_buffer);
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
     if (close(ctx->fd)) r = -1;
-    free(ctx->bad_block_offsets);
     free(ctx->buffer);
     free(ctx);
     return r;
@@ -547,13 +1079,9 @@ int mtd_write_close(MtdWriteContext *ctx)
  * might be pos itself).
  */
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos) {
-    int i;
-    for (i = 0; i < ctx->bad_block_count; ++i) {
-        if (ctx->bad_block_offsets[i] == pos) {
-            pos += ctx->partition->erase_size;
-        } else if (ctx->bad_block_offsets[i] > pos) {
-            return pos;
-        }
+    while (pos + (off_t) ctx->partition->erase_size <= (off_t) ctx->partition->size &&
+           is_bad_block(ctx->partition, pos)) {
+        pos += ctx->partition->erase_size;
     }
     return pos;
 }
@@ -37,18 +37,53 @@ int mtd_partition_info(const MtdPartition *partition,
         size_t *total_size, size_t *erase_size, size_t *write_size);
 
 /* read or write raw data from a partition, starting at the beginning.
- * skips bad blocks as best we can.
+ * skips bad blocks as best we can.  mtd_read_data returns short only at
+ * the end of the partition, and -1 with errno ENOSPC once nothing is left.
  */
 typedef struct MtdReadContext MtdReadContext;
 typedef struct MtdWriteContext MtdWriteContext;
 
+/* most erase blocks read with one read() call.  readers asking for whole
+ * blocks get up to this many at once; smaller reads are buffered.
+ */
+#ifndef MTD_READ_BATCH_BLOCKS
+#define MTD_READ_BATCH_BLOCKS 16
+#endif
+
 MtdReadContext *mtd_read_partition(const MtdPartition *);
 ssize_t mtd_read_data(MtdReadContext *, char *data, size_t data_len);
 void mtd_read_close(MtdReadContext *);
 
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
+
+/* how written blocks are checked.  ALWAYS reads every block back and
+ * SAMPLE one in MTD_WRITE_VERIFY_SAMPLE, a few blocks behind the writes;
+ * a block that fails is written again further on.  HASH reads nothing
+ * back until mtd_erase_blocks or mtd_write_close, which then compare a
+ * hash of the data written so far and fail if it doesn't match.  set it
+ * before writing anything.
+ */
+enum { MTD_VERIFY_ALWAYS, MTD_VERIFY_SAMPLE, MTD_VERIFY_HASH };
+void mtd_write_set_verify(MtdWriteContext *, int policy);
+
+#ifndef MTD_WRITE_VERIFY
+#define MTD_WRITE_VERIFY MTD_VERIFY_ALWAYS
+#endif
+#ifndef MTD_WRITE_VERIFY_SAMPLE
+#define MTD_WRITE_VERIFY_SAMPLE 8
+#endif
+/* blocks written but not yet verified, and most blocks erased in advance. */
+#ifndef MTD_WRITE_VERIFY_DEPTH
+#define MTD_WRITE_VERIFY_DEPTH 4
+#endif
+#ifndef MTD_WRITE_ERASE_AHEAD
+#define MTD_WRITE_ERASE_AHEAD 8
+#endif
+
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
+/* write blocks of 0xff by just erasing them.  must be on a block boundary. */
+int mtd_write_erased_blocks(MtdWriteContext *, int blocks);
 off_t mtd_find_write_start(MtdWriteContext *ctx, off_t pos);
 int mtd_write_close(MtdWriteContext *);
 
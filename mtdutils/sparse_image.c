@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparse_image.h"
+
+#define CHUNK_HEADER_SIZE 16
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    put_le32(p, (uint32_t) v);
+    put_le32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return get_le32(p) | ((uint64_t) get_le32(p + 4) << 32);
+}
+
+int sparse_is_image(const char *header, size_t len)
+{
+    return len >= SPARSE_HEADER_SIZE &&
+           memcmp(header, SPARSE_MAGIC, SPARSE_MAGIC_LEN) == 0 &&
+           get_le32((const unsigned char *) header + 8) == SPARSE_VERSION;
+}
+
+/* Returns SPARSE_CHUNK_ZERO or SPARSE_CHUNK_ERASED if every byte of the
+ * block has that value, SPARSE_CHUNK_RAW otherwise.
+ */
+static int classify_block(const char *data, size_t len)
+{
+    if ((unsigned long) data % sizeof(unsigned long) != 0) {
+        size_t i;
+        for (i = 1; i < len; ++i) {
+            if (data[i] != data[0]) return SPARSE_CHUNK_RAW;
+        }
+        if (data[0] == 0) return SPARSE_CHUNK_ZERO;
+        return data[0] == (char) 0xff ? SPARSE_CHUNK_ERASED : SPARSE_CHUNK_RAW;
+    }
+
+    const unsigned long *word = (const unsigned long *) data;
+    const unsigned long *end = word + len / sizeof(unsigned long);
+    unsigned long first = *word;
+    if (first != 0 && first != ~0UL) return SPARSE_CHUNK_RAW;
+    while (++word < end) {
+        if (*word != first) return SPARSE_CHUNK_RAW;
+    }
+    return first == 0 ? SPARSE_CHUNK_ZERO : SPARSE_CHUNK_ERASED;
+}
+
+struct SparseWriter {
+    sparse_write_fn write_fn;
+    void *cookie;
+    int run_type;           // pending ZERO/ERASED run, or RAW for none
+    uint64_t run_length;
+    uint64_t total;
+    int error;
+};
+
+static int emit(SparseWriter *w, const char *data, size_t len)
+{
+    if (w->error) return -1;
+    if (w->write_fn(w->cookie, data, len) != (ssize_t) len) {
+        w->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int emit_chunk_header(SparseWriter *w, int type, uint64_t length)
+{
+    unsigned char header[CHUNK_HEADER_SIZE];
+    put_le32(header, type);
+    put_le32(header + 4, 0);
+    put_le64(header + 8, length);
+    return emit(w, (const char *) header, sizeof(header));
+}
+
+static int flush_run(SparseWriter *w)
+{
+    int r = 0;
+    if (w->run_type != SPARSE_CHUNK_RAW && w->run_length > 0) {
+        r = emit_chunk_header(w, w->run_type, w->run_length);
+    }
+    w->run_type = SPARSE_CHUNK_RAW;
+    w->run_length = 0;
+    return r;
+}
+
+static int emit_raw(SparseWriter *w, const char *data, size_t len)
+{
+    if (len == 0) return 0;
+    if (emit_chunk_header(w, SPARSE_CHUNK_RAW, len)) return -1;
+    return emit(w, data, len);
+}
+
+SparseWriter *sparse_writer_open(sparse_write_fn write_fn, void *cookie)
+{
+    SparseWriter *w = calloc(1, sizeof(SparseWriter));
+    if (w == NULL) return NULL;
+    w->write_fn = write_fn;
+    w->cookie = cookie;
+    w->run_type = SPARSE_CHUNK_RAW;
+
+    unsigned char header[SPARSE_HEADER_SIZE];
+    memcpy(header, SPARSE_MAGIC, SPARSE_MAGIC_LEN);
+    put_le32(header + 8, SPARSE_VERSION);
+    put_le32(header + 12, SPARSE_BLOCK_SIZE);
+    if (emit(w, (const char *) header, sizeof(header))) {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+ssize_t sparse_writer_write(SparseWriter *w, const char *data, size_t len)
+{
+    size_t raw_start = 0;
+    size_t pos = 0;
+
+    while (pos + SPARSE_BLOCK_SIZE <= len) {
+        int type = classify_block(data + pos, SPARSE_BLOCK_SIZE);
+        if (type == SPARSE_CHUNK_RAW) {
+            if (w->run_type != SPARSE_CHUNK_RAW) {
+                if (flush_run(w)) return -1;
+                raw_start = pos;
+            }
+        } else {
+            if (w->run_type == SPARSE_CHUNK_RAW) {
+                if (emit_raw(w, data + raw_start, pos - raw_start)) return -1;
+            } else if (w->run_type != type) {
+                if (flush_run(w)) return -1;
+            }
+            w->run_type = type;
+            w->run_length += SPARSE_BLOCK_SIZE;
+        }
+        pos += SPARSE_BLOCK_SIZE;
+    }
+
+    // A partial block at the end is always stored as data.
+    if (w->run_type == SPARSE_CHUNK_RAW) {
+        if (emit_raw(w, data + raw_start, len - raw_start)) return -1;
+    } else if (pos < len) {
+        if (flush_run(w) || emit_raw(w, data + pos, len - pos)) return -1;
+    }
+
+    w->total += len;
+    return len;
+}
+
+int sparse_writer_close(SparseWriter *w)
+{
+    flush_run(w);
+    emit_chunk_header(w, SPARSE_CHUNK_END, w->total);
+    int r = w->error ? -1 : 0;
+    free(w);
+    return r;
+}
+
+struct SparseReader {
+    sparse_read_fn read_fn;
+    void *cookie;
+    int chunk_type;
+    uint64_t remaining;     // bytes left in the current chunk
+    int done;
+};
+
+static int read_exactly(SparseReader *r, void *data, size_t len)
+{
+    if (r->read_fn(r->cookie, data, len) != (ssize_t) len) {
+        if (errno == 0) errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+SparseReader *sparse_reader_open(sparse_read_fn read_fn, void *cookie)
+{
+    SparseReader *r = calloc(1, sizeof(SparseReader));
+    if (r == NULL) return NULL;
+    r->read_fn = read_fn;
+    r->cookie = cookie;
+
+    char header[SPARSE_HEADER_SIZE];
+    if (read_exactly(r, header, sizeof(header)) ||
+        !sparse_is_image(header, sizeof(header))) {
+        fprintf(stderr, "sparse: bad image header\n");
+        free(r);
+        errno = EINVAL;
+        return NULL;
+    }
+    return r;
+}
+
+ssize_t sparse_reader_next(SparseReader *r, char *data, size_t len, int *fill)
+{
+    while (r->remaining == 0) {
+        if (r->done) return 0;
+
+        unsigned char header[CHUNK_HEADER_SIZE];
+        errno = 0;
+        if (read_exactly(r, header, sizeof(header))) {
+            fprintf(stderr, "sparse: truncated image\n");
+            return -1;
+        }
+        r->chunk_type = get_le32(header);
+        r->remaining = get_le64(header + 8);
+        switch (r->chunk_type) {
+        case SPARSE_CHUNK_RAW:
+        case SPARSE_CHUNK_ZERO:
+        case SPARSE_CHUNK_ERASED:
+            break;
+        case SPARSE_CHUNK_END:
+            r->remaining = 0;
+            r->done = 1;
+            break;
+        default:
+            fprintf(stderr, "sparse: unknown chunk type %d\n", r->chunk_type);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if (len > r->remaining) len = r->remaining;
+    if (r->chunk_type == SPARSE_CHUNK_RAW) {
+        errno = 0;
+        if (read_exactly(r, data, len)) {
+            fprintf(stderr, "sparse: truncated image\n");
+            return -1;
+        }
+        *fill = -1;
+    } else {
+        *fill = r->chunk_type == SPARSE_CHUNK_ZERO ? 0x00 : 0xff;
+    }
+    r->remaining -= len;
+    return len;
+}
+
+ssize_t sparse_reader_read(SparseReader *r, char *data, size_t len)
+{
+    size_t got = 0;
+    while (got < len) {
+        int fill;
+        ssize_t n = sparse_reader_next(r, data + got, len - got, &fill);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        if (fill >= 0) memset(data + got, fill, n);
+        got += n;
+    }
+    return got;
+}
+
+void sparse_reader_close(SparseReader *r)
+{
+    free(r);
+}
+
+uint64_t sparse_image_size(int fd)
+{
+    unsigned char header[CHUNK_HEADER_SIZE];
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    uint64_t size = 0;
+    if (pos >= 0 && lseek(fd, -CHUNK_HEADER_SIZE, SEEK_END) >= 0 &&
+        read(fd, header, sizeof(header)) == sizeof(header) &&
+        get_le32(header) == SPARSE_CHUNK_END) {
+        size = get_le64(header + 8);
+    }
+    if (pos >= 0) lseek(fd, pos, SEEK_SET);
+    return size;
+}
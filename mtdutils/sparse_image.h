@@ -0,0 +1,72 @@
+#ifndef MTDUTILS_SPARSE_IMAGE_H_
+#define MTDUTILS_SPARSE_IMAGE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Sparse partition images.
+ *
+ * A sparse image is a 16 byte header followed by chunks, each with a
+ * 16 byte header of { uint32 type, uint32 reserved, uint64 length }.
+ * RAW chunks are followed by length bytes of data; ZERO and ERASED
+ * chunks stand for length bytes of 0x00 and 0xff respectively.  The
+ * image ends with an END chunk whose length is the size of the whole
+ * expanded image.  All integers are little-endian.
+ *
+ * Runs are detected in SPARSE_BLOCK_SIZE units, so a partition that is
+ * mostly empty (or freshly erased flash) shrinks to little more than
+ * its used blocks, and restoring it needs to write only those.
+ */
+
+#define SPARSE_MAGIC        "NANDSPRS"
+#define SPARSE_MAGIC_LEN    8
+#define SPARSE_VERSION      1
+#define SPARSE_HEADER_SIZE  16
+#define SPARSE_BLOCK_SIZE   4096
+
+enum {
+    SPARSE_CHUNK_RAW = 0,
+    SPARSE_CHUNK_ZERO = 1,
+    SPARSE_CHUNK_ERASED = 2,
+    SPARSE_CHUNK_END = 3,
+};
+
+/* Returns nonzero if header (at least SPARSE_HEADER_SIZE bytes) starts
+ * a sparse image.
+ */
+int sparse_is_image(const char *header, size_t len);
+
+typedef ssize_t (*sparse_write_fn)(void *cookie, const char *data, size_t len);
+typedef ssize_t (*sparse_read_fn)(void *cookie, char *data, size_t len);
+
+typedef struct SparseWriter SparseWriter;
+typedef struct SparseReader SparseReader;
+
+/* Encode a stream of raw partition data.  write_fn must write all the
+ * bytes it is given or fail.  sparse_writer_close() emits any pending
+ * run and the END chunk, then frees the writer; it returns nonzero if
+ * any write failed.
+ */
+SparseWriter *sparse_writer_open(sparse_write_fn write_fn, void *cookie);
+ssize_t sparse_writer_write(SparseWriter *writer, const char *data, size_t len);
+int sparse_writer_close(SparseWriter *writer);
+
+/* Decode a sparse image.  read_fn must only return short at the end of
+ * the file.  The header is consumed by sparse_reader_open().
+ *
+ * sparse_reader_next() stores up to len bytes of image data in data and
+ * sets *fill to -1, or reports a run of up to len bytes of the value
+ * *fill without touching data.  It returns 0 at the end of the image
+ * and -1 on error.  sparse_reader_read() always expands into data.
+ */
+SparseReader *sparse_reader_open(sparse_read_fn read_fn, void *cookie);
+ssize_t sparse_reader_next(SparseReader *reader, char *data, size_t len, int *fill);
+ssize_t sparse_reader_read(SparseReader *reader, char *data, size_t len);
+void sparse_reader_close(SparseReader *reader);
+
+/* Size of the expanded image, taken from the END chunk of an image file.
+ * Returns 0 if it can't be determined.
+ */
+uint64_t sparse_image_size(int fd);
+
+#endif  // MTDUTILS_SPARSE_IMAGE_H_
@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <libgen.h>
 #include <limits.h>
 #include <linux/input.h>
 #include <stdio.h>
@@ -39,6 +40,8 @@
 
 #include "extendedcommands.h"
 #include "nandroid.h"
+#include "blockcopy.h"
+#include "tarmanifest.h"
 
 #ifndef BOARD_USES_BMLUTILS
 int write_raw_image(const char* partition, const char* filename) {
@@ -57,9 +60,68 @@ int print_and_error(char* message) {
     return 1;
 }
 
+// Each of SYSTEM:, DATA: and CACHE: gets an equal share of the progress bar
+#define NANDROID_PARTITION_PROGRESS (1.0 / 3)
+
+// Left out of tar backups
+#define TARBACKUP_EXCLUDE "*RFS_LOG.LO*"
+
+// Longest chain of incremental backups restore will follow
+#define TARBACKUP_MAX_CHAIN 64
+
 /* TAR backup functions
  */
-int tarbackup_backup_partition_extended(const char* backup_path, char* root, int umount_when_finished) {
+
+// The backup an increment of <name> in backup_path applies to, from
+// <name>.parent.  Returns 0 if there is one.
+static int tarbackup_read_parent(const char* backup_path, const char* name, char* parent)
+{
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/%s.parent", backup_path, name);
+    FILE* f = fopen(tmp, "r");
+    if (f == NULL)
+        return -1;
+    int ret = fgets(parent, PATH_MAX, f) != NULL ? 0 : -1;
+    fclose(f);
+    if (ret == 0)
+        parent[strcspn(parent, "\n")] = '\0';
+    return ret;
+}
+
+// Finds the latest backup before backup_path (in the same directory) that
+// has a manifest for <name>.  Backup directories are named by timestamp,
+// so the latest is the greatest name.
+static int tarbackup_find_parent(const char* backup_path, const char* name, char* parent)
+{
+    char tmp[PATH_MAX];
+    char dir[PATH_MAX];
+    char self[PATH_MAX];
+    strcpy(tmp, backup_path);
+    strcpy(self, basename(tmp));
+    strcpy(tmp, backup_path);
+    strcpy(dir, dirname(tmp));
+
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return -1;
+    char best[PATH_MAX] = "";
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' || strcmp(de->d_name, self) >= 0 || strcmp(de->d_name, best) <= 0)
+            continue;
+        struct stat st;
+        sprintf(tmp, "%s/%s/%s.manifest", dir, de->d_name, name);
+        if (0 == stat(tmp, &st))
+            strcpy(best, de->d_name);
+    }
+    closedir(d);
+    if (best[0] == '\0')
+        return -1;
+    sprintf(parent, "%s/%s", dir, best);
+    return 0;
+}
+
+int tarbackup_backup_partition_extended(const char* backup_path, char* root, int umount_when_finished, int incremental) {
 	char mount_point[PATH_MAX];
 	translate_root_path(root, mount_point, PATH_MAX);
 	char* name = basename(mount_point);
@@ -71,8 +133,31 @@ int tarbackup_backup_partition_extended(const char* backup_path, char* root, int
     }
 
     char tmp[PATH_MAX];
-    sprintf(tmp, "tar -c --exclude=*RFS_LOG.LO* -f %s/%s.tar %s", backup_path, name, get_mount_point_for_root(root)+1);
-    int ret = __system(tmp);
+    char parent_path[PATH_MAX];
+    TarManifest* parent = NULL;
+    if (incremental && 0 == tarbackup_find_parent(backup_path, name, parent_path)) {
+        sprintf(tmp, "%s/%s.manifest", parent_path, name);
+        parent = tar_manifest_load(tmp);
+    }
+    if (parent != NULL) {
+        ui_print("Only changes since %s\n", basename(parent_path));
+        sprintf(tmp, "%s/%s.parent", backup_path, name);
+        FILE* f = fopen(tmp, "w");
+        if (f == NULL || fprintf(f, "%s\n", parent_path) < 0 || fclose(f) != 0) {
+            ui_print("Can't write %s!\n", tmp);
+            tar_manifest_free(parent);
+            return -1;
+        }
+    }
+
+    char archive[PATH_MAX];
+    char deleted[PATH_MAX];
+    sprintf(archive, "%s/%s.tar", backup_path, name);
+    sprintf(tmp, "%s/%s.manifest", backup_path, name);
+    sprintf(deleted, "%s/%s.deleted", backup_path, name);
+    ui_show_progress(NANDROID_PARTITION_PROGRESS, 0);
+    int ret = tar_manifest_backup(get_mount_point_for_root(root), TARBACKUP_EXCLUDE, archive, tmp, parent, deleted);
+    tar_manifest_free(parent);
 
     if (umount_when_finished) {
         ensure_root_path_unmounted(root);
@@ -84,7 +169,7 @@ int tarbackup_backup_partition_extended(const char* backup_path, char* root, int
     return 0;
 }
 
-int tarbackup_backup(const char* backup_path, int backup_system, int backup_data, int backup_cache, int backup_android_secure)
+int tarbackup_backup(const char* backup_path, int backup_system, int backup_data, int backup_cache, int backup_android_secure, int incremental)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
 
@@ -107,10 +192,10 @@ int tarbackup_backup(const char* backup_path, int backup_system, int backup_data
     sprintf(tmp, "mkdir -p %s", backup_path);
     __system(tmp);
 
-    if (backup_system && 0 != (ret = tarbackup_backup_partition_extended(backup_path, "SYSTEM:", 1)))
+    if (backup_system && 0 != (ret = tarbackup_backup_partition_extended(backup_path, "SYSTEM:", 1, incremental)))
         return ret;
 
-    if (backup_data && 0 != (ret = tarbackup_backup_partition_extended(backup_path, "DATA:", 1)))
+    if (backup_data && 0 != (ret = tarbackup_backup_partition_extended(backup_path, "DATA:", 1, incremental)))
         return ret;
 
 /*
@@ -126,7 +211,7 @@ int tarbackup_backup(const char* backup_path, int backup_system, int backup_data
     }
 */
 
-    if (backup_cache && 0 != (ret = tarbackup_backup_partition_extended(backup_path, "CACHE:", 0)))
+    if (backup_cache && 0 != (ret = tarbackup_backup_partition_extended(backup_path, "CACHE:", 0, incremental)))
         return ret;
 /*
     ui_print("Generating md5 sum...\n");
@@ -157,29 +242,68 @@ int tarbackup_restore_partition_extended(const char* backup_path, const char* ro
         return 0;
     }
 
+    // An incremental backup is restored by replaying the full backup it
+    // started from and then every increment after it.
+    char (*chain)[PATH_MAX] = malloc(TARBACKUP_MAX_CHAIN * PATH_MAX);
+    if (chain == NULL)
+        return print_and_error("Out of memory!\n");
+    int depth = 0;
+    strcpy(chain[depth++], backup_path);
+    while (0 == tarbackup_read_parent(chain[depth - 1], name, chain[depth])) {
+        sprintf(tmp, "%s/%s.tar", chain[depth], name);
+        if (0 != statfs(tmp, &file_info)) {
+            ui_print("%s needs %s, which is missing!\n", backup_path, tmp);
+            free(chain);
+            return -1;
+        }
+        if (++depth == TARBACKUP_MAX_CHAIN) {
+            ui_print("Too many incremental backups of %s!\n", name);
+            free(chain);
+            return -1;
+        }
+    }
+
     ensure_directory(mount_point);
 
     ui_print("Restoring %s...\n", name);
     if (0 != (ret = ensure_root_path_unmounted(root))) {
         ui_print("Can't unmount %s!\n", mount_point);
+        free(chain);
         return ret;
     }
 
     if (0 != (ret = format_root_device(root))) {
         ui_print("Error while formatting %s!\n", root);
+        free(chain);
         return ret;
     }
 
     if (0 != (ret = ensure_root_path_mounted(root))) {
         ui_print("Can't mount %s!\n", mount_point);
+        free(chain);
         return ret;
     }
 
-    sprintf(tmp, "tar -x -f %s/%s.tar", backup_path, name);
-    if (0 != __system(tmp)) {
-        ui_print("Error while restoring %s!\n", mount_point);
-        return ret;
+    int base = depth - 1;
+    while (depth-- > 0) {
+        if (depth < base) {
+            ui_print("Applying %s...\n", basename(chain[depth]));
+            sprintf(tmp, "%s/%s.deleted", chain[depth], name);
+            if (0 != tar_manifest_apply_deleted(tmp, "/")) {
+                ui_print("Error while restoring %s!\n", mount_point);
+                free(chain);
+                return -1;
+            }
+        }
+        sprintf(tmp, "%s/%s.tar", chain[depth], name);
+        ui_show_progress(NANDROID_PARTITION_PROGRESS / (depth + 1), 0);
+        if (0 != (ret = blockcopy_tar_extract(tmp, "/", NULL, NULL))) {
+            ui_print("Error while restoring %s!\n", mount_point);
+            free(chain);
+            return ret;
+        }
     }
+    free(chain);
 
     if (umount_when_finished) {
         ensure_root_path_unmounted(root);
@@ -227,6 +351,112 @@ int tarbackup_restore(const char* backup_path, int restore_system, int restore_d
 
 /* Image backup functions
  */
+
+// Images are written as plain <name>.img dumps, which older recoveries
+// and flash_image can read, unless the user opts in to <name>.img.gz
+// (compression), a <name>.idx index into the chunk store shared by all
+// backups (deduplication) or sparse <name>.simg.  Restore accepts all.
+static const char* nandroid_image_suffix()
+{
+    if (nandroid_dedup_enabled)
+        return ".idx";
+    if (nandroid_compression_enabled)
+        return ".img.gz";
+    return nandroid_sparse_enabled ? ".simg" : ".img";
+}
+
+static const char* nandroid_restore_suffixes[] = { ".simg", ".img", ".img.gz", ".idx", NULL };
+
+// Partitions dumped at once; 0 picks the blockcopy default.
+#ifndef NANDROID_JOBS
+#define NANDROID_JOBS 0
+#endif
+
+/* nandroid.md5 holds one "<md5>  <image>" line per image, as md5sum
+ * prints them.  The digests are taken while the images are written, so
+ * backing up needs no separate pass; restore checks every image once,
+ * before anything is formatted.
+ */
+static int nandroid_write_md5(const char* backup_path, char files[][PATH_MAX],
+        const BlockCopyJob* jobs, int count)
+{
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+    int i;
+    for (i = 0; i < count; i++) {
+        char hex[MD5_DIGEST_SIZE * 2 + 1];
+        MD5_hex(jobs[i].md5, hex);
+        fprintf(f, "%s  %s\n", hex, files[i]);
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int nandroid_read_md5(const char* backup_path, const char* image, uint8_t* md5)
+{
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/nandroid.md5", backup_path);
+    FILE* f = fopen(tmp, "r");
+    if (f == NULL)
+        return -1;
+
+    int ret = -1;
+    char line[PATH_MAX + 64];
+    while (ret != 0 && fgets(line, sizeof(line), f) != NULL) {
+        char hex[MD5_DIGEST_SIZE * 2 + 1];
+        char file[PATH_MAX];
+        if (sscanf(line, "%32s %s", hex, file) != 2)
+            continue;
+        // md5sum -b marks binary files with a '*'
+        const char* name = file[0] == '*' ? file + 1 : file;
+        if (strcmp(name, image) != 0)
+            continue;
+        int i;
+        unsigned int byte;
+        for (i = 0; i < MD5_DIGEST_SIZE && sscanf(hex + 2 * i, "%2x", &byte) == 1; i++)
+            md5[i] = byte;
+        if (i == MD5_DIGEST_SIZE)
+            ret = 0;
+    }
+    fclose(f);
+    return ret;
+}
+
+// Replaces (or adds) the line for image in nandroid.md5.
+static int nandroid_update_md5(const char* backup_path, const char* image, const uint8_t* md5)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    sprintf(path, "%s/nandroid.md5", backup_path);
+    sprintf(tmp, "%s/nandroid.md5.tmp", backup_path);
+    FILE* out = fopen(tmp, "w");
+    if (out == NULL)
+        return -1;
+    FILE* in = fopen(path, "r");
+    if (in != NULL) {
+        char line[PATH_MAX + 64];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            char hex[MD5_DIGEST_SIZE * 2 + 1];
+            char file[PATH_MAX];
+            if (sscanf(line, "%32s %s", hex, file) == 2 &&
+                    strcmp(file[0] == '*' ? file + 1 : file, image) == 0)
+                continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    char hex[MD5_DIGEST_SIZE * 2 + 1];
+    MD5_hex(md5, hex);
+    fprintf(out, "%s  %s\n", hex, image);
+    if (fclose(out) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
 int nandroid_backup_partition_extended(const char* backup_path, char* root, int umount_when_finished) {
 	char mount_point[PATH_MAX];
 	translate_root_path(root, mount_point, PATH_MAX);
@@ -235,8 +465,12 @@ int nandroid_backup_partition_extended(const char* backup_path, char* root, int
     ensure_root_path_unmounted(root);
 
     char tmp[PATH_MAX];
-    sprintf(tmp, "dd if=%s of=%s/%s.img bs=4096", get_dev_for_root(root), backup_path, name);
-    int ret = __system(tmp);
+    char image[PATH_MAX];
+    uint8_t md5[MD5_DIGEST_SIZE];
+    sprintf(image, "%s%s", name, nandroid_image_suffix());
+    sprintf(tmp, "%s/%s", backup_path, image);
+    ui_show_progress(NANDROID_PARTITION_PROGRESS, 0);
+    int ret = blockcopy_root_to_file(root, tmp, md5);
 
     if (!umount_when_finished) {
         ensure_root_path_mounted(root);
@@ -245,6 +479,10 @@ int nandroid_backup_partition_extended(const char* backup_path, char* root, int
         ui_print("Error while making image of %s!\n", mount_point);
         return ret;
     }
+    if (0 != (ret = nandroid_update_md5(backup_path, image, md5))) {
+        ui_print("Error while writing md5 sum!\n");
+        return ret;
+    }
     return 0;
 }
 
@@ -252,12 +490,63 @@ int nandroid_backup_partition(const char* backup_path, char* root) {
     return nandroid_backup_partition_extended(backup_path, root, 1);
 }
 
+#define NANDROID_IMAGE_COUNT 3
+
+/* Dump SYSTEM:, DATA: and CACHE: to their images, several at a time,
+ * and record their digests in nandroid.md5.  CACHE: is mounted again
+ * afterwards, like the one-by-one backup did.
+ */
+static int nandroid_backup_partitions(const char* backup_path)
+{
+    static const char* roots[NANDROID_IMAGE_COUNT] = { "SYSTEM:", "DATA:", "CACHE:" };
+    char names[NANDROID_IMAGE_COUNT][PATH_MAX];
+    char files[NANDROID_IMAGE_COUNT][PATH_MAX];
+    char paths[NANDROID_IMAGE_COUNT][PATH_MAX];
+    BlockCopyJob jobs[NANDROID_IMAGE_COUNT];
+    int i;
+
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < NANDROID_IMAGE_COUNT; i++) {
+        char mount_point[PATH_MAX];
+        translate_root_path(roots[i], mount_point, PATH_MAX);
+        strcpy(names[i], basename(mount_point));
+        sprintf(files[i], "%s%s", names[i], nandroid_image_suffix());
+        sprintf(paths[i], "%s/%s", backup_path, files[i]);
+        jobs[i].root = roots[i];
+        jobs[i].path = paths[i];
+        jobs[i].name = names[i];
+        ensure_root_path_unmounted(roots[i]);
+    }
+
+    ui_print("Backing up %s, %s and %s...\n", names[0], names[1], names[2]);
+    ui_show_progress(1.0, 0);
+    int ret = blockcopy_backup_roots(jobs, NANDROID_IMAGE_COUNT, NANDROID_JOBS, 0);
+
+    ensure_root_path_mounted("CACHE:");
+    for (i = 0; i < NANDROID_IMAGE_COUNT; i++) {
+        if (jobs[i].status != 0) {
+            ui_print("Error while making image of %s!\n", names[i]);
+        }
+    }
+    if (ret == 0 && 0 != (ret = nandroid_write_md5(backup_path, files, jobs, NANDROID_IMAGE_COUNT)))
+        ui_print("Error while writing md5 sums!\n");
+    return ret;
+}
+
 int nandroid_backup(const char* backup_path)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     
     if (ensure_root_path_mounted("SDCARD:") != 0)
         return print_and_error("Can't mount /sdcard\n");
+
+    // Make room first: chunks only deleted snapshots used can go.
+    if (nandroid_dedup_enabled) {
+        char dir[PATH_MAX];
+        strcpy(dir, backup_path);
+        blockcopy_dedup_gc(dirname(dir));
+        blockcopy_dedup_set_verify(nandroid_dedup_verify_enabled);
+    }
     
     int ret=0;
     struct statfs s;
@@ -275,10 +564,7 @@ int nandroid_backup(const char* backup_path)
     sprintf(tmp, "mkdir -p %s", backup_path);
     __system(tmp);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "SYSTEM:")))
-        return ret;
-
-    if (0 != (ret = nandroid_backup_partition(backup_path, "DATA:")))
+    if (0 != (ret = nandroid_backup_partitions(backup_path)))
         return ret;
 
 /*
@@ -294,16 +580,6 @@ int nandroid_backup(const char* backup_path)
     }
 */
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "CACHE:", 0)))
-        return ret;
-
-    ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
-        ui_print("Error while generating md5 sum!\n");
-        return ret;
-    }
-    
     sync();
     ui_set_background(BACKGROUND_ICON_NONE);
     ui_reset_progress();
@@ -319,16 +595,65 @@ void ensure_directory(const char* dir) {
     __system(tmp);
 }
 
-int nandroid_restore_partition_extended(const char* backup_path, const char* root, int umount_when_finished) {
+/* Finds the image of root in backup_path, storing its path in tmp and its
+ * name (as listed in nandroid.md5) in image.  Returns -1 if there is none.
+ */
+static int nandroid_find_image(const char* backup_path, const char* name, char* tmp, char* image) {
+    struct statfs file_info;
+    const char** suffix;
+    for (suffix = nandroid_restore_suffixes; *suffix != NULL; suffix++) {
+        sprintf(tmp, "%s/%s%s", backup_path, name, *suffix);
+        if (0 == statfs(tmp, &file_info)) {
+            sprintf(image, "%s%s", name, *suffix);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Cleared by nandroid_main(), which runs without a UI to ask on.
+static int nandroid_interactive = 1;
+
+/* Checks the image of root against nandroid.md5 before anything is
+ * formatted.  An image with no digest there is only restored if the
+ * user says so.
+ */
+static int nandroid_verify_partition(const char* backup_path, const char* root) {
+    char mount_point[PATH_MAX];
+    translate_root_path(root, mount_point, PATH_MAX);
+    char* name = basename(mount_point);
+
+    char tmp[PATH_MAX];
+    char image[PATH_MAX];
+    if (0 != nandroid_find_image(backup_path, name, tmp, image))
+        return 0;
+
+    uint8_t md5[MD5_DIGEST_SIZE];
+    if (0 != nandroid_read_md5(backup_path, image, md5)) {
+        ui_print("No MD5 sum for %s!\n", image);
+        if (nandroid_interactive &&
+                confirm_selection("Restore without MD5 check?", "Yes - Restore anyway"))
+            return 0;
+        return -1;
+    }
+    ui_print("Checking MD5 sum of %s...\n", image);
+    if (0 != blockcopy_check_image(tmp, md5)) {
+        ui_print("MD5 mismatch!\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Restores an image nandroid_verify_partition() has already checked.
+static int nandroid_restore_verified_partition(const char* backup_path, const char* root, int umount_when_finished) {
     int ret;
     char mount_point[PATH_MAX];
     translate_root_path(root, mount_point, PATH_MAX);
     char* name = basename(mount_point);
     
     char tmp[PATH_MAX];
-    sprintf(tmp, "%s/%s.img", backup_path, name);
-    struct stat file_info;
-    if (0 != (ret = statfs(tmp, &file_info))) {
+    char image[PATH_MAX];
+    if (0 != nandroid_find_image(backup_path, name, tmp, image)) {
         ui_print("%s.img not found. Skipping restore of %s.\n", name, mount_point);
         return 0;
     }
@@ -351,8 +676,8 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* roo
         return ret;
     } */
 
-    sprintf(tmp, "dd if=%s/%s.img of=%s bs=4096", backup_path, name, get_dev_for_root(root));
-    if (0 != __system(tmp)) {
+    ui_show_progress(NANDROID_PARTITION_PROGRESS, 0);
+    if (0 != (ret = blockcopy_file_to_root(tmp, root, NULL))) {
         ui_print("Error while restoring %s!\n", mount_point);
         return ret;
     }
@@ -364,6 +689,12 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* roo
     return 0;
 }
 
+int nandroid_restore_partition_extended(const char* backup_path, const char* root, int umount_when_finished) {
+    if (0 != nandroid_verify_partition(backup_path, root))
+        return print_and_error("Restore aborted.\n");
+    return nandroid_restore_verified_partition(backup_path, root, umount_when_finished);
+}
+
 int nandroid_restore_partition(const char* backup_path, const char* root) {
     return nandroid_restore_partition_extended(backup_path, root, 1);
 }
@@ -376,25 +707,24 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     if (ensure_root_path_mounted("SDCARD:") != 0)
         return print_and_error("Can't mount /sdcard\n");
     
-    char tmp[PATH_MAX];
-
-    ui_print("Checking MD5 sums...\n");
-    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
-        return print_and_error("MD5 mismatch!\n");
-    
     int ret=0;
+
+    // Check every image before the first partition is formatted.
+    if ((restore_system && 0 != nandroid_verify_partition(backup_path, "SYSTEM:")) ||
+        (restore_data && 0 != nandroid_verify_partition(backup_path, "DATA:")) ||
+        (restore_cache && 0 != nandroid_verify_partition(backup_path, "CACHE:")))
+        return print_and_error("Restore aborted.\n");
     
-    if (restore_system && 0 != (ret = nandroid_restore_partition(backup_path, "SYSTEM:")))
+    if (restore_system && 0 != (ret = nandroid_restore_verified_partition(backup_path, "SYSTEM:", 1)))
         return ret;
 
-    if (restore_data && 0 != (ret = nandroid_restore_partition(backup_path, "DATA:")))
+    if (restore_data && 0 != (ret = nandroid_restore_verified_partition(backup_path, "DATA:", 1)))
         return ret;
 /*
     if (restore_data && 0 != (ret = nandroid_restore_partition_extended(backup_path, "SDCARD:/.android_secure", 0)))
         return ret;
 */
-    if (restore_cache && 0 != (ret = nandroid_restore_partition_extended(backup_path, "CACHE:", 0)))
+    if (restore_cache && 0 != (ret = nandroid_restore_verified_partition(backup_path, "CACHE:", 0)))
         return ret;
 
     sync();
@@ -430,6 +760,7 @@ int nandroid_usage()
 
 int nandroid_main(int argc, char** argv)
 {
+    nandroid_interactive = 0;
     if (argc > 3 || argc < 2)
         return nandroid_usage();
     
@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "blockcopy.h"
+#include "tarmanifest.h"
+
+typedef struct {
+    char *name;
+    char type;
+    uint64_t size;
+    long mtime;
+    int has_md5;
+    uint8_t md5[MD5_DIGEST_SIZE];
+    int seen;
+} ManifestEntry;
+
+struct TarManifest {
+    ManifestEntry *entries;
+    int count;
+    long started;       // when the backup that wrote it began
+};
+
+static int entry_compare(const void *a, const void *b)
+{
+    return strcmp(((const ManifestEntry *) a)->name, ((const ManifestEntry *) b)->name);
+}
+
+static ManifestEntry *find_entry(TarManifest *manifest, const char *name)
+{
+    ManifestEntry key;
+    key.name = (char *) name;
+    return bsearch(&key, manifest->entries, manifest->count,
+                   sizeof(ManifestEntry), entry_compare);
+}
+
+static char entry_type(mode_t mode)
+{
+    if (S_ISREG(mode)) return 'f';
+    if (S_ISDIR(mode)) return 'd';
+    if (S_ISLNK(mode)) return 'l';
+    if (S_ISCHR(mode)) return 'c';
+    if (S_ISBLK(mode)) return 'b';
+    return 'p';
+}
+
+static int parse_md5(const char *hex, uint8_t *md5)
+{
+    int i;
+    unsigned int byte;
+    if (strlen(hex) != MD5_DIGEST_SIZE * 2) return -1;
+    for (i = 0; i < MD5_DIGEST_SIZE; ++i) {
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) return -1;
+        md5[i] = byte;
+    }
+    return 0;
+}
+
+TarManifest *tar_manifest_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return NULL;
+
+    TarManifest *manifest = calloc(1, sizeof(TarManifest));
+    struct stat st;
+    // Manifests without a start line: the file's mtime is the best guess.
+    if (manifest != NULL && fstat(fileno(f), &st) == 0) manifest->started = st.st_mtime;
+    int alloc = 0;
+    char line[PATH_MAX + 128];
+    while (manifest != NULL && fgets(line, sizeof(line), f) != NULL) {
+        char type;
+        unsigned long long size;
+        long mtime;
+        char hex[MD5_DIGEST_SIZE * 2 + 2];
+        int name_start;
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (sscanf(line, "started %ld", &mtime) == 1) {
+            manifest->started = mtime;
+            continue;
+        }
+        if (sscanf(line, "%c %llu %ld %33s %n", &type, &size, &mtime, hex, &name_start) != 4 ||
+                line[name_start] == '\0') {
+            continue;
+        }
+
+        if (manifest->count == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            ManifestEntry *entries = realloc(manifest->entries, alloc * sizeof(ManifestEntry));
+            if (entries == NULL) {
+                tar_manifest_free(manifest);
+                manifest = NULL;
+                break;
+            }
+            manifest->entries = entries;
+        }
+        ManifestEntry *e = &manifest->entries[manifest->count];
+        memset(e, 0, sizeof(*e));
+        e->type = type;
+        e->size = size;
+        e->mtime = mtime;
+        e->has_md5 = parse_md5(hex, e->md5) == 0;
+        if ((e->name = strdup(line + name_start)) == NULL) continue;
+        manifest->count++;
+    }
+    fclose(f);
+
+    if (manifest != NULL) {
+        qsort(manifest->entries, manifest->count, sizeof(ManifestEntry), entry_compare);
+    }
+    return manifest;
+}
+
+void tar_manifest_free(TarManifest *manifest)
+{
+    int i;
+    if (manifest == NULL) return;
+    for (i = 0; i < manifest->count; ++i) free(manifest->entries[i].name);
+    free(manifest->entries);
+    free(manifest);
+}
+
+/* State of one backup, shared by the tar source hooks.  They run on the
+ * block copier's reader thread, one at a time.
+ */
+typedef struct {
+    TarManifest *parent;
+    FILE *out;
+    int error;
+} ManifestWriter;
+
+static int file_md5(const char *path, uint8_t *md5)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return -1;
+    char *data = malloc(BLOCKCOPY_CHUNK_SIZE);
+    MD5_CTX ctx;
+    size_t r;
+    MD5_init(&ctx);
+    while (data != NULL && (r = fread(data, 1, BLOCKCOPY_CHUNK_SIZE, f)) > 0) {
+        MD5_update(&ctx, data, r);
+    }
+    int ret = data != NULL && !ferror(f) ? 0 : -1;
+    fclose(f);
+    free(data);
+    if (ret == 0) memcpy(md5, MD5_final(&ctx), MD5_DIGEST_SIZE);
+    return ret;
+}
+
+/* Size and mtime say a file is unchanged, except for one modified no
+ * earlier than the second the parent backup started in: it may have
+ * been written again after the parent read it, within the same second.
+ * Those are compared by content against the digest in the manifest.
+ */
+static int manifest_unchanged(void *cookie, const char *name, const struct stat *st)
+{
+    ManifestWriter *w = (ManifestWriter *) cookie;
+    if (w->parent == NULL) return 0;
+    ManifestEntry *e = find_entry(w->parent, name);
+    if (e == NULL || e->type != 'f' || !e->has_md5 ||
+            e->size != (uint64_t) st->st_size || e->mtime != (long) st->st_mtime) {
+        return 0;
+    }
+    if ((long) st->st_mtime < w->parent->started) return 1;
+
+    char path[PATH_MAX];
+    uint8_t md5[MD5_DIGEST_SIZE];
+    snprintf(path, sizeof(path), "/%s", name);
+    return file_md5(path, md5) == 0 && memcmp(md5, e->md5, MD5_DIGEST_SIZE) == 0;
+}
+
+static void manifest_entry(void *cookie, const char *name, const struct stat *st,
+        const uint8_t *md5)
+{
+    ManifestWriter *w = (ManifestWriter *) cookie;
+    ManifestEntry *e = w->parent != NULL ? find_entry(w->parent, name) : NULL;
+    if (e != NULL) {
+        e->seen = 1;
+        // Left out as unchanged: the digest carries over.
+        if (md5 == NULL && S_ISREG(st->st_mode) && e->has_md5) md5 = e->md5;
+    }
+
+    char hex[MD5_DIGEST_SIZE * 2 + 1];
+    if (md5 != NULL) {
+        MD5_hex(md5, hex);
+    } else {
+        strcpy(hex, "-");
+    }
+    if (fprintf(w->out, "%c %llu %ld %s %s\n", entry_type(st->st_mode),
+                (unsigned long long) (S_ISREG(st->st_mode) ? st->st_size : 0),
+                (long) st->st_mtime, hex, name) < 0) {
+        w->error = 1;
+    }
+}
+
+static int write_deleted(TarManifest *parent, const char *deleted_path)
+{
+    FILE *f = fopen(deleted_path, "w");
+    if (f == NULL) return -1;
+    int i;
+    int count = 0;
+    for (i = 0; i < parent->count; ++i) {
+        if (!parent->entries[i].seen) {
+            fprintf(f, "%s\n", parent->entries[i].name);
+            ++count;
+        }
+    }
+    if (count > 0) ui_print("%d entries removed since the last backup\n", count);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+int tar_manifest_backup(const char *dir, const char *exclude, const char *archive,
+        const char *manifest_path, TarManifest *parent, const char *deleted_path)
+{
+    ManifestWriter w;
+    w.parent = parent;
+    w.error = 0;
+    w.out = fopen(manifest_path, "w");
+    if (w.out == NULL) {
+        LOGE("Can't create %s\n(%s)\n", manifest_path, strerror(errno));
+        return -1;
+    }
+
+    int i;
+    if (parent != NULL) {
+        for (i = 0; i < parent->count; ++i) parent->entries[i].seen = 0;
+    }
+    if (fprintf(w.out, "started %ld\n", (long) time(NULL)) < 0) w.error = 1;
+
+    BlockCopyTarHooks hooks;
+    hooks.unchanged = manifest_unchanged;
+    hooks.entry = manifest_entry;
+    hooks.cookie = &w;
+    int ret = blockcopy_tar_create(dir, exclude, &hooks, archive, NULL, NULL);
+
+    if (fclose(w.out) || w.error) {
+        LOGE("Error writing %s\n", manifest_path);
+        ret = -1;
+    }
+    if (ret == 0 && parent != NULL && write_deleted(parent, deleted_path)) {
+        LOGE("Error writing %s\n", deleted_path);
+        ret = -1;
+    }
+    if (ret != 0) unlink(manifest_path);
+    return ret;
+}
+
+static int reverse_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) b, *(char * const *) a);
+}
+
+int tar_manifest_apply_deleted(const char *deleted_path, const char *dest)
+{
+    FILE *f = fopen(deleted_path, "r");
+    if (f == NULL) {
+        LOGE("Can't open %s\n(%s)\n", deleted_path, strerror(errno));
+        return -1;
+    }
+
+    char **names = NULL;
+    int count = 0;
+    int alloc = 0;
+    int ret = 0;
+    char line[PATH_MAX];
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0) continue;
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            char **n = realloc(names, alloc * sizeof(char *));
+            if (n == NULL) {
+                ret = -1;
+                break;
+            }
+            names = n;
+        }
+        if ((names[count] = strdup(line)) == NULL) {
+            ret = -1;
+            break;
+        }
+        ++count;
+    }
+    if (ferror(f)) ret = -1;
+    fclose(f);
+    if (ret != 0) LOGE("Can't read %s\n", deleted_path);
+
+    // Reverse order puts everything in a directory before the directory.
+    if (ret == 0) qsort(names, count, sizeof(char *), reverse_compare);
+    const char *sep = dest[0] != '\0' && dest[strlen(dest) - 1] == '/' ? "" : "/";
+    int i;
+    for (i = 0; i < count; ++i) {
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s%s%s", dest, sep, names[i]);
+        if (ret == 0 && lstat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode) ? rmdir(path) : unlink(path)) {
+                LOGW("Can't remove %s (%s)\n", path, strerror(errno));
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
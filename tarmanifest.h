@@ -0,0 +1,41 @@
+#ifndef TARMANIFEST_H
+#define TARMANIFEST_H
+
+/* Manifests for incremental tar backups.
+ *
+ * Every tar backup of a partition writes <name>.manifest next to
+ * <name>.tar, starting with the time the backup began and then one line
+ * per entry on the partition:
+ *
+ *     started <time>
+ *     <type> <size> <mtime> <md5 or -> <name>
+ *
+ * An incremental backup compares the partition against the manifest of
+ * an earlier backup and only archives regular files whose size or mtime
+ * changed, or whose contents no longer match the digest when the mtime
+ * is too recent to go by (directories, links and nodes are always
+ * archived; they carry no data).  Entries that have disappeared are
+ * listed in <name>.deleted, and <name>.parent names the backup directory
+ * the increment applies to.
+ */
+
+typedef struct TarManifest TarManifest;
+
+TarManifest *tar_manifest_load(const char *path);
+void tar_manifest_free(TarManifest *manifest);
+
+/* Archive the tree at dir into archive, writing a manifest of it to
+ * manifest_path.  If parent is not NULL, files unchanged since parent
+ * are left out and the names of entries gone since then are written to
+ * deleted_path.  Returns 0 on success.
+ */
+int tar_manifest_backup(const char *dir, const char *exclude, const char *archive,
+        const char *manifest_path, TarManifest *parent, const char *deleted_path);
+
+/* Remove the entries listed in a deletion list from below dest.  Returns
+ * -1, having removed nothing, if the list can't be read; entries that
+ * can't be removed are only warned about.
+ */
+int tar_manifest_apply_deleted(const char *deleted_path, const char *dest);
+
+#endif
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <linux/input.h>
 #include <pthread.h>
 #include <stdarg.h>
@@ -47,6 +48,10 @@ static int gShowBackButton = 0;
 #define PROGRESSBAR_INDETERMINATE_STATES 6
 #define PROGRESSBAR_INDETERMINATE_FPS 15
 
+// The render thread redraws at most this often; changes made in between
+// are coalesced into the next frame.
+#define SCREEN_UPDATE_FPS 30
+
 static pthread_mutex_t gUpdateMutex = PTHREAD_MUTEX_INITIALIZER;
 static gr_surface gBackgroundIcon[NUM_BACKGROUND_ICONS];
 static gr_surface gProgressBarIndeterminate[PROGRESSBAR_INDETERMINATE_STATES];
@@ -80,9 +85,44 @@ static enum ProgressBarType {
 static float gProgressScopeStart = 0, gProgressScopeSize = 0, gProgress = 0;
 static time_t gProgressScopeTime, gProgressScopeDuration;
 
+// Signalled when something the progress thread animates may have started
+static pthread_cond_t gProgressCond = PTHREAD_COND_INITIALIZER;
+
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
 
+// Redraws waiting for the render thread, which sleeps on gRenderCond
+#define UPDATE_PROGRESS 1       // only the progress bar changed
+#define UPDATE_ROWS     2       // only gRowsTop..gRowsBottom changed
+#define UPDATE_SCREEN   4       // anything else changed
+static pthread_cond_t gRenderCond = PTHREAD_COND_INITIALIZER;
+static int gPendingUpdate = 0;
+static int gRowsTop, gRowsBottom;
+
+// Timed waits run on CLOCK_MONOTONIC, so setting the date can't stall
+// the UI.  Older bionic has no pthread_condattr_setclock() but a
+// monotonic variant of pthread_cond_timedwait() instead.
+static void init_monotonic_cond(pthread_cond_t *cond)
+{
+#ifndef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+}
+
+static int timedwait_monotonic(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                               const struct timespec *deadline)
+{
+#ifdef HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC
+    return pthread_cond_timedwait_monotonic(cond, mutex, deadline);
+#else
+    return pthread_cond_timedwait(cond, mutex, deadline);
+#endif
+}
+
 // Log text overlay, displayed when a magic key is pressed
 static char text[MAX_ROWS][MAX_COLS];
 static int text_cols = 0, text_rows = 0;
@@ -94,6 +134,18 @@ static int show_menu = 0;
 static int menu_top = 0, menu_items = 0, menu_sel = 0;
 static int menu_show_start = 0;             // this is line which menu display is starting at 
 
+// The progress bar rectangle as the last full redraw left it, rendered
+// twice: with the bar completely full and completely empty, each over
+// the background icon and under the dimmed text overlay and console.
+// A progress tick splices the two at the new position instead of
+// redrawing the screen.
+static struct {
+    int valid;
+    int x, y, w, h;
+    gr_pixel *full, *empty, *out;
+} gBarLayers;
+static int gBarLayerBuilding = 0;   // 1 draws the bar full, 2 empty
+
 // Key event input queue
 static pthread_mutex_t key_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t key_queue_cond = PTHREAD_COND_INITIALIZER;
@@ -117,23 +169,41 @@ static void draw_background_locked(gr_surface icon)
     }
 }
 
+// Where the progress bar goes on the screen.
+static void progress_rect(int *dx, int *dy, int *width, int *height)
+{
+    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
+    *width = gr_get_width(gProgressBarEmpty);
+    *height = gr_get_height(gProgressBarEmpty);
+
+    *dx = (gr_fb_width() - *width)/2;
+    *dy = (3*gr_fb_height() + iconHeight - 2*(*height))/4;
+}
+
 // Draw the progress bar (if any) on the screen.  Does not flip pages.
 // Should only be called with gUpdateMutex locked.
 static void draw_progress_locked()
 {
-    if (gProgressBarType == PROGRESSBAR_TYPE_NONE) return;
+    if (gProgressBarType == PROGRESSBAR_TYPE_NONE && !gBarLayerBuilding) return;
 
-    int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
-    int width = gr_get_width(gProgressBarEmpty);
-    int height = gr_get_height(gProgressBarEmpty);
-
-    int dx = (gr_fb_width() - width)/2;
-    int dy = (3*gr_fb_height() + iconHeight - 2*height)/4;
+    int dx, dy, width, height;
+    progress_rect(&dx, &dy, &width, &height);
 
     // Erase behind the progress bar (in case this was a progress-only update)
     gr_color(0, 0, 0, 255);
     gr_fill(dx, dy, width, height);
 
+    if (gBarLayerBuilding) {
+        int pos = gBarLayerBuilding == 1 ? width : 0;
+        if (pos > 0) {
+          gr_blit(gProgressBarFill, 0, 0, pos, height, dx, dy);
+        }
+        if (pos < width-1) {
+          gr_blit(gProgressBarEmpty, pos, 0, width-pos, height, dx+pos, dy);
+        }
+        return;
+    }
+
     if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL) {
         float progress = gProgressScopeStart + gProgress * gProgressScopeSize;
         int pos = (int) (progress * width);
@@ -217,22 +287,119 @@ static void draw_screen_locked(void)
     }
 }
 
+// Render the progress bar rectangle full and empty into gBarLayers,
+// leaving the screen as it was.  Call right after a full redraw.
+// Should only be called with gUpdateMutex locked.
+static void cache_progress_layers_locked(void)
+{
+    int x, y, w, h;
+    gBarLayers.valid = 0;
+    if (gProgressBarEmpty == NULL || gProgressBarFill == NULL) return;
+    progress_rect(&x, &y, &w, &h);
+    if (x < 0 || y < 0 || x + w > gr_fb_width() || y + h > gr_fb_height()) {
+        return;
+    }
+
+    if (w * h != gBarLayers.w * gBarLayers.h) {
+        free(gBarLayers.full);
+        free(gBarLayers.empty);
+        free(gBarLayers.out);
+        gBarLayers.full = malloc(w * h * sizeof(gr_pixel));
+        gBarLayers.empty = malloc(w * h * sizeof(gr_pixel));
+        gBarLayers.out = malloc(w * h * sizeof(gr_pixel));
+        if (!gBarLayers.full || !gBarLayers.empty || !gBarLayers.out) {
+            free(gBarLayers.full);
+            free(gBarLayers.empty);
+            free(gBarLayers.out);
+            gBarLayers.full = gBarLayers.empty = gBarLayers.out = NULL;
+            gBarLayers.w = gBarLayers.h = 0;
+            return;
+        }
+    }
+    gBarLayers.x = x;
+    gBarLayers.y = y;
+    gBarLayers.w = w;
+    gBarLayers.h = h;
+
+    // The frame we just drew still has to reach the screen; keep its
+    // bar and put it back afterwards.
+    gr_get_pixels(x, y, w, h, gBarLayers.out);
+
+    int identical = gPagesIdentical;
+    gr_clip(x, y, w, h);
+    gBarLayerBuilding = 1;
+    draw_screen_locked();
+    gr_get_pixels(x, y, w, h, gBarLayers.full);
+    gBarLayerBuilding = 2;
+    draw_screen_locked();
+    gr_get_pixels(x, y, w, h, gBarLayers.empty);
+    gBarLayerBuilding = 0;
+    gr_noclip();
+    gPagesIdentical = identical;
+
+    gr_put_pixels(x, y, w, h, gBarLayers.out);
+    gBarLayers.valid = 1;
+}
+
+// Splice the cached layers at the current progress and flip.
+// Should only be called with gUpdateMutex locked.
+static void compose_progress_locked(void)
+{
+    int w = gBarLayers.w, h = gBarLayers.h;
+    float progress = gProgressScopeStart + gProgress * gProgressScopeSize;
+    int pos = (int) (progress * w);
+    int row;
+    if (pos < 0) pos = 0;
+    if (pos > w) pos = w;
+
+    for (row = 0; row < h; ++row) {
+        gr_pixel *out = gBarLayers.out + row * w;
+        memcpy(out, gBarLayers.full + row * w, pos * sizeof(gr_pixel));
+        memcpy(out + pos, gBarLayers.empty + row * w + pos,
+               (w - pos) * sizeof(gr_pixel));
+    }
+    gr_put_pixels(gBarLayers.x, gBarLayers.y, w, h, gBarLayers.out);
+    gr_flip();
+}
+
 // Redraw everything on the screen and flip the screen (make it visible).
 // Should only be called with gUpdateMutex locked.
 static void update_screen_locked(void)
 {
     if (!ui_has_initialized) return;
     draw_screen_locked();
+    cache_progress_layers_locked();
     gr_flip();
 }
 
+// Redraws only the band of text rows asked for, and flips.
+// Should only be called with gUpdateMutex locked.
+static void update_rows_locked(void)
+{
+    if (!ui_has_initialized) return;
+    gr_clip(0, gRowsTop, gr_fb_width(), gRowsBottom - gRowsTop);
+    draw_screen_locked();
+    gr_noclip();
+    gr_flip();
+
+    // The rows may have drawn over the bar; its layers are stale.
+    if (gRowsBottom > gBarLayers.y && gRowsTop < gBarLayers.y + gBarLayers.h) {
+        gBarLayers.valid = 0;
+    }
+}
+
 // Updates only the progress bar, if possible, otherwise redraws the screen.
 // Should only be called with gUpdateMutex locked.
 static void update_progress_locked(void)
 {
     if (!ui_has_initialized) return;
+    if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && gBarLayers.valid) {
+        compose_progress_locked();
+        return;
+    }
     if (show_text || !gPagesIdentical) {
         draw_screen_locked();    // Must redraw the whole screen
+        cache_progress_layers_locked();
         gPagesIdentical = 1;
     } else {
         draw_progress_locked();  // Draw only the progress bar
@@ -240,17 +407,118 @@ static void update_progress_locked(void)
     gr_flip();
 }
 
+// Ask the render thread to redraw; returns without drawing anything.
+// Should only be called with gUpdateMutex locked.
+static void request_update_locked(int what)
+{
+    if (!ui_has_initialized) return;
+    if (!gPendingUpdate) pthread_cond_signal(&gRenderCond);
+    gPendingUpdate |= what;
+}
+
+// Ask for just one row of the text overlay (plus the menu highlight
+// around it) to be redrawn.
+// Should only be called with gUpdateMutex locked.
+static void request_row_update_locked(int row)
+{
+    int top = row * CHAR_HEIGHT;
+    int bottom = (row + 1) * CHAR_HEIGHT + 1;
+    if (!(gPendingUpdate & UPDATE_ROWS)) {
+        gRowsTop = top;
+        gRowsBottom = bottom;
+    } else {
+        if (top < gRowsTop) gRowsTop = top;
+        if (bottom > gRowsBottom) gRowsBottom = bottom;
+    }
+    request_update_locked(UPDATE_ROWS);
+}
+
+// Draws whatever request_update_locked() asked for, no more than
+// SCREEN_UPDATE_FPS times a second, so callers never pay for a redraw.
+static void *render_thread(void *cookie)
+{
+    const long frame_ns = 1000000000L / SCREEN_UPDATE_FPS;
+    struct timespec next = { 0, 0 };
+
+    pthread_mutex_lock(&gUpdateMutex);
+    for (;;) {
+        while (!gPendingUpdate) {
+            pthread_cond_wait(&gRenderCond, &gUpdateMutex);
+        }
+
+        // Let anything else that changes before the next frame is due
+        // pile into this one.
+        for (;;) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > next.tv_sec ||
+                (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec)) {
+                next = now;
+                break;
+            }
+            timedwait_monotonic(&gRenderCond, &gUpdateMutex, &next);
+        }
+
+        // The progress bar sits under the text overlay, so it can't be
+        // redrawn on its own alongside a band of rows.
+        int what = gPendingUpdate;
+        gPendingUpdate = 0;
+        if ((what & UPDATE_SCREEN) ||
+            what == (UPDATE_ROWS | UPDATE_PROGRESS)) {
+            update_screen_locked();
+        } else if (what & UPDATE_ROWS) {
+            update_rows_locked();
+        } else {
+            update_progress_locked();
+        }
+
+        next.tv_nsec += frame_ns;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+    }
+    return NULL;
+}
+
+// True while progress_thread() has something to move: an indeterminate
+// bar that's on screen, or a timed scope that hasn't run out yet.
+// Should only be called with gUpdateMutex locked.
+static int progress_animating_locked(void)
+{
+    if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) return !show_text;
+    return gProgressBarType == PROGRESSBAR_TYPE_NORMAL &&
+           gProgressScopeDuration > 0 && gProgress < 1.0;
+}
+
 // Keeps the progress bar updated, even when the process is otherwise busy.
+// Sleeps on gProgressCond whenever there's nothing to animate.
 static void *progress_thread(void *cookie)
 {
+    const long tick_ns = 1000000000L / PROGRESSBAR_INDETERMINATE_FPS;
+
+    pthread_mutex_lock(&gUpdateMutex);
     for (;;) {
-        usleep(1000000 / PROGRESSBAR_INDETERMINATE_FPS);
-        pthread_mutex_lock(&gUpdateMutex);
+        while (!progress_animating_locked()) {
+            pthread_cond_wait(&gProgressCond, &gUpdateMutex);
+        }
+
+        struct timespec tick;
+        clock_gettime(CLOCK_MONOTONIC, &tick);
+        tick.tv_nsec += tick_ns;
+        if (tick.tv_nsec >= 1000000000L) {
+            tick.tv_sec++;
+            tick.tv_nsec -= 1000000000L;
+        }
+        while (progress_animating_locked() &&
+               timedwait_monotonic(&gProgressCond, &gUpdateMutex,
+                                   &tick) != ETIMEDOUT) {
+        }
 
         // update the progress bar animation, if active
         // skip this if we have a text overlay (too expensive to update)
         if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE && !show_text) {
-            update_progress_locked();
+            request_update_locked(UPDATE_PROGRESS);
         }
 
         // move the progress bar forward on timed intervals, if configured
@@ -261,12 +529,11 @@ static void *progress_thread(void *cookie)
             if (progress > 1.0) progress = 1.0;
             if (progress > gProgress) {
                 gProgress = progress;
-                update_progress_locked();
+                request_update_locked(UPDATE_PROGRESS);
             }
         }
-
-        pthread_mutex_unlock(&gUpdateMutex);
     }
+    pthread_mutex_unlock(&gUpdateMutex);
     return NULL;
 }
 
@@ -327,7 +594,8 @@ static void *input_thread(void *cookie)
         if (ev.value > 0 && device_toggle_display(key_pressed, ev.code)) {
             pthread_mutex_lock(&gUpdateMutex);
             show_text = !show_text;
-            update_screen_locked();
+            request_update_locked(UPDATE_SCREEN);
+            pthread_cond_signal(&gProgressCond);
             pthread_mutex_unlock(&gUpdateMutex);
         }
 
@@ -365,7 +633,11 @@ void ui_init(void)
         }
     }
 
+    init_monotonic_cond(&gRenderCond);
+    init_monotonic_cond(&gProgressCond);
+
     pthread_t t;
+    pthread_create(&t, NULL, render_thread, NULL);
     pthread_create(&t, NULL, progress_thread, NULL);
     pthread_create(&t, NULL, input_thread, NULL);
 }
@@ -373,6 +645,7 @@ void ui_init(void)
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     pthread_mutex_lock(&gUpdateMutex);
     draw_background_locked(gBackgroundIcon[icon]);
+    gBarLayers.valid = 0;
     *width = gr_fb_width();
     *height = gr_fb_height();
     *bpp = sizeof(gr_pixel) * 8;
@@ -391,7 +664,7 @@ void ui_set_background(int icon)
 {
     pthread_mutex_lock(&gUpdateMutex);
     gCurrentIcon = gBackgroundIcon[icon];
-    update_screen_locked();
+    request_update_locked(UPDATE_SCREEN);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -399,7 +672,7 @@ void ui_clear_backgroud()
 {
     pthread_mutex_lock(&gUpdateMutex);
     gCurrentIcon = NULL;
-    update_screen_locked();
+    request_update_locked(UPDATE_SCREEN);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -408,7 +681,8 @@ void ui_show_indeterminate_progress()
     pthread_mutex_lock(&gUpdateMutex);
     if (gProgressBarType != PROGRESSBAR_TYPE_INDETERMINATE) {
         gProgressBarType = PROGRESSBAR_TYPE_INDETERMINATE;
-        update_progress_locked();
+        request_update_locked(UPDATE_PROGRESS);
+        pthread_cond_signal(&gProgressCond);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -422,7 +696,8 @@ void ui_show_progress(float portion, int seconds)
     gProgressScopeTime = time(NULL);
     gProgressScopeDuration = seconds;
     gProgress = 0;
-    update_progress_locked();
+    request_update_locked(UPDATE_PROGRESS);
+    pthread_cond_signal(&gProgressCond);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -437,7 +712,7 @@ void ui_set_progress(float fraction)
         float scale = width * gProgressScopeSize;
         if ((int) (gProgress * scale) != (int) (fraction * scale)) {
             gProgress = fraction;
-            update_progress_locked();
+            request_update_locked(UPDATE_PROGRESS);
         }
     }
     pthread_mutex_unlock(&gUpdateMutex);
@@ -450,7 +725,7 @@ void ui_reset_progress()
     gProgressScopeStart = gProgressScopeSize = 0;
     gProgressScopeTime = gProgressScopeDuration = 0;
     gProgress = 0;
-    update_screen_locked();
+    request_update_locked(UPDATE_SCREEN);
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
@@ -482,7 +757,7 @@ void ui_print(const char *fmt, ...)
             if (*ptr != '\n' && *ptr != '\r') text[text_row][text_col++] = *ptr;
         }
         text[text_row][text_col] = '\0';
-        update_screen_locked();
+        request_update_locked(UPDATE_SCREEN);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -527,7 +802,7 @@ int ui_start_menu(char** headers, char** items) {
         menu_items = i - menu_top;
         show_menu = 1;
         menu_sel = menu_show_start = 0;
-        update_screen_locked();
+        request_update_locked(UPDATE_SCREEN);
     }
     pthread_mutex_unlock(&gUpdateMutex);
     if (gShowBackButton) {
@@ -537,10 +812,11 @@ int ui_start_menu(char** headers, char** items) {
 }
 
 int ui_menu_select(int sel) {
-    int old_sel;
+    int old_sel, old_show_start;
     pthread_mutex_lock(&gUpdateMutex);
     if (show_menu > 0) {
         old_sel = menu_sel;
+        old_show_start = menu_show_start;
         menu_sel = sel;
 
         int sel_direction = (sel > old_sel);
@@ -561,7 +837,15 @@ int ui_menu_select(int sel) {
 
         sel = menu_sel;
 
-        if (menu_sel != old_sel) update_screen_locked();
+        if (menu_sel != old_sel) {
+            if (menu_show_start == old_show_start) {
+                // Only the highlight moved; redraw the two rows it touched.
+                request_row_update_locked(menu_top + old_sel - menu_show_start);
+                request_row_update_locked(menu_top + menu_sel - menu_show_start);
+            } else {
+                request_update_locked(UPDATE_SCREEN);
+            }
+        }
     }
     pthread_mutex_unlock(&gUpdateMutex);
     return sel;
@@ -572,7 +856,7 @@ void ui_end_menu() {
     pthread_mutex_lock(&gUpdateMutex);
     if (show_menu > 0 && text_rows > 0 && text_cols > 0) {
         show_menu = 0;
-        update_screen_locked();
+        request_update_locked(UPDATE_SCREEN);
     }
     pthread_mutex_unlock(&gUpdateMutex);
 }
@@ -611,7 +895,11 @@ void ui_clear_key_queue() {
 }
 
 void ui_set_show_text(int value) {
+    pthread_mutex_lock(&gUpdateMutex);
     show_text = value;
+    gBarLayers.valid = 0;
+    pthread_cond_signal(&gProgressCond);
+    pthread_mutex_unlock(&gUpdateMutex);
 }
 
 void ui_set_showing_back_button(int showBackButton) {
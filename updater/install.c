@@ -29,6 +29,7 @@
 
 #include "cutils/misc.h"
 #include "cutils/properties.h"
+#include "digestutils/digest.h"
 #include "edify/expr.h"
 #include "mincrypt/sha.h"
 #include "minzip/DirUtil.h"
@@ -339,7 +340,8 @@ Value* PackageExtractDirFn(const char* name, State* state,
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                      MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_PARALLEL,
+                                      &timestamp,
                                       NULL, NULL);
     free(zip_path);
     free(dest_path);
@@ -463,17 +465,27 @@ Value* SymlinkFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
-Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* result = NULL;
+// The passes of one or more set_perm() and set_perm_recursive() calls,
+// applied together by a single walk.
+typedef struct {
+    DirPermissions* perms;
+    int count;
+    int alloc;
+} PermBatch;
+
+static bool AddPermissions(const char* name, State* state,
+                           int argc, Expr* argv[], PermBatch* batch) {
+    bool ok = false;
     bool recursive = (strcmp(name, "set_perm_recursive") == 0);
 
     int min_args = 4 + (recursive ? 1 : 0);
     if (argc < min_args) {
-        return ErrorAbort(state, "%s() expects %d+ args, got %d", name, argc);
+        ErrorAbort(state, "%s() expects %d+ args, got %d", name, min_args, argc);
+        return false;
     }
 
     char** args = ReadVarArgs(state, argc, argv);
-    if (args == NULL) return NULL;
+    if (args == NULL) return false;
 
     char* end;
     int i;
@@ -490,50 +502,187 @@ Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    int dir_mode;
+    int file_mode;
     if (recursive) {
-        int dir_mode = strtoul(args[2], &end, 0);
+        dir_mode = strtoul(args[2], &end, 0);
         if (*end != '\0' || args[2][0] == 0) {
             ErrorAbort(state, "%s: \"%s\" not a valid dirmode", name, args[2]);
             goto done;
         }
 
-        int file_mode = strtoul(args[3], &end, 0);
+        file_mode = strtoul(args[3], &end, 0);
         if (*end != '\0' || args[3][0] == 0) {
             ErrorAbort(state, "%s: \"%s\" not a valid filemode",
                        name, args[3]);
             goto done;
         }
-
-        for (i = 4; i < argc; ++i) {
-            dirSetHierarchyPermissions(args[i], uid, gid, dir_mode, file_mode);
-        }
     } else {
-        int mode = strtoul(args[2], &end, 0);
+        file_mode = dir_mode = strtoul(args[2], &end, 0);
         if (*end != '\0' || args[2][0] == 0) {
             ErrorAbort(state, "%s: \"%s\" not a valid mode", name, args[2]);
             goto done;
         }
+    }
 
-        for (i = 3; i < argc; ++i) {
-            if (chown(args[i], uid, gid) < 0) {
-                fprintf(stderr, "%s: chown of %s to %d %d failed: %s\n",
-                        name, args[i], uid, gid, strerror(errno));
-            }
-            if (chmod(args[i], mode) < 0) {
-                fprintf(stderr, "%s: chmod of %s to %o failed: %s\n",
-                        name, args[i], mode, strerror(errno));
+    for (i = min_args - 1; i < argc; ++i) {
+        if (batch->count == batch->alloc) {
+            int alloc = batch->alloc ? batch->alloc * 2 : 16;
+            DirPermissions* perms = realloc(batch->perms,
+                                            alloc * sizeof(DirPermissions));
+            if (perms == NULL) {
+                ErrorAbort(state, "%s: out of memory", name);
+                goto done;
             }
+            batch->perms = perms;
+            batch->alloc = alloc;
         }
+        DirPermissions* p = &batch->perms[batch->count++];
+        p->path = args[i];
+        args[i] = NULL;
+        p->uid = uid;
+        p->gid = gid;
+        p->dirMode = dir_mode;
+        p->fileMode = file_mode;
+        p->recursive = recursive;
     }
-    result = strdup("");
+    ok = true;
 
 done:
     for (i = 0; i < argc; ++i) {
         free(args[i]);
     }
     free(args);
+    return ok;
+}
 
-    return StringValue(result);
+static void PermissionFailed(void* cookie, const char* path,
+                             const char* what, int err) {
+    fprintf(stderr, "%s: %s of %s failed: %s\n",
+            (const char*) cookie, what, path, strerror(err));
+}
+
+// Every failure, out of memory included, goes through PermissionFailed().
+static void ApplyPermissions(const char* name, PermBatch* batch) {
+    if (batch->count > 0) {
+        dirSetPermissionsBatch(batch->perms, batch->count,
+                               DIR_PERMS_SKIP_UNCHANGED,
+                               PermissionFailed, (void*) name);
+    }
+}
+
+static void FreePermissions(PermBatch* batch) {
+    int i;
+    for (i = 0; i < batch->count; ++i) {
+        free((char*) batch->perms[i].path);
+    }
+    free(batch->perms);
+}
+
+Value* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
+    PermBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    bool ok = AddPermissions(name, state, argc, argv, &batch);
+    if (ok) {
+        ApplyPermissions(name, &batch);
+    }
+    FreePermissions(&batch);
+    return ok ? StringValue(strdup("")) : NULL;
+}
+
+// set_perm_batch(call, ...) applies the passes of several set_perm()
+// and set_perm_recursive() calls in one walk.  Scripts don't call it
+// directly; BatchPermissionCalls() puts it in.
+Value* SetPermBatchFn(const char* name, State* state, int argc, Expr* argv[]) {
+    PermBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    int i;
+    for (i = 0; i < argc; ++i) {
+        if (!AddPermissions(argv[i]->name, state,
+                            argv[i]->argc, argv[i]->argv, &batch)) {
+            FreePermissions(&batch);
+            return NULL;
+        }
+    }
+    ApplyPermissions(name, &batch);
+    FreePermissions(&batch);
+    return StringValue(strdup(""));
+}
+
+static bool IsLiteralPermCall(const Expr* expr) {
+    if (expr->fn != SetPermFn) return false;
+    int i;
+    for (i = 0; i < expr->argc; ++i) {
+        if (expr->argv[i]->fn != Literal) return false;
+    }
+    return true;
+}
+
+static bool CollectStatements(Expr* expr, Expr*** list, int* count, int* alloc) {
+    if (expr->fn == SequenceFn) {
+        return CollectStatements(expr->argv[0], list, count, alloc) &&
+               CollectStatements(expr->argv[1], list, count, alloc);
+    }
+    if (*count == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 64;
+        Expr** l = realloc(*list, *alloc * sizeof(Expr*));
+        if (l == NULL) return false;
+        *list = l;
+    }
+    (*list)[(*count)++] = expr;
+    return true;
+}
+
+void BatchPermissionCalls(Expr* root) {
+    Expr** stmts = NULL;
+    int count = 0;
+    int alloc = 0;
+    int i, j, k;
+
+    if (!CollectStatements(root, &stmts, &count, &alloc)) {
+        free(stmts);
+        return;
+    }
+
+    for (i = 0; i < count; i = j) {
+        for (j = i; j < count && IsLiteralPermCall(stmts[j]); ++j) ;
+        if (j - i < 2) {
+            // Not a run; look for statement lists inside it instead.
+            if (j == i) {
+                for (k = 0; k < stmts[i]->argc; ++k) {
+                    BatchPermissionCalls(stmts[i]->argv[k]);
+                }
+                ++j;
+            }
+            continue;
+        }
+
+        // The first statement of the run becomes the batch, holding
+        // copies of the calls; the rest become empty literals.
+        Expr** calls = malloc((j - i) * sizeof(Expr*));
+        if (calls == NULL) continue;
+        for (k = i; k < j; ++k) {
+            calls[k - i] = malloc(sizeof(Expr));
+            if (calls[k - i] == NULL) break;
+            memcpy(calls[k - i], stmts[k], sizeof(Expr));
+        }
+        if (k < j) {
+            while (k > i) free(calls[--k - i]);
+            free(calls);
+            continue;
+        }
+        stmts[i]->fn = SetPermBatchFn;
+        stmts[i]->name = "set_perm_batch";
+        stmts[i]->argc = j - i;
+        stmts[i]->argv = calls;
+        for (k = i + 1; k < j; ++k) {
+            stmts[k]->fn = Literal;
+            stmts[k]->name = "";
+            stmts[k]->argc = 0;
+            stmts[k]->argv = NULL;
+        }
+    }
+    free(stmts);
 }
 
 
@@ -996,7 +1145,7 @@ Value* Sha1CheckFn(const char* name, State* state, int argc, Expr* argv[]) {
         return StringValue(strdup(""));
     }
     uint8_t digest[SHA_DIGEST_SIZE];
-    SHA(args[0]->data, args[0]->size, digest);
+    digest_sha1(args[0]->data, args[0]->size, digest);
     FreeValue(args[0]);
 
     if (argc == 1) {
@@ -1040,23 +1189,25 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* filename;
     if (ReadArgs(state, argv, 1, &filename) < 0) return NULL;
 
-    Value* v = malloc(sizeof(Value));
-    v->type = VAL_BLOB;
-
+    // Regular files are mapped rather than copied, so sha1_check() of a
+    // large system file hashes the page cache directly.
     FileContents fc;
-    if (LoadFileContents(filename, &fc) != 0) {
+    if (MapFileContents(filename, &fc) != 0) {
         ErrorAbort(state, "%s() loading \"%s\" failed: %s",
                    name, filename, strerror(errno));
         free(filename);
-        free(v);
-        free(fc.data);
         return NULL;
     }
+    free(filename);
 
+    if (fc.mapped) {
+        return MappedBlobValue((char*)fc.data, fc.size);
+    }
+
+    Value* v = malloc(sizeof(Value));
+    v->type = VAL_BLOB;
     v->size = fc.size;
     v->data = (char*)fc.data;
-
-    free(filename);
     return v;
 }
 
@@ -17,6 +17,12 @@
 #ifndef _UPDATER_INSTALL_H_
 #define _UPDATER_INSTALL_H_
 
+#include "edify/expr.h"
+
 void RegisterInstallFunctions();
 
+// Fold runs of set_perm() and set_perm_recursive() statements in the
+// parsed script into single walks.
+void BatchPermissionCalls(Expr* root);
+
 #endif
@@ -103,6 +103,8 @@ int main(int argc, char** argv) {
         return 6;
     }
 
+    BatchPermissionCalls(root);
+
     // Evaluate the parsed script.
 
     UpdaterInfo updater_info;
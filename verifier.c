@@ -18,12 +18,21 @@
 #include "verifier.h"
 
 #include "mincrypt/rsa.h"
-#include "mincrypt/sha.h"
+#include "digestutils/digest.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// The signed data is hashed this much at a time; the kernel is asked
+// to start reading the next window while the current one is hashed.
+#define HASH_WINDOW (1024 * 1024)
+
 // Look for an RSA signature embedded in the .ZIP file comment given
 // the path to the zip.  Verify it matches one of the given public
 // keys.
@@ -32,13 +41,31 @@
 // or no key matches the signature).
 
 int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
-
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
         LOGE("failed to open %s (%s)\n", path, strerror(errno));
         return VERIFY_FAILURE;
     }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOGE("failed to stat %s (%s)\n", path, strerror(errno));
+        close(fd);
+        return VERIFY_FAILURE;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOGE("failed to map %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+    int ret = verify_data(data, st.st_size, pKeys, numKeys);
+    munmap(data, st.st_size);
+    return ret;
+}
+
+int verify_data(const unsigned char* data, size_t length,
+                const RSAPublicKey *pKeys, unsigned int numKeys) {
+    ui_set_progress(0.0);
 
     // An archive with a whole-file signature will end in six bytes:
     //
@@ -51,33 +78,25 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
 
 #define FOOTER_SIZE 6
 
-    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (length < FOOTER_SIZE) {
+        LOGE("package is too small to be signed\n");
         return VERIFY_FAILURE;
     }
 
-    unsigned char footer[FOOTER_SIZE];
-    if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
-        LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* footer = data + length - FOOTER_SIZE;
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
-    int comment_size = footer[4] + (footer[5] << 8);
-    int signature_start = footer[0] + (footer[1] << 8);
+    size_t comment_size = footer[4] + (footer[5] << 8);
+    size_t signature_start = footer[0] + (footer[1] << 8);
     LOGI("comment is %d bytes; signature %d bytes from end\n",
-         comment_size, signature_start);
+         (int) comment_size, (int) signature_start);
 
-    if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
+    if (signature_start < FOOTER_SIZE + RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
@@ -87,9 +106,8 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
-    if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
+    if (eocd_size > length || signature_start > comment_size) {
+        LOGE("comment doesn't fit in the package\n");
         return VERIFY_FAILURE;
     }
 
@@ -97,30 +115,19 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = ftell(f) + EOCD_HEADER_SIZE - 2;
+    size_t signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
 
-    unsigned char* eocd = malloc(eocd_size);
-    if (eocd == NULL) {
-        LOGE("malloc for EOCD record failed\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-    if (fread(eocd, 1, eocd_size, f) != eocd_size) {
-        LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* eocd = data + length - eocd_size;
 
     // If this is really is the EOCD record, it will begin with the
     // magic number $50 $4b $05 $06.
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
         return VERIFY_FAILURE;
     }
 
-    int i;
+    size_t i;
     for (i = 4; i < eocd_size-3; ++i) {
         if (eocd[i  ] == 0x50 && eocd[i+1] == 0x4b &&
             eocd[i+2] == 0x05 && eocd[i+3] == 0x06) {
@@ -129,56 +136,50 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
             return VERIFY_FAILURE;
         }
     }
 
-#define BUFFER_SIZE 4096
-
-    SHA_CTX ctx;
-    SHA_init(&ctx);
-    unsigned char* buffer = malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    // Hash straight out of the mapping.  The pages stay in the page
+    // cache, so installing the package afterwards doesn't read it from
+    // storage again.
+    DigestSha1 ctx;
+    digest_sha1_init(&ctx);
 
+    // Page-align the readahead hints; data itself is page-aligned.
+    long page = sysconf(_SC_PAGESIZE);
     double frac = -1.0;
     size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
+    madvise((void*) data, signed_len < HASH_WINDOW ? signed_len : HASH_WINDOW,
+            MADV_WILLNEED);
     while (so_far < signed_len) {
-        int size = BUFFER_SIZE;
+        size_t size = HASH_WINDOW;
         if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
+        size_t next = so_far + size;
+        if (next < signed_len) {
+            size_t ahead = signed_len - next < HASH_WINDOW ? signed_len - next : HASH_WINDOW;
+            size_t start = next & ~(page - 1);
+            madvise((void*) (data + start), ahead + (next - start), MADV_WILLNEED);
         }
-        SHA_update(&ctx, buffer, size);
-        so_far += size;
+        digest_sha1_update(&ctx, data + so_far, size);
+        so_far = next;
         double f = so_far / (double)signed_len;
         if (f > frac + 0.02 || size == so_far) {
             ui_set_progress(f);
             frac = f;
         }
     }
-    fclose(f);
-    free(buffer);
 
-    const uint8_t* sha1 = SHA_final(&ctx);
+    const uint8_t* sha1 = digest_sha1_final(&ctx);
     for (i = 0; i < numKeys; ++i) {
         // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
         // the signing tool appends after the signature itself.
         if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
                        RSANUMBYTES, sha1)) {
             LOGI("whole-file signature verified\n");
-            free(eocd);
             return VERIFY_SUCCESS;
         }
     }
-    free(eocd);
     LOGE("failed to verify whole-file signature\n");
     return VERIFY_FAILURE;
 }